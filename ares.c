@@ -21,24 +21,38 @@
  */
 
 /*
- * TODO: highlight symbols, underline urls, undo and redo, handle widow resize,
+ * TODO: highlight symbols, underline urls,
  * better terminal management (make it like its own thing not just printed text
- * in the terminal). Fix git output showing throught editor (can be fixed by
- * fixing the previous todo)
+ * in the terminal).
  */
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #include "ares.h"
 
@@ -63,29 +77,619 @@ enum Highlight {
   HL_KEYWORD_PRIMARY,
   HL_KEYWORD_SECONDARY,
   HL_COMMENT,
-  HL_ML_COMMENT
+  HL_ML_COMMENT,
+  HL_BRACKET
 };
 
+enum LexKind {
+  LEX_LINE = 0,  // comment to the end of the row
+  LEX_BLOCK,  // comment that may span rows
+  LEX_NESTED,  // block comment counting the ones opened inside it
+  LEX_STRING,  // string ending with the row if it isn't closed
+  LEX_TEXT,  // string that may span rows
+  LEX_CHAR,  // one char or escape, else the open marker is just code
+  LEX_RAW  // string closed by the close marker and the delimiter it opened with
+};
+
+// A comment or string, from its open marker to its close marker.
+struct LexRule {
+  unsigned char kind;
+  unsigned char hl;
+  char esc;  // makes the next char part of the string, 0 for none
+  unsigned char spaced;  // only opens at the start of a row or after a blank
+  unsigned char word;  // the open marker starts with a word char
+  unsigned char olen, mlen, clen, slen;
+  char open[LEX_DELIM];
+  char mid[LEX_DELIM];  // raw strings: between the delimiter and the text
+  char close[LEX_DELIM];
+  char suffix[LEX_DELIM];  // raw strings: after the closing delimiter
+  unsigned char delim[256];  // raw strings: bytes the delimiter is made of
+};
+
+struct Keyword {
+  char* word;  // NULL for an empty slot
+  unsigned char len;
+  unsigned char hl;
+};
+
+/*
+ * A language, compiled from its definition into tables the lexer indexes by
+ * byte: what the byte may start in code, and per rule whether it may end
+ * the comment or string, so everything else is skipped without a compare.
+ */
 struct Syntax {
   char* filetype;
   char** filematch;
-  char** keywords;
-  char* singleline_comment_start;
-  char* multiline_comment_start;
-  char* multiline_comment_end;
-  int flags;
+  char* source;  // the definition text
+  int numbers;
+  int nrules;
+  struct LexRule rules[LEX_RULES];
+  unsigned char first[256];  // 1 + the first rule opening with the byte
+  unsigned char next[LEX_RULES];  // 1 + the next rule opening with that byte
+  unsigned char cls[256];  // LEX_WORD, LEX_DIGIT, ...
+  unsigned char stop[LEX_RULES][256];
+  struct Keyword* keywords;  // open addressing, kwmask + 1 slots
+  unsigned int kwmask;
+  int kwmax;  // longest keyword
+};
+
+/*
+ * Lexer state carried from one span of render text to the next: from a row
+ * to the row below it (only comments and strings that span rows survive
+ * that) and between the segments of a long row.
+ */
+struct LexState {
+  unsigned int state;  // see LEX_RULE, 0 in code
+  unsigned char prev_sep;  // the span doesn't start inside a word
+  unsigned char skip_hl;
+  unsigned char prev_word;  // the span starts inside a word
+  unsigned short skip;  // chars already coloured by a match past the span
+};
+
+/*
+ * A position in a row in all three coordinates: byte offset in chars, screen
+ * column, and byte offset in render (in the segment's render for long rows).
+ */
+struct ColPos {
+  int cx;
+  int rx;
+  int ri;
+};
+
+enum ColField { COL_CX = 0, COL_RX, COL_RI };
+
+/*
+ * Brackets outside strings and comments in a span of text, counting opens
+ * as +1 and closes as -1: the total and the lowest running total.
+ */
+struct Brackets {
+  int sum;
+  int min;
+};
+
+// Slice of a row longer than LONG_ROW, rendered and highlighted on its own.
+struct Segment {
+  int start;  // offset in chars, always on a char boundary
+  int len;
+  int rx;  // screen column of the first char, valid below rx_valid
+  int width;  // in screen columns
+  int rsize;  // in render bytes
+  int tabs;
+  int phase;  // rx % TAB_STOP that width was computed for, -1 after an edit
+  int stale;  // needs lexing again
+  struct LexState in;
+  struct Brackets br;
+  int* words;  // word index nodes of the words starting in the segment
+  int nwords;
+  char* render;  // only while on screen, with lookahead past the end
+  unsigned char* hl;
 };
 
 typedef struct erow {
-  int idx;
   int size;
   int rsize;
   char* chars;
   char* render;
   unsigned char* hl;
-  int hl_open_comment;
+  struct ColPos* marks;  // every COL_CHECKPOINT bytes, NULL for plain ASCII
+  int nmarks;
+  struct Segment* segs;  // long rows only, render and hl are then unused
+  int nsegs;
+  int* wraps;  // rx each visual line after the first starts at, NULL if full
+  int nlines;  // visual lines when soft wrapped
+  unsigned int wrap_gen;  // nlines and wraps are current if this is S.wrap.gen
+  int rx_valid;
+  int cached;
+  unsigned int hl_state;  // lexer state at the end of the row, see LEX_RULE
+  struct Brackets br;
+  int* words;  // word index nodes of the row's words, NULL for long rows
+  int nwords;
+  int stale;
+  unsigned int snap;
+  int head;
+  unsigned char diff;
+  unsigned char diff_stale;
 } erow;
 
+/*
+ * A save running on a background thread. rows is a snapshot of the row
+ * pointers taken when the save started; rows whose snap matches gen share
+ * their chars with it, so the editor copies a row before changing it
+ * (rowDetach) and parks the old buffer in orphans until the save is done.
+ */
+struct SaveRow {
+  char* chars;
+  int size;
+};
+
+struct SaveJob {
+  pthread_t thread;
+  int threaded;
+  int gzip;
+  unsigned int gen;
+  char* filename;
+  struct SaveRow* rows;
+  int numrows;
+  int dirty;
+  long long total;
+  long long journal_mark;
+  _Atomic long long written;
+  _Atomic int done;
+  int result;
+  int err;
+  char** orphans;
+  int norphans;
+  int orphancap;
+};
+
+/*
+ * Every buffer change boils down to one of these primitive row edits. They
+ * are what the swap file journal and the undo history record.
+ */
+enum EditOp {
+  EDIT_INSERT_ROW = 1,
+  EDIT_DEL_ROW,
+  EDIT_INSERT_TEXT,
+  EDIT_DEL_TEXT
+};
+
+/*
+ * Swap file: an append-only log of every primitive row edit made since the
+ * file was last saved, replayed on top of the file after a crash. Records
+ * are buffered in buf and written out by processBackground.
+ */
+
+struct Journal {
+  int fd;
+  char* path;
+  char* buf;
+  int len;
+  int cap;
+  long long size;
+  long long dirty_since;
+  int suspended;
+};
+
+/*
+ * Undo history. Each UndoOp is a forward edit; undo applies its inverse.
+ * Ops made by one command share a group and are undone together. ops is a
+ * queue starting at start so the oldest groups can be dropped cheaply once
+ * the history grows past UNDO_MEMORY_MAX bytes.
+ */
+struct UndoOp {
+  int op;
+  int row;
+  int col;
+  int len;
+  char* text;
+  unsigned int group;
+  int cx, cy;
+};
+
+struct UndoLog {
+  struct UndoOp* ops;
+  int start;
+  int len;
+  int cap;
+};
+
+struct Undo {
+  struct UndoLog done;
+  struct UndoLog undone;
+  unsigned int group;
+  int boundary;
+  int coalesce;
+  int applying;
+  int suspended;
+  long long bytes;
+  int cx, cy;
+};
+
+/*
+ * A child process run without a shell, its stdout and stderr captured
+ * through a pipe. processBackground drains the pipe and reaps the child,
+ * then hands the output to done.
+ */
+struct Job {
+  pid_t pid;
+  int fd;
+  char* out;
+  int outlen;
+  int outcap;
+  void (*done)(struct Job* job, int status);
+  void* arg;
+  struct Job* next;
+};
+
+/*
+ * Diff gutter against the HEAD version of the file. head holds a hash per
+ * HEAD line; each row records the HEAD line it is matched to and its gutter
+ * mark. Rows in [lo, hi] flagged diff_stale are re-diffed by diffUpdate.
+ */
+struct Diff {
+  unsigned long long* head;
+  int nhead;
+  int active;
+  int loading;
+  int lo, hi;
+};
+
+/*
+ * Session recorder (fp set) or replayer (data set). See recordStart and
+ * replaySession.
+ */
+struct Recording {
+  FILE* fp;
+  long long last_us;
+  unsigned char* data;
+  long long len;
+  long long pos;
+  unsigned long long next;
+  int have_next;
+  int realtime;
+  int done;
+  long long start_us;
+  long long due_us;
+  long long waited_us;
+  long long keys;
+  long long out_bytes;
+  long long* frame_us;
+  int frames;
+  int framecap;
+  int print_frames;
+  int reported;
+  char* scratch;
+};
+
+/*
+ * Fenwick tree of a per-row weight: row lengths, counting the newline after
+ * each row, for byte offset lookups, and visual line counts for soft wrap.
+ * Inserting or deleting a row shifts every row after it, so nodes past
+ * valid are rebuilt when a query first reaches them.
+ */
+struct RowIndex {
+  long long* tree;  // 1-based, tree[i] sums rows (i - (i & -i), i]
+  int cap;
+  int valid;
+  long long total;  // of every row, only kept for byte offsets
+  long long (*weight)(erow* row);
+};
+
+/*
+ * A growing file (--follow) or a pipe on stdin that is still being read.
+ * New bytes are read without blocking from processBackground and appended
+ * as rows; partial is set while the last row is still missing its newline.
+ */
+struct Follow {
+  int fd;
+  int pipe;
+  int tail;  // keep the cursor on the last row while it is there
+  int partial;
+  long long offset;  // bytes read so far
+};
+
+// Inflates a gzip file into a pipe, which is then read like a followed pipe.
+struct GzipJob {
+  pthread_t thread;
+  int in;  // the compressed file
+  int out;  // write end of the pipe
+  int err;  // zlib error the data stopped at, or 0
+};
+
+struct Gzip {
+  int on;  // the file is gzip compressed, and is saved compressed
+  struct GzipJob* job;  // still inflating
+};
+
+/*
+ * inotify watch on the directory holding the file, since saves (ours and
+ * other programs') replace it by renaming. st is the file as we last read or
+ * wrote it, which tells our own saves apart from outside changes.
+ */
+struct Watch {
+  int fd;
+  int wd;
+  int pending;
+  int conflict;  // changed on disk while there were unsaved edits
+  struct stat st;
+};
+
+/*
+ * Header of the cache file kept next to a big file, followed by numrows + 1
+ * line start offsets and the lexer state each row ends in. The fields up
+ * to numrows must match the file and syntax for the cache to be used.
+ */
+struct CacheHeader {
+  char magic[8];
+  unsigned long long syntax;
+  unsigned long long sample;  // hash of the first and last CACHE_SAMPLE bytes
+  long long size;
+  long long mtime_sec;
+  long long mtime_nsec;
+  long long ino;
+  long long numrows;
+  int cy, cx;
+};
+
+/*
+ * Soft wrap, toggled with Ctrl-W. Each row caches where its visual lines
+ * start at the current width and lines indexes how many each row has, so
+ * screen lines map to rows in O(log n). Bumping gen drops every row's cache.
+ */
+struct Wrap {
+  int on;
+  int cols;
+  unsigned int gen;
+  struct RowIndex lines;
+  int skip;  // visual lines of row rowoff scrolled off the top
+  int y;  // screen line of the cursor
+};
+
+/*
+ * Segment tree of the rows' bracket counts, for finding matching brackets
+ * in O(log n). Like RowIndex, leaves from valid on moved with an inserted
+ * or deleted row; a node is current if all of its leaves are below valid.
+ * The highlight leaves the rebuild past the cursor to an idle task.
+ */
+struct BracketTree {
+  struct Brackets* node;  // node[1] is the root, leaf i is node[size + i]
+  int size;  // a power of two
+  int valid;
+  int pending;  // the highlight waits for the tree to be rebuilt
+  int nmarks;  // brackets highlighted on screen
+  int mark_row[2];
+  int mark_cx[2];
+};
+
+/*
+ * Identifiers in the buffer for completion, counted in a trie. Each row
+ * (each segment of a long row) holds the node of every word in it, so
+ * lexing a row again adds its new words and drops its old ones. Nodes
+ * stay when their count drops to 0 and are reused if the word comes back.
+ */
+struct WordNode {
+  int child;  // first child, 0 for none
+  int next;  // next sibling
+  int parent;
+  int count;  // occurrences of the word ending here
+  int total;  // occurrences of words in the subtree
+  unsigned char c;
+  unsigned char len;
+};
+
+struct Words {
+  struct WordNode* node;  // node[0] is the root
+  int nnodes;
+  int cap;
+  int* scan;  // nodes of the span being lexed
+  int scancap;
+};
+
+// Completion popup for the word before the cursor, opened with Ctrl-N.
+struct Completion {
+  int active;
+  int cy;
+  int cx;  // where the prefix ends
+  int plen;
+  int n;
+  int sel;
+  int node[COMPLETE_MAX];
+  int dist[COMPLETE_MAX];  // rows from the cursor, COMPLETE_NEAR + 1 if further
+};
+
+// One-shot timer, kept in the wheel slot of the tick it's due in.
+struct Timer {
+  long long due;  // nowMs() time
+  void (*fn)();
+  struct Timer* next;
+  int armed;
+};
+
+// Background work done in slices while no input is waiting.
+struct IdleTask {
+  int (*run)(long long deadline);  // returns 1 while there is work left
+  int queued;
+  struct IdleTask* next;
+};
+
+/*
+ * The event loop waits in poll() on the terminal and every background fd.
+ * Signal handlers and the save thread wake it through the self-pipe; timers
+ * set redraw when the screen needs refreshing.
+ */
+struct Loop {
+  int input_fd;  // -1 when running headless
+  int wake[2];
+  struct Timer* wheel[TIMER_SLOTS];
+  long long tick;  // last tick the wheel was run up to
+  struct IdleTask* idle;
+  int redraw;
+  volatile sig_atomic_t resized;  // SIGWINCH came, the size is read again
+  int hl_next;  // next row the idle highlighter looks at
+  struct Timer message;
+  struct Timer progress;
+  struct Timer journal;
+  struct Timer follow;
+  struct Timer resize;
+  struct IdleTask highlight;
+  struct IdleTask index;
+  struct IdleTask brackets;
+  struct IdleTask evict;
+};
+
+/*
+ * An open file. The current buffer's fields live in S, where all of the
+ * editing code works on them; the other buffers keep theirs here, and
+ * switching copies them in and out, at the same cost for any file size.
+ * Hidden buffers give back the render memory of rows off their screen.
+ */
+struct Buffer {
+  int cx, cy;
+  int rx;
+  int rowoff;
+  int coloff;
+  int numrows;
+  erow* row;
+  int rowcap;
+  int dirty;
+  char* filename;
+  struct Syntax* syntax;
+  struct SaveJob* save;
+  struct Journal journal;
+  struct Undo undo;
+  struct RowIndex bytes;
+  struct Wrap wrap;
+  struct BracketTree brackets;
+  struct Follow follow;
+  struct Gzip gzip;
+  struct Watch watch;
+  struct Diff diff;
+  int evicted;  // rows below this were already given back while hidden
+};
+
+// Scrollable view of captured command output, toggled with Ctrl-E.
+struct Pane {
+  char* text;
+  int len;
+  int* lines;
+  int numlines;
+  int linecap;
+  int scroll;
+  int visible;
+};
+
+// A line of .gitignore, matched against paths relative to its directory.
+struct IgnoreRule {
+  char* pattern;
+  int negate;
+  int dir;  // only matches directories
+  int anchored;  // has a slash, so it matches the whole path, not the name
+};
+
+// The rules of one .gitignore, and of the ones in the directories above it.
+struct Ignore {
+  struct Ignore* parent;
+  int baselen;  // its directory is the first baselen bytes of a path
+  char* text;
+  struct IgnoreRule* rules;
+  int nrules;
+  struct Ignore* next;  // every loaded file, freed when the grep is
+};
+
+// A directory to list or a file to scan, queued for the grep threads.
+struct GrepTask {
+  char* path;  // relative to the directory grep runs in
+  int dir;
+  struct Ignore* ignore;
+  struct GrepTask* next;
+};
+
+struct GrepFile;
+
+struct GrepHit {
+  struct GrepFile* file;
+  int line;
+  int col;
+  char* text;  // the line, cut at GREP_LINE_MAX
+  int len;
+};
+
+// Files with matches, handed from the threads to the editor as they finish.
+struct GrepFile {
+  char* path;
+  struct GrepHit* hits;
+  int nhits;
+  struct GrepFile* next;
+};
+
+/*
+ * Project grep, run with Ctrl-P. Worker threads share a queue of
+ * directories and files: listing a directory queues what's in it, so the
+ * walk spreads over the threads as it goes. Results come back a file at a
+ * time through the done list and the self-pipe, and are listed while the
+ * scan goes on.
+ */
+struct Grep {
+  pthread_mutex_t lock;
+  pthread_cond_t more;
+  pthread_t threads[GREP_THREADS];
+  int nthreads;
+  int running;  // threads that haven't exited
+  int busy;  // threads working on a task
+  struct GrepTask* tasks;
+  struct GrepFile* done;
+  struct Ignore* ignores;
+  _Atomic int cancel;
+  _Atomic int nmatches;
+  _Atomic long long scanned;  // files
+  char* query;
+  int qlen;
+  int rare;  // index of the byte in query memchr looks for
+  // Editor side, only touched by the main thread.
+  int active;  // threads to join
+  struct GrepFile* files;
+  struct GrepHit** list;
+  int nlist;
+  int listcap;
+  int nfiles;
+  int sel;
+  int scroll;
+  int visible;
+};
+
+#ifdef ARES_STATS
+enum Stat {
+  STAT_KEY = 0,
+  STAT_FRAME,
+  STAT_DRAW,
+  STAT_SYNTAX,
+  STAT_FIND,
+  STAT_BYTES,
+  STAT_ALLOCS,
+  STAT_COUNT
+};
+
+// Log-linear histogram: exact below 4, then four buckets per power of two.
+struct Histogram {
+  unsigned long long count;
+  unsigned long long sum;
+  unsigned long long max;
+  unsigned long long buckets[STATS_BUCKETS];
+};
+
+// Hot path timings, shown with Ctrl-T and written out with Ctrl-D.
+struct Stats {
+  struct Histogram hist[STAT_COUNT];
+  long long key_ns;  // when the key being handled was read, 0 if none
+  unsigned long frame_allocs;
+  long long last_frame;
+  long long last_draw;
+  long long last_bytes;
+  long long last_allocs;
+  int overlay;
+};
+#endif
+
 struct State {
   int cx, cy;
   int rx;
@@ -95,41 +699,380 @@ struct State {
   int screencols;
   int numrows;
   erow* row;
+  int rowcap;  // rows allocated, grown by doubling
   int dirty;
   char* filename;
   char statusmsg[80];
   time_t statusmsg_time;
   struct Syntax* syntax;
+  struct SaveJob* save;
+  unsigned int save_gen;
+  struct Journal journal;
+  struct Undo undo;
+  int batch;
+  int batch_lo, batch_hi;
+  struct RowIndex bytes;
+  struct Wrap wrap;
+  struct BracketTree brackets;
+  struct Words words;
+  struct Completion complete;
+  struct Follow follow;
+  struct Gzip gzip;
+  struct Watch watch;
+  struct Job* jobs;
+  struct Pane pane;
+  struct Grep grep;
+  struct Diff diff;
+  int (*input)(char* c);
+  void (*output)(const char* s, int len);
+  struct Recording rec;
+  struct Loop loop;
+  struct Buffer** buffers;  // the entry for current is stale, S has its state
+  int nbuffers;
+  int current;
+#ifdef ARES_STATS
+  struct Stats stats;
+#endif
   struct termios orig_termios;
 };
 
 struct State S;
 
-char* C_HL_extensions[] = { ".c", ".h", ".cpp", NULL };
-char* C_HL_keywords[] = { "switch", "if", "while", "for", "break", "continue",
-  "return", "else", "struct", "union", "typedef", "static", "enum", "class",
-  "case", "#include", "#define", "#ifndef", "#endif", "int|", "long|",
-  "double|", "float|", "char|", "unsigned|", "signed|", "void|", NULL };
+// Rows are kept in one array, so a row's number is where it sits in it.
+int rowIndex(erow* row) { return row - S.row; }
+
+/*
+ * Syntax definitions. Each line of one is a directive, # starts a comment:
+ *
+ *   name NAME                     filetype shown in the status bar
+ *   files PATTERN...              file name endings (.c) or parts it is for
+ *   keywords WORD...              primary keywords
+ *   types WORD...                 secondary keywords
+ *   numbers                       highlight numeric literals
+ *   line OPEN [spaced]            comment to the end of the row
+ *   block OPEN CLOSE              comment that may span rows
+ *   nested OPEN CLOSE             block comment that nests
+ *   string OPEN CLOSE [ESC]       string ending with the row
+ *   text OPEN CLOSE [ESC]         string that may span rows
+ *   char OPEN CLOSE [ESC]         char literal, one char or an escape
+ *   raw PREFIX DELIM OPEN CLOSE SUFFIX
+ *
+ * A raw string is PREFIX, a delimiter of up to LEX_RAW_DELIM chars from
+ * DELIM (* for any printable char), OPEN, then the text up to CLOSE, the
+ * same delimiter and SUFFIX (- for none). A spaced line comment only opens
+ * at the start of a row or after a blank. Markers starting with a word
+ * char, like the r of r"...", don't open inside a word.
+ */
+const char* builtin_syntax[] = {
+  "name c\n"
+  "files .c .h\n"
+  "keywords switch if while for break continue return else struct union\n"
+  "keywords typedef static enum class case #include #define #ifndef #endif\n"
+  "types int long double float char unsigned signed void\n"
+  "numbers\n"
+  "line //\n"
+  "block /* */\n"
+  "string \" \" \\\n"
+  "string ' ' \\\n",
+
+  "name go\n"
+  "files .go\n"
+  "keywords break default func interface select case defer go map struct\n"
+  "keywords chan else goto package switch const fallthrough if range type\n"
+  "keywords continue for import return var\n"
+  "numbers\n"
+  "line //\n"
+  "block /* */\n"
+  "string \" \" \\\n"
+  "string ' ' \\\n"
+  "text ` `\n",
+};
+
+struct Syntax** HLDB;
+int HLDB_ENTRIES;
+
+unsigned int lexHash(const char* s, int len)
+{
+  unsigned int h = 2166136261u;
+  for (int i = 0; i < len; i++)
+    h = (h ^ (unsigned char)s[i]) * 16777619u;
+  return h;
+}
+
+// Copy a marker into a rule field, "-" standing for an empty one.
+int lexMarker(char* dst, unsigned char* len, const char* src)
+{
+  int n = strcmp(src, "-") ? (int)strlen(src) : 0;
+  if (n > LEX_DELIM)
+    return -1;
+  memcpy(dst, src, n);
+  *len = n;
+  return 0;
+}
+
+void syntaxFree(struct Syntax* sy)
+{
+  for (char** f = sy->filematch; f && *f; f++)
+    free(*f);
+  for (unsigned int k = 0; sy->keywords && k <= sy->kwmask; k++)
+    free(sy->keywords[k].word);
+  free(sy->keywords);
+  free(sy->filematch);
+  free(sy->filetype);
+  free(sy->source);
+  free(sy);
+}
+
+void syntaxKeyword(struct Syntax* sy, const char* word, int hl)
+{
+  int len = strlen(word);
+  if (len >= LEX_LOOKAHEAD)
+    return;
+  unsigned int k = lexHash(word, len) & sy->kwmask;
+  while (sy->keywords[k].word) {
+    if (sy->keywords[k].len == len && !memcmp(sy->keywords[k].word, word, len))
+      return;
+    k = (k + 1) & sy->kwmask;
+  }
+  sy->keywords[k].word = strdup(word);
+  sy->keywords[k].len = len;
+  sy->keywords[k].hl = hl;
+  if (len > sy->kwmax)
+    sy->kwmax = len;
+  unsigned char c = word[0];
+  if (!(sy->cls[c] & LEX_WORD))
+    sy->cls[c] |= LEX_KEYSTART;
+}
+
+/*
+ * Add rule r to the tables: chain it after the rules opening with the same
+ * byte, longest open marker first, and mark the bytes that can end it.
+ */
+void syntaxIndex(struct Syntax* sy, int r)
+{
+  struct LexRule* rule = &sy->rules[r];
+  unsigned char c = rule->open[0];
+  unsigned char* link = &sy->first[c];
+  while (*link && sy->rules[*link - 1].olen >= rule->olen)
+    link = &sy->next[*link - 1];
+  sy->next[r] = *link;
+  *link = r + 1;
+  sy->cls[c] |= LEX_OPENS;
+  rule->word = (sy->cls[c] & LEX_WORD) != 0;
+
+  if (rule->kind == LEX_LINE)
+    return;
+  sy->stop[r][(unsigned char)rule->close[0]] = 1;
+  if (rule->esc)
+    sy->stop[r][(unsigned char)rule->esc] = 1;
+  if (rule->kind == LEX_NESTED)
+    sy->stop[r][c] = 1;
+}
+
+/*
+ * Compile the definition text, read from path, into lexer tables. Returns
+ * NULL after showing what is wrong with it.
+ */
+struct Syntax* syntaxCompile(const char* path, const char* text)
+{
+  static const char* kinds[] = { "line", "block", "nested", "string", "text",
+    "char", "raw" };
+  struct Syntax* sy = calloc(1, sizeof(struct Syntax));
+  sy->source = strdup(text);
+  for (int c = 0; c < 256; c++) {
+    if (isalnum(c) || c == '_' || c >= 0x80)
+      sy->cls[c] |= LEX_WORD;
+    if (isdigit(c))
+      sy->cls[c] |= LEX_DIGIT;
+  }
+
+  // Keywords go in a table sized from the word count of the whole text.
+  int words = 0;
+  for (const char* p = text; *p; p++)
+    words += !isspace((unsigned char)*p)
+        && (p == text || isspace((unsigned char)p[-1]));
+  sy->kwmask = 1;
+  while (sy->kwmask < (unsigned int)words * 2)
+    sy->kwmask <<= 1;
+  sy->keywords = calloc(sy->kwmask, sizeof(struct Keyword));
+  sy->kwmask--;
+
+  char* copy = strdup(text);
+  char* rest = copy;
+  char* line;
+  int lineno = 0, nfiles = 0;
+  const char* error = NULL;
+  while (error == NULL && (line = strsep(&rest, "\n")) != NULL) {
+    lineno++;
+    char* save;
+    char* dir = strtok_r(line, " \t\r", &save);
+    if (dir == NULL || dir[0] == '#')
+      continue;
+    char* arg[6];
+    int n = 0;
+    if (!strcmp(dir, "keywords") || !strcmp(dir, "types")) {
+      int hl = dir[0] == 'k' ? HL_KEYWORD_PRIMARY : HL_KEYWORD_SECONDARY;
+      while ((arg[0] = strtok_r(NULL, " \t\r", &save)) != NULL)
+        syntaxKeyword(sy, arg[0], hl);
+      continue;
+    }
+    if (!strcmp(dir, "files")) {
+      while ((arg[0] = strtok_r(NULL, " \t\r", &save)) != NULL) {
+        sy->filematch = realloc(sy->filematch, sizeof(char*) * (nfiles + 2));
+        sy->filematch[nfiles++] = strdup(arg[0]);
+        sy->filematch[nfiles] = NULL;
+      }
+      continue;
+    }
+    while (n < 6 && (arg[n] = strtok_r(NULL, " \t\r", &save)) != NULL)
+      n++;
+
+    if (!strcmp(dir, "name")) {
+      if (n != 1) {
+        error = "name takes one word";
+      } else {
+        free(sy->filetype);
+        sy->filetype = strdup(arg[0]);
+      }
+      continue;
+    }
+    if (!strcmp(dir, "numbers")) {
+      sy->numbers = 1;
+      sy->cls['.'] |= LEX_DOT;
+      continue;
+    }
+
+    int kind = 0;
+    while (kind <= LEX_RAW && strcmp(dir, kinds[kind]))
+      kind++;
+    if (kind > LEX_RAW) {
+      error = "unknown directive";
+      continue;
+    }
+    if (sy->nrules == LEX_RULES) {
+      error = "too many comments and strings";
+      continue;
+    }
+    struct LexRule* rule = &sy->rules[sy->nrules];
+    memset(rule, 0, sizeof(*rule));
+    rule->kind = kind;
+    rule->hl = kind == LEX_LINE ? HL_COMMENT
+        : kind <= LEX_NESTED    ? HL_ML_COMMENT
+                                : HL_STRING;
+    int ok;
+    if (kind == LEX_LINE) {
+      ok = n >= 1 && n <= 2 && (n == 1 || !strcmp(arg[1], "spaced"));
+      rule->spaced = n == 2;
+    } else if (kind == LEX_BLOCK || kind == LEX_NESTED) {
+      ok = n == 2;
+    } else if (kind == LEX_RAW) {
+      ok = n == 5 && strlen(arg[1]) < 256
+          && lexMarker(rule->mid, &rule->mlen, arg[2]) == 0
+          && lexMarker(rule->suffix, &rule->slen, arg[4]) == 0;
+      for (int c = 0; ok && c < 256; c++)
+        rule->delim[c] = strcmp(arg[1], "*")
+            ? c && strchr(arg[1], c) != NULL
+            : isgraph(c) && c != '\\' && c != rule->mid[0] && c != arg[3][0];
+    } else {
+      ok = (n == 2 || n == 3) && (n == 2 || strlen(arg[2]) == 1);
+      rule->esc = n == 3 ? arg[2][0] : 0;
+    }
+    char* close = arg[kind == LEX_RAW ? 3 : 1];
+    if (ok)
+      ok = lexMarker(rule->open, &rule->olen, arg[0]) == 0 && rule->olen
+          && (kind == LEX_LINE
+              || (lexMarker(rule->close, &rule->clen, close) == 0
+                  && rule->clen));
+    if (!ok) {
+      error = "bad arguments";
+      continue;
+    }
+    syntaxIndex(sy, sy->nrules++);
+  }
+  free(copy);
+
+  if (error == NULL && (sy->filetype == NULL || sy->filematch == NULL))
+    error = "needs a name and files";
+  if (error) {
+    setStatusMessage("%s:%d: %s", path, lineno, error);
+    syntaxFree(sy);
+    return NULL;
+  }
+  return sy;
+}
 
-char* Go_HL_extensions[] = { ".go", NULL };
-char* Go_HL_keywords[] = { "break", "default", "func", "interface", "select",
-  "case", "defer", "go", "map", "struct", "chan", "else", "goto", "package",
-  "switch", "const", "fallthrough", "if", "range", "type", "continue", "for",
-  "import", "return", "var", NULL };
+// Add a compiled language, replacing one of the same name.
+void syntaxAdd(struct Syntax* sy)
+{
+  if (sy == NULL)
+    return;
+  for (int j = 0; j < HLDB_ENTRIES; j++) {
+    if (!strcmp(HLDB[j]->filetype, sy->filetype)) {
+      syntaxFree(HLDB[j]);
+      HLDB[j] = sy;
+      return;
+    }
+  }
+  HLDB = realloc(HLDB, sizeof(struct Syntax*) * (HLDB_ENTRIES + 1));
+  HLDB[HLDB_ENTRIES++] = sy;
+}
 
-struct Syntax HLDB[]
-    = { { "c", C_HL_extensions, C_HL_keywords, "//", "/*", "*/",
-            HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS },
-        { "go", Go_HL_extensions, Go_HL_keywords, "//", "/*", "*/",
-            HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS },
- };
+void syntaxLoadDir(const char* dir)
+{
+  DIR* d = opendir(dir);
+  if (d == NULL)
+    return;
+  struct dirent* e;
+  int slen = strlen(SYNTAX_SUFFIX);
+  while ((e = readdir(d)) != NULL) {
+    int nlen = strlen(e->d_name);
+    if (nlen <= slen || strcmp(&e->d_name[nlen - slen], SYNTAX_SUFFIX))
+      continue;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+      continue;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+      char* text = malloc(st.st_size + 1);
+      ssize_t len = 0, n;
+      while (len < st.st_size
+          && (n = read(fd, &text[len], st.st_size - len)) > 0)
+        len += n;
+      text[len] = '\0';
+      syntaxAdd(syntaxCompile(path, text));
+      free(text);
+    }
+    close(fd);
+  }
+  closedir(d);
+}
 
-#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+// Compile the built in languages and the definition files, once at startup.
+void syntaxInit()
+{
+  if (HLDB_ENTRIES)
+    return;
+  for (unsigned int j = 0; j < sizeof(builtin_syntax) / sizeof(char*); j++)
+    syntaxAdd(syntaxCompile("built in", builtin_syntax[j]));
+  syntaxLoadDir(SYNTAX_DIR);
+  char* home = getenv("HOME");
+  if (home) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/.config/ares/syntax", home);
+    syntaxLoadDir(path);
+  }
+  if (getenv("ARES_SYNTAX"))
+    syntaxLoadDir(getenv("ARES_SYNTAX"));
+}
 
 void die(const char* s)
 {
-  write(STDOUT_FILENO, "\x1b[2J", 4);
-  write(STDOUT_FILENO, "\x1b[H", 3);
+  if (S.journal.len)
+    journalFlush(1);
+  S.output("\x1b[2J", 4);
+  S.output("\x1b[H", 3);
 
   perror(s);
   exit(1);
@@ -159,27 +1102,256 @@ void enableRawMode()
     die("tcsetattr");
 }
 
-int readKey()
+/*
+ * Terminal input source and output sink. Anything with the same contract
+ * can be swapped in through S.input and S.output to run the editor without
+ * a terminal: input returns 1 with a byte, 0 on timeout or -1 on error.
+ */
+int ttyRead(char* c) { return read(STDIN_FILENO, c, 1); }
+
+void ttyWrite(const char* s, int len)
 {
-  int nread;
-  char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN)
-      die("read");
+  struct iovec iov = { (char*)s, len };
+  writeAllv(STDOUT_FILENO, &iov, 1);
+}
+
+void timerInsert(struct Timer* t)
+{
+  struct Timer** slot = &S.loop.wheel[t->due / TIMER_TICK_MS % TIMER_SLOTS];
+  t->next = *slot;
+  *slot = t;
+}
+
+void timerCancel(struct Timer* t)
+{
+  if (!t->armed)
+    return;
+  struct Timer** pp = &S.loop.wheel[t->due / TIMER_TICK_MS % TIMER_SLOTS];
+  while (*pp != t)
+    pp = &(*pp)->next;
+  *pp = t->next;
+  t->armed = 0;
+}
+
+// Run t->fn ms from now, replacing any earlier arming of t.
+void timerArm(struct Timer* t, long long ms)
+{
+  timerCancel(t);
+  t->due = nowMs() + ms;
+  t->armed = 1;
+  timerInsert(t);
+}
+
+// Fire the timers due by now, visiting each slot passed since the last run.
+void timersRun()
+{
+  struct Loop* L = &S.loop;
+  long long now = nowMs();
+  long long tick = now / TIMER_TICK_MS;
+  if (tick - L->tick >= TIMER_SLOTS)
+    L->tick = tick - TIMER_SLOTS + 1;
+  for (; L->tick <= tick; L->tick++) {
+    struct Timer** slot = &L->wheel[L->tick % TIMER_SLOTS];
+    struct Timer** pp = slot;
+    while (*pp) {
+      struct Timer* t = *pp;
+      if (t->due > now) {
+        pp = &t->next;  // due on a later turn of the wheel
+        continue;
+      }
+      *pp = t->next;
+      t->armed = 0;
+      t->fn();
+      pp = slot;  // fn may have armed or cancelled timers in this slot
+    }
   }
+  L->tick = tick;
+}
 
-  if (c == '\x1b') {
-    char seq[3];
+// Milliseconds until the next timer is due, or -1 if none is armed.
+int timerTimeout()
+{
+  long long due = LLONG_MAX;
+  for (int j = 0; j < TIMER_SLOTS; j++)
+    for (struct Timer* t = S.loop.wheel[j]; t; t = t->next)
+      if (t->due < due)
+        due = t->due;
+  if (due == LLONG_MAX)
+    return -1;
+  long long ms = due - nowMs();
+  return ms < 0 ? 0 : ms > INT_MAX ? INT_MAX : ms;
+}
 
-    if (read(STDIN_FILENO, &seq[0], 1) != 1)
-      return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1)
-      return '\x1b';
+void loopRedraw() { S.loop.redraw = 1; }
 
-    if (seq[0] == '[') {
-      if (seq[1] >= '0' && seq[1] <= '9') {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1)
-          return '\x1b';
+void idleQueue(struct IdleTask* t)
+{
+  if (t->queued || S.loop.input_fd == -1)
+    return;
+  struct IdleTask** pp = &S.loop.idle;
+  while (*pp)
+    pp = &(*pp)->next;
+  t->next = NULL;
+  t->queued = 1;
+  *pp = t;
+}
+
+// Give the task at the head of the queue a slice, round robin.
+void idleRun()
+{
+  struct IdleTask* t = S.loop.idle;
+  S.loop.idle = t->next;
+  t->queued = 0;
+  if (t->run(nowUs() + IDLE_SLICE_US))
+    idleQueue(t);
+}
+
+void loopWake(char why)
+{
+  if (S.loop.wake[1] != -1 && write(S.loop.wake[1], &why, 1) == -1) {
+    // The pipe is full, so the loop is already going to wake.
+  }
+}
+
+void onSignal(int sig)
+{
+  int saved = errno;
+  loopWake(sig);
+  errno = saved;
+}
+
+// Only flag it, the loop reads the new size.
+void onResize(int sig)
+{
+  S.loop.resized = 1;
+  onSignal(sig);
+}
+
+// Wait on the terminal from now on, with the self-pipe for wakeups.
+void loopStart()
+{
+  if (pipe(S.loop.wake) == -1)
+    die("pipe");
+  for (int j = 0; j < 2; j++) {
+    fcntl(S.loop.wake[j], F_SETFL, O_NONBLOCK);
+    fcntl(S.loop.wake[j], F_SETFD, FD_CLOEXEC);
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = onSignal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGCHLD, &sa, NULL) == -1)
+    die("sigaction");
+  sa.sa_handler = onResize;
+  if (sigaction(SIGWINCH, &sa, NULL) == -1)
+    die("sigaction");
+
+  S.loop.input_fd = STDIN_FILENO;
+  S.loop.tick = nowMs() / TIMER_TICK_MS;
+}
+
+/*
+ * Block until a key arrives (EV_KEY) or there is background work to do
+ * (EV_OTHER). Idle tasks run while nothing else is ready, one slice at a
+ * time so input is never kept waiting longer than IDLE_SLICE_US.
+ */
+int waitEvents()
+{
+  struct Loop* L = &S.loop;
+  if (L->input_fd == -1)
+    return EV_KEY;
+
+  struct pollfd fds[POLL_MAX];
+  int n = 0;
+  fds[n++] = (struct pollfd){ L->input_fd, POLLIN, 0 };
+  fds[n++] = (struct pollfd){ L->wake[0], POLLIN, 0 };
+  if (S.follow.fd != -1 && S.follow.pipe)
+    fds[n++] = (struct pollfd){ S.follow.fd, POLLIN, 0 };
+  if (S.watch.fd != -1)
+    fds[n++] = (struct pollfd){ S.watch.fd, POLLIN, 0 };
+  int overflow = 0;
+  for (struct Job* job = S.jobs; job; job = job->next) {
+    if (job->fd == -1)
+      continue;
+    if (n == POLL_MAX)
+      overflow = 1;
+    else
+      fds[n++] = (struct pollfd){ job->fd, POLLIN, 0 };
+  }
+
+  for (;;) {
+    int timeout = timerTimeout();
+    if (timeout == 0)
+      return EV_OTHER;
+    if (overflow && (timeout == -1 || timeout > FOLLOW_POLL_MS))
+      timeout = FOLLOW_POLL_MS;
+    if (L->idle)
+      timeout = 0;
+
+    int ready = poll(fds, n, timeout);
+    if (ready == -1) {
+      if (errno != EINTR)
+        die("poll");
+      return EV_OTHER;
+    }
+    if (ready == 0) {
+      if (!L->idle)
+        return EV_OTHER;
+      idleRun();
+      if (L->redraw)
+        return EV_OTHER;
+      continue;
+    }
+
+    if (fds[1].revents) {
+      char buf[64];
+      while (read(L->wake[0], buf, sizeof(buf)) > 0)
+        ;
+    }
+    int ev = 0;
+    if (fds[0].revents)
+      ev |= EV_KEY;
+    for (int j = 1; j < n; j++)
+      if (fds[j].revents)
+        ev |= EV_OTHER;
+    return ev;
+  }
+}
+
+int readKey()
+{
+  int nread;
+  char c;
+  for (;;) {
+    int ev = waitEvents();
+    if (ev & EV_KEY) {
+      nread = S.input(&c);
+      if (nread == 1)
+        break;
+      if (nread == -1 && errno != EAGAIN)
+        die("read");
+    }
+    if (processBackground())
+      refreshScreen();
+  }
+#ifdef ARES_STATS
+  S.stats.key_ns = nowNs();
+#endif
+
+  if (c == '\x1b') {
+    char seq[3];
+
+    if (S.input(&seq[0]) != 1)
+      return '\x1b';
+    if (S.input(&seq[1]) != 1)
+      return '\x1b';
+
+    if (seq[0] == '[') {
+      if (seq[1] >= '0' && seq[1] <= '9') {
+        if (S.input(&seq[2]) != 1)
+          return '\x1b';
         if (seq[2] == '~') {
           switch (seq[1]) {
           case '1':
@@ -225,7 +1397,7 @@ int readKey()
 
     return '\x1b';
   } else {
-    return c;
+    return (unsigned char)c;
   }
 }
 
@@ -269,702 +1441,5768 @@ int getWindowSize(int* rows, int* cols)
   }
 }
 
-int is_separator(int c)
+// Highlight of a word in code: a keyword's, else normal.
+int lexKeyword(struct Syntax* sy, const char* s, int len)
 {
-  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+  if (len > sy->kwmax)
+    return HL_NORMAL;
+  unsigned int k = lexHash(s, len) & sy->kwmask;
+  for (; sy->keywords[k].word; k = (k + 1) & sy->kwmask)
+    if (sy->keywords[k].len == len && !memcmp(sy->keywords[k].word, s, len))
+      return sy->keywords[k].hl;
+  return HL_NORMAL;
 }
 
-void updateSyntax(erow* row)
+/*
+ * Length of the comment or string rule r opens at buf[i], 0 if it doesn't.
+ * A char literal is matched whole; the others set state to being inside.
+ */
+int lexOpen(struct Syntax* sy, const char* buf, int i, int avail, int r,
+    unsigned int* state)
 {
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
-
-  if (S.syntax == NULL)
-    return;
-
-  char** keywords = S.syntax->keywords;
-
-  char* scs = S.syntax->singleline_comment_start;
-  char* mcs = S.syntax->multiline_comment_start;
-  char* mce = S.syntax->multiline_comment_end;
-
-  int scs_len = scs ? strlen(scs) : 0;
-  int mcs_len = mcs ? strlen(mcs) : 0;
-  int mce_len = mce ? strlen(mce) : 0;
-
-  int prev_sep = 1;
-  int in_string = 0;
-  int in_comment = (row->idx > 0 && S.row[row->idx - 1].hl_open_comment);
-
-  int i = 0;
-  while (i < row->rsize) {
-    char c = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
-
-    if (scs_len && !in_string && !in_comment) {
-      if (!strncmp(&row->render[i], scs, scs_len)) {
-        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-        break;
-      }
+  struct LexRule* rule = &sy->rules[r];
+  if (i + rule->olen > avail || memcmp(&buf[i], rule->open, rule->olen))
+    return 0;
+  int j = i + rule->olen;
+  switch (rule->kind) {
+  case LEX_CHAR:
+    if (j < avail && buf[j] == rule->esc && rule->esc) {
+      int end = j + LEX_CHAR_MAX < avail ? j + LEX_CHAR_MAX : avail;
+      for (j += 2; j < end && buf[j] != rule->close[0]; j++)
+        ;
+    } else if (j < avail) {
+      // One char, UTF-8 continuation bytes included.
+      for (j++; j < avail && ((unsigned char)buf[j] & 0xc0) == 0x80; j++)
+        ;
     }
+    if (j + rule->clen > avail || memcmp(&buf[j], rule->close, rule->clen))
+      return 0;
+    return j + rule->clen - i;
+  case LEX_RAW: {
+    int d = j;
+    while (j < avail && j - d < LEX_RAW_DELIM
+        && rule->delim[(unsigned char)buf[j]])
+      j++;
+    if (j + rule->mlen > avail || memcmp(&buf[j], rule->mid, rule->mlen))
+      return 0;
+    *state = (r + 1) | (j - d) << 8 | (lexHash(&buf[d], j - d) & 0xffff) << 16;
+    return j + rule->mlen - i;
+  }
+  case LEX_NESTED:
+    *state = (r + 1) | 1 << 8;
+    return j - i;
+  default:
+    *state = r + 1;
+    return j - i;
+  }
+}
 
-    if (mcs_len && mce_len && !in_string) {
-      if (in_comment) {
-        row->hl[i] = HL_ML_COMMENT;
-        if (!strncmp(&row->render[i], mce, mce_len)) {
-          memset(&row->hl[i], HL_ML_COMMENT, mce_len);
-          i += mce_len;
-          in_comment = 0;
-          prev_sep = 1;
-          continue;
-        } else {
-          i++;
-          continue;
-        }
-      } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-        memset(&row->hl[i], HL_ML_COMMENT, mcs_len);
-        i += mcs_len;
-        in_comment = 1;
-        continue;
-      }
+/*
+ * Highlight buf from i as the inside of the comment or string in *state,
+ * up to its close marker or len. Returns where it stopped, which is past
+ * len if the close marker or an escape runs into the lookahead.
+ */
+int lexInside(struct Syntax* sy, const char* buf, int i, int len, int avail,
+    unsigned char* hl, unsigned int* state)
+{
+  int r = LEX_RULE(*state) - 1;
+  struct LexRule* rule = &sy->rules[r];
+  int start = i;
+  if (rule->kind == LEX_LINE) {
+    memset(&hl[i], rule->hl, len - i);
+    return len;
+  }
+  const unsigned char* stop = sy->stop[r];
+  while (i < len) {
+    if (!stop[(unsigned char)buf[i]]) {
+      i++;
+      continue;
     }
-
-    if (S.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-      if (in_string) {
-        row->hl[i] = HL_STRING;
-        if (c == '\\' && i + 1 < row->rsize) {
-          row->hl[i + 1] = HL_STRING;
-          i += 2;
-          continue;
-        }
-        if (c == in_string)
-          in_string = 0;
-        i++;
-        prev_sep = 1;
-        continue;
-      } else {
-        if (c == '"' || c == '\'') {
-          in_string = c;
-          row->hl[i] = HL_STRING;
+    char c = buf[i];
+    if (c == rule->esc) {
+      i += i + 1 < avail ? 2 : 1;
+      continue;
+    }
+    if (c == rule->close[0] && i + rule->clen <= avail
+        && !memcmp(&buf[i], rule->close, rule->clen)) {
+      int end = i + rule->clen;
+      if (rule->kind == LEX_RAW) {
+        int dlen = LEX_DEPTH(*state);
+        if (end + dlen + rule->slen > avail
+            || (lexHash(&buf[end], dlen) & 0xffff) != LEX_DELIM_HASH(*state)
+            || memcmp(&buf[end + dlen], rule->suffix, rule->slen)) {
           i++;
           continue;
         }
+        end += dlen + rule->slen;
       }
-    }
-    if (S.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-      if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER))
-          || (c == '.' && prev_hl == HL_NUMBER)) {
-        row->hl[i] = HL_NUMBER;
-        i++;
-        prev_sep = 0;
+      i = end;
+      if (rule->kind == LEX_NESTED && LEX_DEPTH(*state) > 1) {
+        *state -= 1 << 8;
         continue;
       }
+      *state = 0;
+      break;
     }
-
-    if (prev_sep) {
-      int j;
-      for (j = 0; keywords[j]; j++) {
-        int klen = strlen(keywords[j]);
-        int kw2 = keywords[j][klen - 1] == '|';
-        if (kw2)
-          klen--;
-        if (!strncmp(&row->render[i], keywords[j], klen)
-            && is_separator(row->render[i + klen])) {
-          memset(&row->hl[i], kw2 ? HL_KEYWORD_SECONDARY : HL_KEYWORD_PRIMARY,
-              klen);
-          i += klen;
-          break;
-        }
-      }
-      if (keywords[j] != NULL) {
-        prev_sep = 0;
-        continue;
-      }
+    if (rule->kind == LEX_NESTED && c == rule->open[0]
+        && i + rule->olen <= avail
+        && !memcmp(&buf[i], rule->open, rule->olen)) {
+      i += rule->olen;
+      if (LEX_DEPTH(*state) < 0xff)
+        *state += 1 << 8;
+      continue;
     }
-    prev_sep = is_separator(c);
     i++;
   }
-  int changed = (row->hl_open_comment != in_comment);
-  row->hl_open_comment = in_comment;
-  if (changed && row->idx + 1 < S.numrows)
-    updateSyntax(&S.row[row->idx + 1]);
+  memset(&hl[start], rule->hl, i - start);
+  return i;
 }
 
-char* syntaxToColor(int hl)
+// The state a row ending in state hands to the next row.
+unsigned int lexRowEnd(unsigned int state)
 {
-  switch (hl) {
-  case HL_STRING:
-    return STRING_HIGHLIGHT_COLOR;
-  case HL_NUMBER:
-    return NUMBER_HIGHLIGHT_COLOR;
-  case HL_COMMENT:
-  case HL_ML_COMMENT:
-    return COMMENT_HIGHLIGHT_COLOR;
-  case HL_MATCH:
-    return SEARCH_MATCH_HIGHLIGHT_COLOR;
-  case HL_KEYWORD_PRIMARY:
-    return KEYWORD_PRIMARY_HIGHLIGHT_COLOR;
-  case HL_KEYWORD_SECONDARY:
-    return KEYWORD_SECONDARY_HIGHLIGHT_COLOR;
-  default:
-    return DEFAULT_HIGHLIGHT_COLOR;
+  if (state == 0 || S.syntax == NULL)
+    return 0;
+  int kind = S.syntax->rules[LEX_RULE(state) - 1].kind;
+  return kind == LEX_LINE || kind == LEX_STRING || kind == LEX_CHAR ? 0 : state;
+}
+
+// Length of the numeric literal at buf[i], up to avail.
+int lexNumber(struct Syntax* sy, const char* buf, int i, int avail)
+{
+  int hex = buf[i] == '0' && i + 1 < avail && (buf[i + 1] | 0x20) == 'x';
+  int j = i + 1;
+  while (j < avail) {
+    unsigned char c = buf[j];
+    int next = j + 1 < avail ? sy->cls[(unsigned char)buf[j + 1]] : 0;
+    if (isalnum(c) || c == '_')
+      j++;
+    else if (c == '.' && (next & LEX_DIGIT))
+      j++;
+    else if (c == '\'' && (next & LEX_WORD)
+        && isalnum((unsigned char)buf[j - 1]))
+      j++;  // digit separator
+    else if ((c == '+' || c == '-')
+        && (buf[j - 1] | 0x20) == (hex ? 'p' : 'e'))
+      j++;
+    else
+      break;
   }
+  return j - i;
 }
 
-void selectSyntaxHighlight()
+/*
+ * Highlight len chars of render text into hl, starting from and updating
+ * st. buf holds avail >= len chars and a NUL; anything past len is only
+ * lookahead for matches that start inside the span, and hl needs room for
+ * the part of such a match that runs past len.
+ */
+void lexSpan(const char* buf, int len, int avail, unsigned char* hl,
+    struct LexState* st)
 {
-  S.syntax = NULL;
-  if (S.filename == NULL)
+  struct Syntax* sy = S.syntax;
+  if (sy == NULL) {
+    memset(hl, HL_NORMAL, len);
     return;
+  }
+  if (st->skip >= len) {
+    memset(hl, st->skip_hl, len);
+    st->skip -= len;
+    return;
+  }
 
-  for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-    struct Syntax* s = &HLDB[j];
-    unsigned int i = 0;
-    while (s->filematch[i]) {
-      char* p = strstr(S.filename, s->filematch[i]);
-      if (p != NULL) {
-        int patlen = strlen(s->filematch[i]);
-        if (s->filematch[i][0] != '.' || p[patlen] == '\0') {
-          S.syntax = s;
-
-          int filerow;
-          for (filerow = 0; filerow < S.numrows; filerow++) {
-            updateSyntax(&S.row[filerow]);
-          }
+  unsigned int state = st->state;
+  int sep = st->prev_sep;
+  int i = st->skip;
+  memset(hl, st->skip_hl, i);
+  while (i < len) {
+    if (state) {
+      i = lexInside(sy, buf, i, len, avail, hl, &state);
+      sep = 1;
+      continue;
+    }
+    unsigned char c = buf[i];
+    int cls = sy->cls[c];
+    if (cls == 0) {
+      hl[i++] = HL_NORMAL;
+      sep = 1;
+      continue;
+    }
 
-          return;
+    if (cls & LEX_OPENS) {
+      int n = 0;
+      for (int r = sy->first[c]; r && n == 0; r = sy->next[r - 1]) {
+        struct LexRule* rule = &sy->rules[r - 1];
+        if ((rule->word && !sep)
+            || (rule->spaced && i > 0 && buf[i - 1] != ' '))
+          continue;
+        n = lexOpen(sy, buf, i, avail, r - 1, &state);
+        if (n && rule->kind == LEX_LINE) {
+          memset(&hl[i], rule->hl, len - i);
+          n = len - i;
+        } else if (n) {
+          memset(&hl[i], rule->hl, n);
         }
       }
-      i++;
+      if (n) {
+        i += n;
+        sep = 1;
+        continue;
+      }
+    }
+
+    if (sep && sy->numbers
+        && ((cls & LEX_DIGIT)
+            || ((cls & LEX_DOT) && i + 1 < avail
+                && (sy->cls[(unsigned char)buf[i + 1]] & LEX_DIGIT)))) {
+      int n = lexNumber(sy, buf, i, avail);
+      memset(&hl[i], HL_NUMBER, n);
+      i += n;
+      sep = 0;
+      continue;
+    }
+
+    if (cls & LEX_WORD) {
+      int j = i + 1;
+      while (j < avail && (sy->cls[(unsigned char)buf[j]] & LEX_WORD))
+        j++;
+      memset(&hl[i], sep ? lexKeyword(sy, &buf[i], j - i) : HL_NORMAL, j - i);
+      i = j;
+      sep = 0;
+      continue;
+    }
+
+    if ((cls & LEX_KEYSTART) && sep) {
+      int j = i + 1;
+      while (j < avail && (sy->cls[(unsigned char)buf[j]] & LEX_WORD))
+        j++;
+      int kw = lexKeyword(sy, &buf[i], j - i);
+      if (kw != HL_NORMAL) {
+        memset(&hl[i], kw, j - i);
+        i = j;
+        sep = 0;
+        continue;
+      }
     }
+    hl[i++] = HL_NORMAL;
+    sep = 1;
   }
+
+  st->state = state;
+  st->prev_sep = sep;
+  st->skip = i > len ? i - len : 0;
+  st->skip_hl = st->skip ? hl[len] : HL_NORMAL;
 }
 
-int rowCxToRx(erow* row, int cx)
+// +1 for an opening bracket, -1 for a closing one.
+int bracketDir(char c)
 {
-  int rx = 0;
-  int j;
-  for (j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t')
-      rx += (TAB_STOP - 1) - (rx % TAB_STOP);
-    rx++;
+  switch (c) {
+  case '(':
+  case '[':
+  case '{':
+    return 1;
+  case ')':
+  case ']':
+  case '}':
+    return -1;
   }
-  return rx;
+  return 0;
 }
 
-int rowRxToCx(erow* row, int rx)
+void bracketCount(const char* render, const unsigned char* hl, int len,
+    struct Brackets* b)
 {
-  int cur_rx = 0;
-  int cx;
-  for (cx = 0; cx < row->size; cx++) {
-    if (row->chars[cx] == '\t')
-      cur_rx += (TAB_STOP - 1) - (cur_rx % TAB_STOP);
-    cur_rx++;
-
-    if (cur_rx > rx)
-      return cx;
+  b->sum = 0;
+  b->min = 0;
+  for (int i = 0; i < len; i++) {
+    if (hl[i] != HL_NORMAL || bracketDir(render[i]) == 0)
+      continue;
+    b->sum += bracketDir(render[i]);
+    if (b->sum < b->min)
+      b->min = b->sum;
   }
-  return cx;
 }
 
-void updateRow(erow* row)
+// Append the counts of b to a.
+void bracketJoin(struct Brackets* a, const struct Brackets* b)
 {
-  int tabs = 0;
-  int j;
-  for (j = 0; j < row->size; j++)
-    if (row->chars[j] == '\t')
-      tabs++;
+  if (a->sum + b->min < a->min)
+    a->min = a->sum + b->min;
+  a->sum += b->sum;
+}
 
-  free(row->render);
-  row->render = malloc(row->size + tabs * (TAB_STOP - 1) + 1);
+// Bytes of UTF-8 chars count as word chars, so words aren't split.
+int isWordChar(unsigned char c)
+{
+  return isalnum(c) || c == '_' || c >= 0x80;
+}
 
-  int idx = 0;
-  for (j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
-      while (idx % TAB_STOP != 0)
-        row->render[idx++] = ' ';
-    } else {
-      row->render[idx++] = row->chars[j];
-    }
+int wordNode(int parent, unsigned char c)
+{
+  struct Words* W = &S.words;
+  if (W->nnodes == W->cap) {
+    W->cap = W->cap ? W->cap * 2 : 1024;
+    W->node = realloc(W->node, sizeof(struct WordNode) * W->cap);
   }
-  row->render[idx] = '\0';
-  row->rsize = idx;
-
-  updateSyntax(row);
+  struct WordNode* n = &W->node[W->nnodes];
+  memset(n, 0, sizeof(*n));
+  n->c = c;
+  n->parent = parent;
+  if (W->nnodes > 0) {
+    n->len = W->node[parent].len + 1;
+    n->next = W->node[parent].child;
+    W->node[parent].child = W->nnodes;
+  }
+  return W->nnodes++;
 }
 
-void insertRow(int at, char* s, size_t len)
+/*
+ * Count an occurrence of s and return its node. A child found is moved to
+ * the front of its siblings, so common words are found in a step or two.
+ */
+int wordAdd(const char* s, int len)
 {
-  if (at < 0 || at > S.numrows)
-    return;
-
-  S.row = realloc(S.row, sizeof(erow) * (S.numrows + 1));
-  memmove(&S.row[at + 1], &S.row[at], sizeof(erow) * (S.numrows - at));
-  for (int j = at + 1; j <= S.numrows; j++)
-    S.row[j].idx++;
+  struct Words* W = &S.words;
+  if (W->nnodes == 0)
+    wordNode(0, 0);
+  int k = 0;
+  W->node[0].total++;
+  for (int i = 0; i < len; i++) {
+    int prev = 0, j = W->node[k].child;
+    while (j && W->node[j].c != (unsigned char)s[i]) {
+      prev = j;
+      j = W->node[j].next;
+    }
+    if (j == 0) {
+      j = wordNode(k, s[i]);
+    } else if (prev) {
+      W->node[prev].next = W->node[j].next;
+      W->node[j].next = W->node[k].child;
+      W->node[k].child = j;
+    }
+    k = j;
+    W->node[k].total++;
+  }
+  W->node[k].count++;
+  return k;
+}
 
-  S.row[at].idx = at;
+void wordDrop(int k)
+{
+  S.words.node[k].count--;
+  for (; k; k = S.words.node[k].parent)
+    S.words.node[k].total--;
+  S.words.node[0].total--;
+}
 
-  S.row[at].size = len;
-  S.row[at].chars = malloc(len + 1);
-  memcpy(S.row[at].chars, s, len);
-  S.row[at].chars[len] = '\0';
+void wordsClear(int** words, int* nwords)
+{
+  for (int j = 0; j < *nwords; j++)
+    wordDrop((*words)[j]);
+  free(*words);
+  *words = NULL;
+  *nwords = 0;
+}
 
-  S.row[at].rsize = 0;
-  S.row[at].render = NULL;
-  S.row[at].hl = NULL;
-  S.row[at].hl_open_comment = 0;
-  updateRow(&S.row[at]);
+/*
+ * Index the words starting in render[0, len) after it was lexed into hl,
+ * and drop the ones *words held from the last time. A word is counted
+ * where it starts, running into the lookahead up to avail; with cut set
+ * the text goes on past avail, so a word reaching it is left out.
+ */
+void wordsScan(const char* render, const unsigned char* hl, int len,
+    int avail, int cut, struct LexState* st, int** words, int* nwords)
+{
+  struct Words* W = &S.words;
+  int n = 0;
+  int i = 0;
+  if (st->prev_word)
+    while (i < len && isWordChar(render[i]))
+      i++;
+  while (i < len) {
+    if (!isWordChar(render[i])) {
+      i++;
+      continue;
+    }
+    int j = i;
+    while (j < avail && isWordChar(render[j]))
+      j++;
+    int code = hl[i] == HL_NORMAL || hl[i] == HL_KEYWORD_PRIMARY
+        || hl[i] == HL_KEYWORD_SECONDARY;
+    if (code && !isdigit((unsigned char)render[i]) && j - i >= WORD_MIN
+        && j - i <= WORD_MAX && !(cut && j == avail)) {
+      if (n == W->scancap) {
+        W->scancap = W->scancap ? W->scancap * 2 : 256;
+        W->scan = realloc(W->scan, sizeof(int) * W->scancap);
+      }
+      W->scan[n++] = wordAdd(&render[i], j - i);
+    }
+    i = j;
+  }
+  if (len > 0)
+    st->prev_word = isWordChar(render[len - 1]);
+
+  for (int j = 0; j < *nwords; j++)
+    wordDrop((*words)[j]);
+  if (n != *nwords) {
+    free(*words);
+    *words = n ? malloc(sizeof(int) * n) : NULL;
+    *nwords = n;
+  }
+  if (n)
+    memcpy(*words, W->scan, sizeof(int) * n);
+}
 
-  S.numrows++;
-  S.dirty++;
+// Code points shown in two columns, and ones that take none.
+const int wide_chars[][2] = { { 0x1100, 0x115F }, { 0x231A, 0x231B },
+  { 0x2329, 0x232A }, { 0x23E9, 0x23EC }, { 0x23F0, 0x23F0 },
+  { 0x23F3, 0x23F3 }, { 0x25FD, 0x25FE }, { 0x2614, 0x2615 },
+  { 0x2648, 0x2653 }, { 0x267F, 0x267F }, { 0x2693, 0x2693 },
+  { 0x26A1, 0x26A1 }, { 0x26AA, 0x26AB }, { 0x26BD, 0x26BE },
+  { 0x26C4, 0x26C5 }, { 0x26CE, 0x26CE }, { 0x26D4, 0x26D4 },
+  { 0x26EA, 0x26EA }, { 0x26F2, 0x26F3 }, { 0x26F5, 0x26F5 },
+  { 0x26FA, 0x26FA }, { 0x26FD, 0x26FD }, { 0x2705, 0x2705 },
+  { 0x270A, 0x270B }, { 0x2728, 0x2728 }, { 0x274C, 0x274C },
+  { 0x274E, 0x274E }, { 0x2753, 0x2755 }, { 0x2757, 0x2757 },
+  { 0x2795, 0x2797 }, { 0x27B0, 0x27B0 }, { 0x27BF, 0x27BF },
+  { 0x2B1B, 0x2B1C }, { 0x2B50, 0x2B50 }, { 0x2B55, 0x2B55 },
+  { 0x2E80, 0x303E }, { 0x3041, 0x33FF }, { 0x3400, 0x4DBF },
+  { 0x4E00, 0x9FFF }, { 0xA000, 0xA4CF }, { 0xA960, 0xA97F },
+  { 0xAC00, 0xD7A3 }, { 0xF900, 0xFAFF }, { 0xFE10, 0xFE19 },
+  { 0xFE30, 0xFE6F }, { 0xFF00, 0xFF60 }, { 0xFFE0, 0xFFE6 },
+  { 0x16FE0, 0x16FE4 }, { 0x17000, 0x18CFF }, { 0x1B000, 0x1B2FF },
+  { 0x1F004, 0x1F004 }, { 0x1F0CF, 0x1F0CF }, { 0x1F18E, 0x1F18E },
+  { 0x1F191, 0x1F19A }, { 0x1F200, 0x1F251 }, { 0x1F300, 0x1F64F },
+  { 0x1F680, 0x1F6FF }, { 0x1F900, 0x1F9FF }, { 0x1FA70, 0x1FAFF },
+  { 0x20000, 0x2FFFD }, { 0x30000, 0x3FFFD } };
+const int zero_width_chars[][2] = { { 0x0300, 0x036F }, { 0x0483, 0x0489 },
+  { 0x0591, 0x05BD }, { 0x0610, 0x061A }, { 0x064B, 0x065F },
+  { 0x0E31, 0x0E31 }, { 0x0E34, 0x0E3A }, { 0x0E47, 0x0E4E },
+  { 0x1AB0, 0x1AFF }, { 0x1DC0, 0x1DFF }, { 0x200B, 0x200F },
+  { 0x202A, 0x202E }, { 0x2060, 0x2064 }, { 0x20D0, 0x20FF },
+  { 0xFE00, 0xFE0F }, { 0xFE20, 0xFE2F }, { 0xFEFF, 0xFEFF },
+  { 0xE0100, 0xE01EF } };
+
+int inRanges(int cp, const int (*ranges)[2], int n)
+{
+  int lo = 0, hi = n - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (cp < ranges[mid][0])
+      hi = mid - 1;
+    else if (cp > ranges[mid][1])
+      lo = mid + 1;
+    else
+      return 1;
+  }
+  return 0;
 }
 
-void freeRow(erow* row)
+// Screen columns for a code point; invalid bytes (-1) show as one '?'.
+int charWidth(int cp)
 {
-  free(row->render);
-  free(row->chars);
-  free(row->hl);
+  if (cp < 0x300)
+    return 1;
+  if (inRanges(cp, zero_width_chars,
+          sizeof(zero_width_chars) / sizeof(zero_width_chars[0])))
+    return 0;
+  if (inRanges(cp, wide_chars, sizeof(wide_chars) / sizeof(wide_chars[0])))
+    return 2;
+  return 1;
 }
 
-void delRow(int at)
+/*
+ * Decode the UTF-8 sequence at s, returning its length. Bytes that don't
+ * start a valid sequence decode one at a time as -1.
+ */
+int utf8Decode(const char* s, int len, int* cp)
 {
-  if (at < 0 || at >= S.numrows)
-    return;
-  freeRow(&S.row[at]);
-  memmove(&S.row[at], &S.row[at + 1], sizeof(erow) * (S.numrows - at - 1));
-  for (int j = at; j < S.numrows - 1; j++)
-    S.row[j].idx--;
-  S.numrows--;
-  S.dirty++;
+  unsigned char c = s[0];
+  *cp = -1;
+  if (c < 0x80) {
+    *cp = c;
+    return 1;
+  }
+  int n = (c >= 0xC2 && c < 0xE0) ? 2 : (c >= 0xE0 && c < 0xF0) ? 3
+      : (c >= 0xF0 && c < 0xF5)                                 ? 4
+                                                                : 0;
+  if (n == 0 || n > len)
+    return 1;
+  int v = c & (0x7F >> n);
+  for (int j = 1; j < n; j++) {
+    if ((s[j] & 0xC0) != 0x80)
+      return 1;
+    v = (v << 6) | (s[j] & 0x3F);
+  }
+  if ((n == 3 && v < 0x800) || (n == 4 && (v < 0x10000 || v > 0x10FFFF))
+      || (v >= 0xD800 && v <= 0xDFFF))
+    return 1;
+  *cp = v;
+  return n;
 }
 
-void rowInsertChar(erow* row, int at, int c)
+// Start of the char that ends at cx.
+int utf8Prev(const char* s, int cx)
 {
-  if (at < 0 || at > row->size)
-    at = row->size;
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  row->size++;
-  row->chars[at] = c;
-  updateRow(row);
-  S.dirty++;
+  int lead = cx - 1;
+  while (lead > 0 && cx - lead < 4 && (s[lead] & 0xC0) == 0x80)
+    lead--;
+  int cp;
+  if (utf8Decode(&s[lead], cx - lead, &cp) == cx - lead)
+    return lead;
+  return cx - 1;
 }
 
-void rowAppendString(erow* row, char* s, size_t len)
+int isContinuation(char c) { return (c & 0xC0) == 0x80; }
+
+int colField(struct ColPos* p, int field)
 {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  updateRow(row);
-  S.dirty++;
+  return field == COL_CX ? p->cx : field == COL_RX ? p->rx : p->ri;
 }
 
-void rowDelChar(erow* row, int at)
+// Move p past the char at p->cx.
+void colStep(erow* row, struct ColPos* p)
 {
-  if (at < 0 || at >= row->size)
+  if (row->chars[p->cx] == '\t') {
+    int w = TAB_STOP - p->rx % TAB_STOP;
+    p->cx++;
+    p->rx += w;
+    p->ri += w;
     return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
-  updateRow(row);
-  S.dirty++;
+  }
+  int cp;
+  int n = utf8Decode(&row->chars[p->cx], row->size - p->cx, &cp);
+  p->cx += n;
+  p->rx += charWidth(cp);
+  p->ri += n;
 }
 
-void insertChar(int c)
+// Advance p to the last char before end that starts at or before value.
+void colWalk(erow* row, struct ColPos* p, int field, int value, int end)
 {
-  if (S.cy == S.numrows) {
-    insertRow(S.numrows, "", 0);
+  while (p->cx < end) {
+    struct ColPos next = *p;
+    colStep(row, &next);
+    if (colField(&next, field) > value)
+      break;
+    *p = next;
   }
-  rowInsertChar(&S.row[S.cy], S.cx, c);
-  S.cx++;
 }
 
-void insertNewline()
+// Expand tabs in chars [from, to) of row, starting at screen column rx.
+int renderChars(erow* row, int from, int to, int rx, char* out)
 {
-  if (S.cx == 0) {
-    insertRow(S.cy, "", 0);
-  } else {
-    erow* row = &S.row[S.cy];
-    insertRow(S.cy + 1, &row->chars[S.cx], row->size - S.cx);
-    row = &S.row[S.cy];
-    row->size = S.cx;
-    row->chars[row->size] = '\0';
-    updateRow(row);
+  struct ColPos p = { from, rx, 0 };
+  while (p.cx < to) {
+    int cx = p.cx, ri = p.ri;
+    colStep(row, &p);
+    if (row->chars[cx] == '\t')
+      memset(&out[ri], ' ', p.ri - ri);
+    else
+      memcpy(&out[ri], &row->chars[cx], p.cx - cx);
   }
-  S.cy++;
-  S.cx = 0;
+  return p.ri;
 }
 
-void delChar()
+void segDropCache(erow* row, struct Segment* seg)
 {
-  if (S.cy == S.numrows)
-    return;
-  if (S.cx == 0 && S.cy == 0)
+  if (seg->render == NULL)
     return;
+  free(seg->render);
+  free(seg->hl);
+  seg->render = NULL;
+  seg->hl = NULL;
+  row->cached--;
+}
 
-  erow* row = &S.row[S.cy];
-  if (S.cx > 0) {
-    rowDelChar(row, S.cx - 1);
-    S.cx--;
-  } else {
-    S.cx = S.row[S.cy - 1].size;
-    rowAppendString(&S.row[S.cy - 1], row->chars, row->size);
-    delRow(S.cy);
-    S.cy--;
+void segFree(erow* row)
+{
+  for (int j = 0; j < row->nsegs; j++) {
+    segDropCache(row, &row->segs[j]);
+    wordsClear(&row->segs[j].words, &row->segs[j].nwords);
   }
+  free(row->segs);
+  row->segs = NULL;
+  row->nsegs = 0;
 }
 
-char* rowsToString(int* buflen)
+// First char boundary at or after pos.
+int segBoundary(erow* row, int pos)
 {
-  int totlen = 0;
-  int j;
-  for (j = 0; j < S.numrows; j++)
-    totlen += S.row[j].size + 1;
-  *buflen = totlen;
-
-  char* buf = malloc(totlen);
-  char* p = buf;
-  for (j = 0; j < S.numrows; j++) {
-    memcpy(p, S.row[j].chars, S.row[j].size);
-    p += S.row[j].size;
-    *p = '\n';
-    p++;
+  while (pos < row->size && isContinuation(row->chars[pos]))
+    pos++;
+  return pos < row->size ? pos : row->size;
+}
+
+// Switch row to segments, dropping its full render.
+void segBuild(erow* row)
+{
+  free(row->render);
+  free(row->hl);
+  free(row->marks);
+  row->render = NULL;
+  row->hl = NULL;
+  row->marks = NULL;
+  row->nmarks = 0;
+  row->rsize = 0;
+  wordsClear(&row->words, &row->nwords);
+
+  row->segs = calloc(row->size / SEGMENT_SIZE + 1, sizeof(struct Segment));
+  row->nsegs = 0;
+  for (int pos = 0; pos < row->size;) {
+    struct Segment* seg = &row->segs[row->nsegs++];
+    int end = segBoundary(row, pos + SEGMENT_SIZE);
+    seg->start = pos;
+    seg->len = end - pos;
+    seg->phase = -1;
+    seg->stale = 1;
+    pos = end;
   }
+  row->rx_valid = 1;
+  row->cached = 0;
+}
 
-  return buf;
+// Segment holding char offset cx.
+int segFind(erow* row, int cx)
+{
+  int lo = 0, hi = row->nsegs - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (row->segs[mid].start <= cx)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
 }
 
-void ares_open(char* filename)
+int segWidth(erow* row, struct Segment* seg)
 {
-  free(S.filename);
-  S.filename = strdup(filename);
+  int phase = seg->rx % TAB_STOP;
+  if (seg->phase == phase || (seg->phase != -1 && seg->tabs == 0))
+    return seg->width;
 
-  selectSyntaxHighlight();
+  struct ColPos p = { seg->start, seg->rx, 0 };
+  int tabs = 0;
+  while (p.cx < seg->start + seg->len) {
+    if (row->chars[p.cx] == '\t')
+      tabs++;
+    colStep(row, &p);
+  }
+  seg->width = p.rx - seg->rx;
+  seg->rsize = p.ri;
+  seg->tabs = tabs;
+  seg->phase = phase;
+  return seg->width;
+}
 
-  FILE* fp = fopen(filename, "r");
-  if (!fp)
-    die("fopen");
+// Make segs[upto].rx valid. Only segments with tabs ever need a rescan.
+void segResolve(erow* row, int upto)
+{
+  for (; row->rx_valid <= upto && row->rx_valid < row->nsegs; row->rx_valid++) {
+    struct Segment* prev = &row->segs[row->rx_valid - 1];
+    struct Segment* seg = &row->segs[row->rx_valid];
+    int rx = prev->rx + segWidth(row, prev);
+    if (seg->render && seg->tabs && rx % TAB_STOP != seg->rx % TAB_STOP)
+      segDropCache(row, seg);
+    seg->rx = rx;
+  }
+}
 
-  char* line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    while (
-        linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-      linelen--;
-    insertRow(S.numrows, line, linelen);
+// Segment holding render column rx.
+int segFindRx(erow* row, int rx)
+{
+  while (row->rx_valid < row->nsegs && row->segs[row->rx_valid - 1].rx <= rx)
+    segResolve(row, row->rx_valid);
+
+  int lo = 0, hi = row->rx_valid - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (row->segs[mid].rx <= rx)
+      lo = mid;
+    else
+      hi = mid - 1;
   }
-  free(line);
-  fclose(fp);
-  S.dirty = 0;
+  return lo;
 }
 
-void ares_save()
+/*
+ * Segment k changed at char offset at. Lexing of earlier segments looks up
+ * to LEX_LOOKAHEAD chars past their end, so those that reach at go too.
+ */
+void segTouch(erow* row, int k, int at)
 {
-  if (S.filename == NULL) {
-    S.filename = ares_prompt("Save as: %s (ESC to cancel)", NULL);
-    if (S.filename == NULL) {
-      setStatusMessage("Save aborted");
+  row->segs[k].phase = -1;
+  row->segs[k].stale = 1;
+  if (row->rx_valid > k + 1)
+    row->rx_valid = k + 1;
+  for (int j = k - 1;
+       j >= 0 && row->segs[j].start + row->segs[j].len + LEX_LOOKAHEAD > at;
+       j--)
+    row->segs[j].stale = 1;
+}
+
+// Break an oversized segment back into SEGMENT_SIZE pieces.
+void segSplit(erow* row, int k)
+{
+  segDropCache(row, &row->segs[k]);
+  struct Segment seg = row->segs[k];
+  int end = seg.start + seg.len;
+  int n = 0;
+  for (int pos = seg.start; pos < end; n++)
+    pos = segBoundary(row, pos + SEGMENT_SIZE);
+
+  row->segs = realloc(row->segs, sizeof(struct Segment) * (row->nsegs + n - 1));
+  memmove(&row->segs[k + n], &row->segs[k + 1],
+      sizeof(struct Segment) * (row->nsegs - k - 1));
+  row->nsegs += n - 1;
+
+  int pos = seg.start;
+  for (int j = 0; j < n; j++) {
+    struct Segment* piece = &row->segs[k + j];
+    int next = j + 1 < n ? segBoundary(row, pos + SEGMENT_SIZE) : end;
+    memset(piece, 0, sizeof(*piece));
+    piece->start = pos;
+    piece->len = next - pos;
+    piece->phase = -1;
+    piece->stale = 1;
+    pos = next;
+  }
+  row->segs[k].rx = seg.rx;
+  row->segs[k].in = seg.in;
+  row->segs[k].words = seg.words;
+  row->segs[k].nwords = seg.nwords;
+}
+
+/*
+ * Move continuation bytes at the start of segment k to the one before it,
+ * so no char is split between segments.
+ */
+void segAlign(erow* row, int k)
+{
+  for (; k > 0 && k < row->nsegs; k++) {
+    struct Segment* seg = &row->segs[k];
+    if (seg->len == 0 || !isContinuation(row->chars[seg->start]))
       return;
+    while (seg->len > 0 && isContinuation(row->chars[seg->start])) {
+      seg->start++;
+      seg->len--;
+      row->segs[k - 1].len++;
     }
-    selectSyntaxHighlight();
+    segTouch(row, k - 1, seg->start);
+    segTouch(row, k, seg->start);
+    if (seg->len > 0)
+      return;
   }
+}
 
-  int len;
-  char* buf = rowsToString(&len);
+void segInsert(erow* row, int at, int len)
+{
+  int k = segFind(row, at);
+  if (k > 0 && at == row->segs[k].start && isContinuation(row->chars[at]))
+    k--;
+  row->segs[k].len += len;
+  for (int j = k + 1; j < row->nsegs; j++)
+    row->segs[j].start += len;
+  segTouch(row, k, at);
+  if (row->segs[k].len > 2 * SEGMENT_SIZE)
+    segSplit(row, k);
+}
 
-  int fd = open(S.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        S.dirty = 0;
-        setStatusMessage("%d bytes written to disk", len);
-        return;
-      }
+void segDelete(erow* row, int at, int len)
+{
+  int end = at + len;
+  int k = segFind(row, at);
+  int j;
+  for (j = k; j < row->nsegs && row->segs[j].start < end; j++) {
+    struct Segment* seg = &row->segs[j];
+    int lo = seg->start > at ? seg->start : at;
+    int hi = seg->start + seg->len < end ? seg->start + seg->len : end;
+    seg->len -= hi - lo;
+  }
+
+  // Drop segments left empty, keeping at least one.
+  int n = k;
+  for (int i = k; i < row->nsegs; i++) {
+    struct Segment* seg = &row->segs[i];
+    if (i < j && seg->len == 0 && (n > 0 || i + 1 < row->nsegs)) {
+      segDropCache(row, seg);
+      wordsClear(&seg->words, &seg->nwords);
+      continue;
     }
-    close(fd);
+    if (i < j) {
+      seg->phase = -1;
+      seg->stale = 1;
+    }
+    row->segs[n++] = *seg;
   }
+  row->nsegs = n;
+  for (int i = k; i < n; i++)
+    row->segs[i].start = i ? row->segs[i - 1].start + row->segs[i - 1].len : 0;
+
+  if (k >= n)
+    k = n - 1;
+  row->segs[0].rx = 0;
+  if (row->rx_valid > k)
+    row->rx_valid = k > 0 ? k : 1;
+  segTouch(row, k, at);
+  segAlign(row, k);
+  segAlign(row, k + 1);
+}
 
-  free(buf);
-  setStatusMessage("Can't save! I/O error: %s", strerror(errno));
+// Lex segment j from st, keeping its render and highlight if keep is set.
+void segLex(erow* row, int j, struct LexState* st, int keep)
+{
+  segResolve(row, j);
+  struct Segment* seg = &row->segs[j];
+  segWidth(row, seg);
+  int end = seg->start + seg->len;
+  int ahead = row->size - end < LEX_LOOKAHEAD ? row->size - end : LEX_LOOKAHEAD;
+
+  // The lookahead may end inside a multibyte char, which then runs over.
+  int cap = seg->rsize + ahead * TAB_STOP + 4;
+  char* render = malloc(cap);
+  unsigned char* hl = malloc(cap);
+  renderChars(row, seg->start, end, seg->rx, render);
+  int avail = seg->rsize
+      + renderChars(row, end, end + ahead, seg->rx + seg->width,
+          &render[seg->rsize]);
+  render[avail] = '\0';
+  lexSpan(render, seg->rsize, avail, hl, st);
+  bracketCount(render, hl, seg->rsize, &seg->br);
+  wordsScan(render, hl, seg->rsize, avail, end + ahead < row->size, st,
+      &seg->words, &seg->nwords);
+
+  segDropCache(row, seg);
+  if (keep) {
+    seg->render = render;
+    seg->hl = hl;
+    row->cached++;
+  } else {
+    free(render);
+    free(hl);
+  }
 }
 
-void ares_push_cb(char* query, int key)
+/*
+ * Relex the stale segments of a long row, given the state it starts in.
+ * Lexing moves on to the next segment only while the state handed to it
+ * differs from what it was last lexed with, so an edit costs one segment
+ * unless it opens or closes a comment or string.
+ */
+void segSyntax(erow* row, struct LexState* st)
 {
-  if (key == 'y' || key == 'Y') {
-    int add_result = system("git push");
+  struct Segment* segs = row->segs;
+  if (memcmp(&segs[0].in, st, sizeof(*st))) {
+    segs[0].in = *st;
+    segs[0].stale = 1;
+  }
 
-    if (add_result != 0) {
-      setStatusMessage("Git push failed");
-      return;
+  unsigned int state = row->hl_state;
+  for (int j = 0; j < row->nsegs; j++) {
+    if (!segs[j].stale)
+      continue;
+    struct LexState out = segs[j].in;
+    segLex(row, j, &out, segs[j].render != NULL);
+    segs[j].stale = 0;
+    if (j + 1 == row->nsegs) {
+      state = out.state;
+    } else if (memcmp(&segs[j + 1].in, &out, sizeof(out))) {
+      segs[j + 1].in = out;
+      segs[j + 1].stale = 1;
     }
   }
-  return;
+  st->state = state;
 }
 
-void ares_commit_cb(char* query, int key)
+// Segment j ready to draw, lexed from its entry state if it wasn't cached.
+struct Segment* segCached(erow* row, int j)
 {
-  if (key == '\r') {
+  segResolve(row, j);
+  struct Segment* seg = &row->segs[j];
+  if (seg->render == NULL) {
+    struct LexState st = seg->in;
+    segLex(row, j, &st, 1);
+  }
+  return seg;
+}
 
-    char add_command[512];
+// Paint chars [cx, cx + len) in the cached segments, until they are relexed.
+void segHighlight(erow* row, int cx, int len, int hl)
+{
+  for (int j = segFind(row, cx);
+       j < row->nsegs && row->segs[j].start < cx + len; j++) {
+    struct Segment* seg = segCached(row, j);
+    int end = seg->start + seg->len;
+    struct ColPos from = { seg->start, seg->rx, 0 };
+    colWalk(row, &from, COL_CX, cx, end);
+    struct ColPos to = from;
+    colWalk(row, &to, COL_CX, cx + len - 1, end);
+    if (len > 0 && to.cx < end)
+      colStep(row, &to);
+    memset(&seg->hl[from.ri], hl, to.ri - from.ri);
+  }
+}
 
-    snprintf(add_command, sizeof(add_command), "git add %s", S.filename);
+// Drop the cached segments of row outside [lo, hi].
+void segEvict(erow* row, int lo, int hi)
+{
+  if (row->cached <= hi - lo + 1)
+    return;
+  for (int j = 0; j < row->nsegs; j++)
+    if (j < lo || j > hi)
+      segDropCache(row, &row->segs[j]);
+}
 
-    int add_result = system(add_command);
+/*
+ * Highlight row, then the rows below it for as long as the lexer state
+ * handed down keeps changing. Stale rows on the way are rendered first.
+ */
+void updateSyntax(erow* row)
+{
+  for (;;) {
+    STAT_START(syntax_start);
+    struct LexState st;
+    memset(&st, 0, sizeof(st));
+    st.prev_sep = 1;
+    int at = rowIndex(row);
+    st.state = S.syntax && at > 0 ? S.row[at - 1].hl_state : 0;
+
+    if (row->segs) {
+      segSyntax(row, &st);
+    } else {
+      row->hl = realloc(row->hl, row->rsize);
+      lexSpan(row->render, row->rsize, row->rsize, row->hl, &st);
+      wordsScan(row->render, row->hl, row->rsize, row->rsize, 0, &st,
+          &row->words, &row->nwords);
+    }
 
-    if (add_result != 0) {
-      setStatusMessage("Git add failed");
+    unsigned int state = lexRowEnd(st.state);
+    int changed = (row->hl_state != state);
+    row->hl_state = state;
+    rowBrackets(row);
+    STAT_STOP(STAT_SYNTAX, syntax_start);
+    if (!changed || at + 1 >= S.numrows)
       return;
+    row = &S.row[at + 1];
+    if (row->stale) {
+      row->stale = 0;
+      renderRow(row);
     }
+  }
+}
 
-    char commit_command[512];
-    snprintf(
-        commit_command, sizeof(commit_command), "git commit -m \"%s\"", query);
-
-    int commit_result = system(commit_command);
-
-    if (commit_result == 0) {
-      setStatusMessage("Commit successful");
-    } else {
-      setStatusMessage("Commit failed");
-    }
+char* syntaxToColor(int hl)
+{
+  switch (hl) {
+  case HL_STRING:
+    return STRING_HIGHLIGHT_COLOR;
+  case HL_NUMBER:
+    return NUMBER_HIGHLIGHT_COLOR;
+  case HL_COMMENT:
+  case HL_ML_COMMENT:
+    return COMMENT_HIGHLIGHT_COLOR;
+  case HL_MATCH:
+    return SEARCH_MATCH_HIGHLIGHT_COLOR;
+  case HL_BRACKET:
+    return BRACKET_MATCH_HIGHLIGHT_COLOR;
+  case HL_KEYWORD_PRIMARY:
+    return KEYWORD_PRIMARY_HIGHLIGHT_COLOR;
+  case HL_KEYWORD_SECONDARY:
+    return KEYWORD_SECONDARY_HIGHLIGHT_COLOR;
+  default:
+    return DEFAULT_HIGHLIGHT_COLOR;
   }
 }
 
-void ares_commit()
+void selectSyntaxHighlight()
 {
-  int saved_cx = S.cx;
-  int saved_cy = S.cy;
-  int saved_coloff = S.coloff;
-  int saved_rowoff = S.rowoff;
+  S.syntax = NULL;
+  if (S.filename == NULL)
+    return;
 
-  char* query = ares_prompt("Commit Message: %s", ares_commit_cb);
-  if (query) {
-    char* push_query = ares_prompt("Push changes (y/n): %s", ares_push_cb);
+  // Later definitions win, those from files over the built in ones.
+  for (int j = HLDB_ENTRIES - 1; j >= 0; j--) {
+    struct Syntax* s = HLDB[j];
+    unsigned int i = 0;
+    while (s->filematch[i]) {
+      char* p = strstr(S.filename, s->filematch[i]);
+      if (p != NULL) {
+        int patlen = strlen(s->filematch[i]);
+        if (s->filematch[i][0] != '.' || p[patlen] == '\0'
+            || !strcmp(&p[patlen], ".gz")) {
+          S.syntax = s;
+
+          int filerow;
+          for (filerow = 0; filerow < S.numrows; filerow++) {
+            erow* row = &S.row[filerow];
+            for (int j = 0; j < row->nsegs; j++)
+              row->segs[j].stale = 1;
+            if (row->stale)
+              rowReady(row);
+            else
+              updateSyntax(row);
+          }
+
+          return;
+        }
+      }
+      i++;
+    }
   }
+}
 
-  if (query) {
-    free(query);
+/*
+ * Find the char holding position value, given in field. Plain rows map
+ * directly, other rows walk from the nearest column index entry and long
+ * rows from the start of the segment (ri is then relative to it).
+ */
+struct ColPos rowSeek(erow* row, int field, int value)
+{
+  rowReady(row);
+  struct ColPos p = { 0, 0, 0 };
+  int end = row->size;
+  if (row->segs) {
+    int k = field == COL_CX ? segFind(row, value) : segFindRx(row, value);
+    segResolve(row, k);
+    p.cx = row->segs[k].start;
+    p.rx = row->segs[k].rx;
+    end = p.cx + row->segs[k].len;
+  } else if (row->marks == NULL) {
+    p.cx = value < row->size ? value : row->size;
+    p.rx = p.ri = p.cx;
+    return p;
   } else {
-    S.cx = saved_cx;
-    S.cy = saved_cy;
-    S.coloff = saved_coloff;
-    S.rowoff = saved_rowoff;
+    int lo = 0, hi = row->nmarks - 1;
+    while (lo < hi) {
+      int mid = (lo + hi + 1) / 2;
+      if (colField(&row->marks[mid], field) <= value)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+    p = row->marks[lo];
   }
+  colWalk(row, &p, field, value, end);
+  return p;
 }
 
-void ares_goto_cb(char* query, int key)
+int rowCxToRx(erow* row, int cx) { return rowSeek(row, COL_CX, cx).rx; }
+
+int rowRxToCx(erow* row, int rx) { return rowSeek(row, COL_RX, rx).cx; }
+
+/*
+ * Rebuild the render of a short row, and its column index unless every
+ * byte is plain ASCII and one column wide.
+ */
+void renderRow(erow* row)
 {
-  if (key == '\r' || key == '\x1b') {
-    int target = atoi(query) - 1;
-    if (target <= S.numrows && target >= 0) {
-      S.cy = target;
-    } else {
-      setStatusMessage("You cant do that :(");
-    }
+  wrapChanged(row);
+  if (row->size > LONG_ROW) {
+    if (row->segs == NULL)
+      segBuild(row);
     return;
   }
+  if (row->segs)
+    segFree(row);
+
+  int tabs = 0, plain = 1;
+  int j;
+  for (j = 0; j < row->size; j++) {
+    if (row->chars[j] == '\t')
+      tabs++;
+    else if ((unsigned char)row->chars[j] >= 0x80)
+      plain = 0;
+  }
+
+  free(row->render);
+  free(row->marks);
+  row->render = malloc(row->size + tabs * (TAB_STOP - 1) + 1);
+  row->marks = NULL;
+  row->nmarks = 0;
+  if (plain && tabs == 0) {
+    memcpy(row->render, row->chars, row->size);
+    row->rsize = row->size;
+  } else {
+    row->marks
+        = malloc(sizeof(struct ColPos) * (row->size / COL_CHECKPOINT + 1));
+    struct ColPos p = { 0, 0, 0 };
+    while (p.cx < row->size) {
+      if (p.cx >= row->nmarks * COL_CHECKPOINT)
+        row->marks[row->nmarks++] = p;
+      int cx = p.cx, ri = p.ri;
+      colStep(row, &p);
+      if (row->chars[cx] == '\t')
+        memset(&row->render[ri], ' ', p.ri - ri);
+      else
+        memcpy(&row->render[ri], &row->chars[cx], p.cx - cx);
+    }
+    row->rsize = p.ri;
+  }
+  row->render[row->rsize] = '\0';
 }
 
-void ares_goto()
+void updateRow(erow* row)
 {
-  char* query = ares_prompt("Goto Line: %s", ares_goto_cb);
+  renderRow(row);
+  updateSyntax(row);
+}
 
-  if (query) {
-    free(query);
+// Render a row left stale by a batch or loaded from the cache.
+void rowReady(erow* row)
+{
+  if (row->stale) {
+    row->stale = 0;
+    updateRow(row);
   }
 }
 
-void ares_find_cb(char* query, int key)
+// Idle task: render the rows loaded from the cache before they're scrolled to.
+int idleHighlight(long long deadline)
 {
-  static int last_match = -1;
-  static int direction = 1;
+  while (S.loop.hl_next < S.numrows) {
+    rowReady(&S.row[S.loop.hl_next++]);
+    if (S.loop.hl_next % 256 == 0 && nowUs() >= deadline)
+      return 1;
+  }
+  return 0;
+}
 
-  static int saved_hl_line;
-  static char* saved_hl = NULL;
+/*
+ * Row contents changed. Inside a batch the render and highlight update is
+ * deferred to endBatch, so a bulk change re-highlights each row only once.
+ * Every command runs in a batch, so a key that makes several edits (an
+ * auto-paired bracket, a tab, a split line) pays for each row once.
+ */
+void rowChanged(erow* row)
+{
+  if (S.batch == 0) {
+    updateRow(row);
+    return;
+  }
+  row->stale = 1;
+  int at = rowIndex(row);
+  if (at < S.batch_lo)
+    S.batch_lo = at;
+  if (at > S.batch_hi)
+    S.batch_hi = at;
+}
 
-  if (saved_hl) {
-    memcpy(S.row[saved_hl_line].hl, saved_hl, S.row[saved_hl_line].rsize);
-    free(saved_hl);
-    saved_hl = NULL;
+void beginBatch()
+{
+  if (S.batch++ == 0) {
+    S.batch_lo = INT_MAX;
+    S.batch_hi = -1;
   }
+}
 
-  if (key == '\r' || key == '\x1b') {
-    last_match = -1;
-    direction = 1;
+void endBatch()
+{
+  if (--S.batch > 0)
     return;
-  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-    direction = 1;
-  } else if (key == ARROW_LEFT || key == ARROW_UP) {
-    direction = -1;
-  } else {
-    last_match = -1;
-    direction = 1;
+  for (int j = S.batch_lo; j <= S.batch_hi && j < S.numrows; j++) {
+    if (S.row[j].stale) {
+      S.row[j].stale = 0;
+      updateRow(&S.row[j]);
+    }
   }
+}
 
-  if (last_match == -1)
-    direction = 1;
-  int current = last_match;
-  int i;
-  for (i = 0; i < S.numrows; i++) {
-    current += direction;
-    if (current == -1)
-      current = S.numrows - 1;
-    else if (current == S.numrows)
-      current = 0;
+// Rows from at on moved, their nodes are rebuilt by indexUpdate.
+void indexInvalidate(struct RowIndex* I, int at)
+{
+  if (at < I->valid)
+    I->valid = at;
+  idleQueue(&S.loop.index);
+}
 
-    erow* row = &S.row[current];
-    char* match = strstr(row->render, query);
-    if (match) {
-      last_match = current;
-      S.cy = current;
-      S.cx = rowRxToCx(row, match - row->render);
-      S.rowoff = S.numrows;
+// The weight of row at changed by delta.
+void indexAdd(struct RowIndex* I, int at, long long delta)
+{
+  for (int i = at + 1; i <= I->valid; i += i & -i)
+    I->tree[i] += delta;
+}
 
-      saved_hl_line = current;
-      saved_hl = malloc(row->rsize);
-      memcpy(saved_hl, row->hl, row->rsize);
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-      break;
-    }
+/*
+ * Rebuild the nodes from valid up to n in linear time: each node starts as
+ * its own row and is pushed into its parent, after the valid nodes whose
+ * parent lies in the rebuilt part.
+ */
+void indexUpdate(struct RowIndex* I, int n)
+{
+  if (I->valid >= n)
+    return;
+  if (n + 1 > I->cap) {
+    I->cap = (S.numrows + 1) * 2;
+    I->tree = realloc(I->tree, sizeof(long long) * I->cap);
   }
+  int i;
+  for (i = I->valid + 1; i <= n; i++)
+    I->tree[i] = I->weight(&S.row[i - 1]);
+  for (i = I->valid; i > 0; i -= i & -i)
+    if (i + (i & -i) <= n)
+      I->tree[i + (i & -i)] += I->tree[i];
+  for (i = I->valid + 1; i <= n; i++)
+    if (i + (i & -i) <= n)
+      I->tree[i + (i & -i)] += I->tree[i];
+  I->valid = n;
+}
+
+// Sum of the weights of the rows before at.
+long long indexSum(struct RowIndex* I, int at)
+{
+  if (at > S.numrows)
+    at = S.numrows;
+  indexUpdate(I, at);
+  long long sum = 0;
+  for (int i = at; i > 0; i -= i & -i)
+    sum += I->tree[i];
+  return sum;
+}
+
+/*
+ * Row whose weight covers off, or numrows past the end. Only the valid
+ * prefix is searched, so it is extended until it reaches off.
+ */
+int indexFind(struct RowIndex* I, long long off)
+{
+  while (I->valid < S.numrows && indexSum(I, I->valid) <= off) {
+    int n = I->valid > 65536 ? I->valid * 2 : I->valid + 65536;
+    indexUpdate(I, n < S.numrows ? n : S.numrows);
+  }
+  int step = 1, at = 0;
+  while (step * 2 <= I->valid)
+    step *= 2;
+  for (; step > 0; step /= 2) {
+    if (at + step <= I->valid && I->tree[at + step] <= off) {
+      at += step;
+      off -= I->tree[at];
+    }
+  }
+  return at;
+}
+
+// Idle task: extend the indexes to the end of the file ahead of the queries.
+int idleIndex(long long deadline)
+{
+  struct RowIndex* all[] = { &S.bytes, &S.wrap.lines };
+  for (int k = 0; k < 2; k++) {
+    struct RowIndex* I = all[k];
+    if (I == &S.wrap.lines && !S.wrap.on)
+      continue;
+    while (I->valid < S.numrows) {
+      int n = S.numrows - I->valid > 65536 ? I->valid + 65536 : S.numrows;
+      indexUpdate(I, n);
+      if (nowUs() >= deadline)
+        return 1;
+    }
+  }
+  return 0;
+}
+
+long long byteWeight(erow* row) { return row->size + 1; }
+
+/*
+ * Find where the visual lines of a row start at the wrap width. Lines are
+ * cut every cols columns, a tab being spaces that can be split, unless a
+ * wide char would be cut at the edge: it moves down whole, and only rows
+ * where that happens keep a list of line starts.
+ */
+void wrapCompute(erow* row)
+{
+  int cols = S.wrap.cols;
+  free(row->wraps);
+  row->wraps = NULL;
+  row->wrap_gen = S.wrap.gen;
+
+  int j, rx = 0;
+  for (j = 0; j < row->size; j++) {
+    if (row->chars[j] == '\t')
+      rx += TAB_STOP - rx % TAB_STOP;
+    else if ((unsigned char)row->chars[j] < 0x80)
+      rx++;
+    else
+      break;
+  }
+  if (j == row->size) {
+    row->nlines = rx ? (rx + cols - 1) / cols : 1;
+    return;
+  }
+
+  int n = 0, cap = 0, start = 0;
+  struct ColPos p = { 0, 0, 0 };
+  while (p.cx < row->size) {
+    struct ColPos q = p;
+    int tab = row->chars[p.cx] == '\t';
+    colStep(row, &q);
+    while (q.rx > start + cols && (tab || p.rx > start)) {
+      start = tab && p.rx < start + cols ? start + cols : p.rx;
+      n++;
+      if (row->wraps == NULL) {
+        if (start == n * cols)
+          continue;
+        cap = n * 2;
+        row->wraps = malloc(sizeof(int) * cap);
+        for (int k = 0; k < n - 1; k++)
+          row->wraps[k] = (k + 1) * cols;
+      } else if (n > cap) {
+        cap *= 2;
+        row->wraps = realloc(row->wraps, sizeof(int) * cap);
+      }
+      row->wraps[n - 1] = start;
+    }
+    p = q;
+  }
+  row->nlines = n + 1;
+}
+
+long long wrapLines(erow* row)
+{
+  if (row->wrap_gen != S.wrap.gen)
+    wrapCompute(row);
+  return row->nlines;
+}
+
+// Screen column visual line k of a row starts at.
+int wrapStart(erow* row, int k)
+{
+  if (k == 0)
+    return 0;
+  return row->wraps ? row->wraps[k - 1] : k * S.wrap.cols;
+}
+
+// Visual line of a row that screen column rx is on.
+int wrapLineOf(erow* row, int rx)
+{
+  int last = wrapLines(row) - 1;
+  if (row->wraps == NULL)
+    return rx / S.wrap.cols < last ? rx / S.wrap.cols : last;
+  int lo = 0, hi = last;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (row->wraps[mid - 1] <= rx)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+// Row contents changed: wrap it again and correct its count in the index.
+void wrapChanged(erow* row)
+{
+  if (!S.wrap.on || row->wrap_gen != S.wrap.gen)
+    return;
+  long long old = row->nlines;
+  wrapCompute(row);
+  int at = rowIndex(row);
+  if (at < S.wrap.lines.valid)
+    indexAdd(&S.wrap.lines, at, row->nlines - old);
+}
+
+// Every row's wrap is out of date, after a toggle or a change of width.
+void wrapReset()
+{
+  S.wrap.gen++;
+  S.wrap.cols = textCols() > 0 ? textCols() : 1;
+  indexInvalidate(&S.wrap.lines, 0);
+}
+
+void bracketInvalidate(int at)
+{
+  if (at < S.brackets.valid)
+    S.brackets.valid = at;
+  idleQueue(&S.loop.brackets);
+}
+
+/*
+ * Bring the leaves below n up to date, and the nodes above them whose
+ * leaves are all below n.
+ */
+void bracketUpdate(int n)
+{
+  struct BracketTree* B = &S.brackets;
+  if (S.numrows > B->size) {
+    while (B->size < S.numrows)
+      B->size = B->size ? B->size * 2 : 1024;
+    B->node = realloc(B->node, sizeof(struct Brackets) * 2 * B->size);
+    memset(B->node, 0, sizeof(struct Brackets) * 2 * B->size);
+    B->valid = 0;
+  }
+  if (B->valid >= n)
+    return;
+
+  for (int i = B->valid; i < n; i++) {
+    rowReady(&S.row[i]);
+    B->node[B->size + i] = S.row[i].br;
+  }
+  int lo = B->size + B->valid, hi = B->size + n - 1;
+  while (lo > 1) {
+    lo /= 2;
+    hi = (hi + 1) / 2 - 1;
+    for (int k = lo; k <= hi; k++) {
+      B->node[k] = B->node[2 * k];
+      bracketJoin(&B->node[k], &B->node[2 * k + 1]);
+    }
+  }
+  B->valid = n;
+}
+
+// Idle task: rebuild the tree to the end of the file, then redraw.
+int idleBrackets(long long deadline)
+{
+  struct BracketTree* B = &S.brackets;
+  while (B->valid < S.numrows) {
+    int n = S.numrows - B->valid > 4096 ? B->valid + 4096 : S.numrows;
+    bracketUpdate(n);
+    if (nowUs() >= deadline)
+      return 1;
+  }
+  if (B->pending)
+    S.loop.redraw = 1;
+  B->pending = 0;
+  return 0;
+}
+
+// Row at was lexed again, after an edit or a change of lexer state.
+void rowBrackets(erow* row)
+{
+  struct Brackets b = { 0, 0 };
+  if (row->segs) {
+    for (int j = 0; j < row->nsegs; j++)
+      bracketJoin(&b, &row->segs[j].br);
+  } else {
+    bracketCount(row->render, row->hl, row->rsize, &b);
+  }
+  if (b.sum == row->br.sum && b.min == row->br.min)
+    return;
+  row->br = b;
+
+  struct BracketTree* B = &S.brackets;
+  int at = rowIndex(row);
+  if (at >= B->valid)
+    return;
+  int k = B->size + at, width = 1;
+  B->node[k] = b;
+  for (; k > 1; k /= 2, width *= 2) {
+    int end = (k / 2) * width * 2 - B->size + width * 2;
+    if (end > B->valid)
+      break;
+    B->node[k / 2] = B->node[k & ~1];
+    bracketJoin(&B->node[k / 2], &B->node[k | 1]);
+  }
+}
+
+/*
+ * Scan the brackets of render[from, to) forward (dir 1) or backward, with
+ * depth counting unmatched opens going forward and closes going back.
+ * Returns the render index where depth reaches 0, or -1.
+ */
+int bracketScan(const char* render, const unsigned char* hl, int from, int to,
+    int dir, int* depth)
+{
+  for (int i = dir > 0 ? from : to - 1; i >= from && i < to; i += dir) {
+    if (hl[i] != HL_NORMAL || bracketDir(render[i]) == 0)
+      continue;
+    *depth += bracketDir(render[i]) * dir;
+    if (*depth == 0)
+      return i;
+  }
+  return -1;
+}
+
+/*
+ * Look for the bracket that brings depth to 0 in a row, after cx going
+ * forward or before it going back; cx may be -1 or size for the whole row.
+ * Returns its cx, or -1 with depth carried past the row. Long rows skip
+ * the segments the match can't be in.
+ */
+int rowBracketFind(erow* row, int cx, int dir, int* depth)
+{
+  rowReady(row);
+  if (row->segs == NULL) {
+    int ri = cx < 0 ? -1
+        : cx >= row->size ? row->rsize
+                          : rowSeek(row, COL_CX, cx).ri;
+    int i = dir > 0
+        ? bracketScan(row->render, row->hl, ri + 1, row->rsize, 1, depth)
+        : bracketScan(row->render, row->hl, 0, ri, -1, depth);
+    return i == -1 ? -1 : rowSeek(row, COL_RI, i).cx;
+  }
+
+  int inside = cx >= 0 && cx < row->size;
+  int first = inside ? segFind(row, cx) : dir > 0 ? 0 : row->nsegs - 1;
+  for (int j = first; j >= 0 && j < row->nsegs; j += dir) {
+    struct Brackets* b = &row->segs[j].br;
+    if (j != first || !inside) {
+      if (dir > 0 ? *depth + b->min > 0 : *depth - (b->sum - b->min) > 0) {
+        *depth += b->sum * dir;
+        continue;
+      }
+    }
+    struct Segment* seg = segCached(row, j);
+    int end = seg->start + seg->len;
+    int from = 0, to = seg->rsize;
+    if (j == first && inside) {
+      struct ColPos p = { seg->start, seg->rx, 0 };
+      colWalk(row, &p, COL_CX, cx, end);
+      if (dir > 0)
+        from = p.ri + 1;
+      else
+        to = p.ri;
+    }
+    int i = bracketScan(seg->render, seg->hl, from, to, dir, depth);
+    if (i != -1) {
+      struct ColPos p = { seg->start, seg->rx, 0 };
+      colWalk(row, &p, COL_RI, i, end);
+      return p.cx;
+    }
+  }
+  return -1;
+}
+
+// First row in [lo, hi) where depth, carried forward, reaches 0.
+int bracketDown(int k, int nlo, int nhi, int lo, int hi, int* depth)
+{
+  if (nhi <= lo || nlo >= hi)
+    return -1;
+  struct Brackets* b = &S.brackets.node[k];
+  if (nlo >= lo && nhi <= hi && *depth + b->min > 0) {
+    *depth += b->sum;
+    return -1;
+  }
+  if (nhi - nlo == 1)
+    return nlo;
+  int mid = (nlo + nhi) / 2;
+  int r = bracketDown(2 * k, nlo, mid, lo, hi, depth);
+  return r != -1 ? r : bracketDown(2 * k + 1, mid, nhi, lo, hi, depth);
+}
+
+// Last row below hi where depth, carried backward, reaches 0.
+int bracketUp(int k, int nlo, int nhi, int hi, int* depth)
+{
+  if (nlo >= hi)
+    return -1;
+  struct Brackets* b = &S.brackets.node[k];
+  if (nhi <= hi && *depth - (b->sum - b->min) > 0) {
+    *depth -= b->sum;
+    return -1;
+  }
+  if (nhi - nlo == 1)
+    return nlo;
+  int mid = (nlo + nhi) / 2;
+  int r = bracketUp(2 * k + 1, mid, nhi, hi, depth);
+  return r != -1 ? r : bracketUp(2 * k, nlo, mid, hi, depth);
+}
+
+/*
+ * Find the bracket that brings depth to 0 going from (at, cx) in direction
+ * dir, in the row itself and then through the tree. Searching forward only
+ * brings as much of the tree up to date as it needs, in growing chunks.
+ * With lazy set it goes at most a chunk past the current part of the tree;
+ * if the match is further it gives up and sets pending for idleBrackets.
+ */
+int bracketSearch(int at, int cx, int dir, int depth, int* mrow, int* mcx,
+    int lazy)
+{
+  struct BracketTree* B = &S.brackets;
+  int found = rowBracketFind(&S.row[at], cx, dir, &depth);
+  if (found == -1 && dir > 0) {
+    int row = -1, end = at + 1, limit = S.numrows;
+    if (lazy && B->valid < limit)
+      limit = B->valid > end + 1024 ? B->valid
+          : limit - end > 1024      ? end + 1024
+                                    : limit;
+    for (int chunk = 1024; row == -1 && end < limit; chunk *= 2) {
+      int n = limit - end > chunk ? end + chunk : limit;
+      bracketUpdate(n);
+      row = bracketDown(1, 0, B->size, end, n, &depth);
+      end = n;
+    }
+    if (row == -1 && limit < S.numrows) {
+      B->pending = 1;
+      idleQueue(&S.loop.brackets);
+    }
+    at = row;
+  } else if (found == -1) {
+    if (lazy && at > B->valid + 1024) {
+      B->pending = 1;
+      idleQueue(&S.loop.brackets);
+      return 0;
+    }
+    bracketUpdate(at);
+    at = bracketUp(1, 0, B->size, at, &depth);
+  }
+  if (found == -1 && at != -1)
+    found = rowBracketFind(&S.row[at], dir > 0 ? -1 : S.row[at].size, dir,
+        &depth);
+  if (found == -1)
+    return 0;
+  *mrow = at;
+  *mcx = found;
+  return 1;
+}
+
+// Whether the char at cx is a bracket outside strings and comments.
+int rowIsBracket(erow* row, int cx)
+{
+  if (cx < 0 || cx >= row->size || bracketDir(row->chars[cx]) == 0)
+    return 0;
+  rowReady(row);
+  if (row->segs == NULL)
+    return row->hl[rowSeek(row, COL_CX, cx).ri] == HL_NORMAL;
+  struct Segment* seg = segCached(row, segFind(row, cx));
+  struct ColPos p = { seg->start, seg->rx, 0 };
+  colWalk(row, &p, COL_CX, cx, seg->start + seg->len);
+  return seg->hl[p.ri] == HL_NORMAL;
+}
+
+/*
+ * The bracket under the cursor (or just before it) and its match, or else
+ * the brackets of the innermost block the cursor is in. Returns how many
+ * of the two were found, with *on set in the first case. See bracketSearch
+ * for lazy.
+ */
+int bracketPair(int rows[2], int cxs[2], int* on, int lazy)
+{
+  *on = 0;
+  if (S.cy >= S.numrows)
+    return 0;
+  erow* row = &S.row[S.cy];
+  for (int cx = S.cx; cx >= S.cx - 1 && cx >= 0; cx--) {
+    if (!rowIsBracket(row, cx))
+      continue;
+    *on = 1;
+    rows[0] = S.cy;
+    cxs[0] = cx;
+    int dir = bracketDir(row->chars[cx]);
+    return 1 + bracketSearch(S.cy, cx, dir, 1, &rows[1], &cxs[1], lazy);
+  }
+  if (!bracketSearch(S.cy, S.cx, -1, 1, &rows[0], &cxs[0], lazy))
+    return 0;
+  return 1 + bracketSearch(rows[0], cxs[0], 1, 1, &rows[1], &cxs[1], lazy);
+}
+
+// Jump to the bracket matching the one at the cursor, or the block's start.
+void ares_bracket()
+{
+  int rows[2], cxs[2], on;
+  int n = bracketPair(rows, cxs, &on, 0);
+  if (n == 0 || (on && n == 1)) {
+    setStatusMessage("No matching bracket");
+    return;
+  }
+  S.cy = rows[on];
+  S.cx = cxs[on];
+}
+
+/*
+ * Find the brackets to highlight in the next frame. It runs every frame, so
+ * a match far into the part of the tree an edit invalidated is left out
+ * until the idle task has rebuilt it, instead of costing O(n) per key.
+ */
+void bracketHighlight()
+{
+  struct BracketTree* B = &S.brackets;
+  int on;
+  B->pending = 0;
+  B->nmarks = bracketPair(B->mark_row, B->mark_cx, &on, 1);
+  if (B->pending && B->nmarks < 2)
+    B->nmarks = 0;
+}
+
+// Mark the highlighted brackets in a row's hl, or put them back to normal.
+void bracketMark(erow* row, int hl)
+{
+  struct BracketTree* B = &S.brackets;
+  for (int j = 0; j < B->nmarks; j++) {
+    if (B->mark_row[j] != rowIndex(row))
+      continue;
+    if (row->segs)
+      segHighlight(row, B->mark_cx[j], 1, hl);
+    else
+      row->hl[rowSeek(row, COL_CX, B->mark_cx[j]).ri] = hl;
+  }
+}
+
+// Byte offset in the file of the start of row at.
+long long rowOffset(int at)
+{
+  if (at >= S.numrows)
+    return S.bytes.total;
+  return indexSum(&S.bytes, at);
+}
+
+// Row holding byte offset off, or numrows past the end of the file.
+int offsetRow(long long off) { return indexFind(&S.bytes, off); }
+
+// Row at changed length by delta.
+void bytesAdd(int at, int delta)
+{
+  S.bytes.total += delta;
+  indexAdd(&S.bytes, at, delta);
+}
+
+void recordEdit(int op, int a, int b, const char* s, int len)
+{
+  journalRecord(op, a, b, s, len);
+  undoRecord(op, a, b, s, len);
+  diffTouch(op, a);
+}
+
+void initRow(erow* row, const char* s, size_t len)
+{
+
+  row->size = len;
+  row->chars = malloc(len + 1);
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
+
+  row->rsize = 0;
+  row->render = NULL;
+  row->hl = NULL;
+  row->marks = NULL;
+  row->nmarks = 0;
+  row->segs = NULL;
+  row->nsegs = 0;
+  row->wraps = NULL;
+  row->nlines = 0;
+  row->wrap_gen = 0;
+  row->hl_state = 0;
+  row->br.sum = 0;
+  row->br.min = 0;
+  row->words = NULL;
+  row->nwords = 0;
+  row->stale = 0;
+  row->snap = 0;
+  row->head = -1;
+  row->diff = 0;
+  row->diff_stale = 1;
+}
+
+void insertRow(int at, char* s, size_t len)
+{
+  if (at < 0 || at > S.numrows)
+    return;
+
+  if (S.numrows == S.rowcap) {
+    S.rowcap = S.rowcap ? S.rowcap * 2 : 64;
+    S.row = realloc(S.row, sizeof(erow) * S.rowcap);
+  }
+  memmove(&S.row[at + 1], &S.row[at], sizeof(erow) * (S.numrows - at));
+  if (S.batch && at <= S.batch_hi) {
+    S.batch_hi++;
+    if (at <= S.batch_lo)
+      S.batch_lo++;
+  }
+
+  initRow(&S.row[at], s, len);
+  // Start from the state the row below used to get, so it is re-highlighted
+  // if the new row hands down a different one.
+  if (at > 0)
+    S.row[at].hl_state = S.row[at - 1].hl_state;
+  S.numrows++;
+  indexInvalidate(&S.bytes, at);
+  indexInvalidate(&S.wrap.lines, at);
+  bracketInvalidate(at);
+  S.bytes.total += len + 1;
+  rowChanged(&S.row[at]);
+
+  S.dirty++;
+  recordEdit(EDIT_INSERT_ROW, at, 0, s, len);
+}
+
+int rowShared(erow* row)
+{
+  return S.save && row->snap == S.save->gen;
+}
+
+void saveOrphan(char* chars)
+{
+  struct SaveJob* job = S.save;
+  if (job->norphans == job->orphancap) {
+    job->orphancap = job->orphancap ? job->orphancap * 2 : 64;
+    job->orphans = realloc(job->orphans, sizeof(char*) * job->orphancap);
+  }
+  job->orphans[job->norphans++] = chars;
+}
+
+// Give row its own copy of chars if a background save still reads them.
+void rowDetach(erow* row)
+{
+  if (!rowShared(row))
+    return;
+  char* copy = malloc(row->size + 1);
+  memcpy(copy, row->chars, row->size + 1);
+  saveOrphan(row->chars);
+  row->chars = copy;
+  row->snap = 0;
+}
+
+void freeRow(erow* row)
+{
+  segFree(row);
+  wordsClear(&row->words, &row->nwords);
+  free(row->marks);
+  free(row->wraps);
+  free(row->render);
+  if (rowShared(row))
+    saveOrphan(row->chars);
+  else
+    free(row->chars);
+  free(row->hl);
+}
+
+/*
+ * Drop the render and highlight of a row in a hidden buffer. It is lexed
+ * again when next needed, from the lexer state it keeps; its bracket
+ * counts and words stay indexed.
+ */
+void rowEvict(erow* row)
+{
+  if (row->segs) {
+    segEvict(row, 0, -1);
+    return;
+  }
+  if (row->stale)
+    return;
+  free(row->render);
+  free(row->hl);
+  free(row->marks);
+  row->render = NULL;
+  row->hl = NULL;
+  row->marks = NULL;
+  row->nmarks = 0;
+  row->rsize = 0;
+  row->stale = 1;
+}
+
+void delRow(int at)
+{
+  if (at < 0 || at >= S.numrows)
+    return;
+  recordEdit(EDIT_DEL_ROW, at, 0, S.row[at].chars, S.row[at].size);
+  S.bytes.total -= S.row[at].size + 1;
+  unsigned int state = S.row[at].hl_state;
+  freeRow(&S.row[at]);
+  memmove(&S.row[at], &S.row[at + 1], sizeof(erow) * (S.numrows - at - 1));
+  if (S.batch && at < S.batch_hi) {
+    S.batch_hi--;
+    if (at < S.batch_lo)
+      S.batch_lo--;
+  }
+  S.numrows--;
+  indexInvalidate(&S.bytes, at);
+  indexInvalidate(&S.wrap.lines, at);
+  bracketInvalidate(at);
+  if (at < S.numrows
+      && state != (at > 0 ? S.row[at - 1].hl_state : 0))
+    rowChanged(&S.row[at]);
+  S.dirty++;
+}
+
+void rowInsertString(erow* row, int at, char* s, size_t len)
+{
+  if (at < 0 || at > row->size)
+    at = row->size;
+  rowDetach(row);
+  row->chars = realloc(row->chars, row->size + len + 1);
+  memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+  memcpy(&row->chars[at], s, len);
+  row->size += len;
+  bytesAdd(rowIndex(row), len);
+  if (row->segs)
+    segInsert(row, at, len);
+  rowChanged(row);
+  S.dirty++;
+  recordEdit(EDIT_INSERT_TEXT, rowIndex(row), at, &row->chars[at], len);
+}
+
+void rowDelRange(erow* row, int at, int len)
+{
+  if (at < 0 || len <= 0 || at + len > row->size)
+    return;
+  rowDetach(row);
+  recordEdit(EDIT_DEL_TEXT, rowIndex(row), at, &row->chars[at], len);
+  memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+  row->size -= len;
+  bytesAdd(rowIndex(row), -len);
+  if (row->segs)
+    segDelete(row, at, len);
+  rowChanged(row);
+  S.dirty++;
+}
+
+void rowInsertChar(erow* row, int at, int c)
+{
+  char ch = c;
+  rowInsertString(row, at, &ch, 1);
+}
+
+void rowAppendString(erow* row, char* s, size_t len)
+{
+  rowInsertString(row, row->size, s, len);
+}
+
+void rowDelChar(erow* row, int at) { rowDelRange(row, at, 1); }
+
+void rowTruncate(erow* row, int size)
+{
+  if (size >= 0)
+    rowDelRange(row, size, row->size - size);
+}
+
+void undoPush(struct UndoLog* log, struct UndoOp* u)
+{
+  if (log->start + log->len == log->cap) {
+    if (log->start > log->cap / 2) {
+      memmove(log->ops, &log->ops[log->start],
+          sizeof(struct UndoOp) * log->len);
+      log->start = 0;
+    } else {
+      log->cap = log->cap ? log->cap * 2 : 256;
+      log->ops = realloc(log->ops, sizeof(struct UndoOp) * log->cap);
+    }
+  }
+  log->ops[log->start + log->len++] = *u;
+}
+
+struct UndoOp* undoTop(struct UndoLog* log)
+{
+  return log->len ? &log->ops[log->start + log->len - 1] : NULL;
+}
+
+void undoClear(struct UndoLog* log)
+{
+  for (int j = 0; j < log->len; j++) {
+    struct UndoOp* u = &log->ops[log->start + j];
+    S.undo.bytes -= sizeof(struct UndoOp) + u->len;
+    free(u->text);
+  }
+  log->start = 0;
+  log->len = 0;
+}
+
+// Drop the oldest groups until the history fits in UNDO_MEMORY_MAX.
+void undoTrim()
+{
+  struct UndoLog* log = &S.undo.done;
+  while (S.undo.bytes > UNDO_MEMORY_MAX && log->len > 0) {
+    unsigned int group = log->ops[log->start].group;
+    if (group == S.undo.group)
+      break;
+    while (log->len > 0 && log->ops[log->start].group == group) {
+      struct UndoOp* u = &log->ops[log->start];
+      S.undo.bytes -= sizeof(struct UndoOp) + u->len;
+      free(u->text);
+      log->start++;
+      log->len--;
+    }
+  }
+}
+
+/*
+ * Start a new undo group for the command bound to key. Only plain typing
+ * may extend the previous group.
+ */
+void undoBoundary(int key)
+{
+  S.undo.boundary = 1;
+  S.undo.cx = S.cx;
+  S.undo.cy = S.cy;
+  if (key < 32 || key == BACKSPACE || key > 255)
+    S.undo.coalesce = 0;
+}
+
+void undoRecord(int op, int row, int col, const char* s, int len)
+{
+  if (S.undo.applying || S.undo.suspended)
+    return;
+  undoClear(&S.undo.undone);
+
+  // Consecutive character inserts extend the last op instead of adding one.
+  struct UndoOp* last = undoTop(&S.undo.done);
+  if (op == EDIT_INSERT_TEXT && last && last->op == EDIT_INSERT_TEXT
+      && last->row == row && last->col + last->len == col
+      && (!S.undo.boundary || S.undo.coalesce)) {
+    last->text = realloc(last->text, last->len + len);
+    memcpy(&last->text[last->len], s, len);
+    last->len += len;
+    S.undo.bytes += len;
+    S.undo.boundary = 0;
+    undoTrim();
+    return;
+  }
+
+  if (S.undo.boundary) {
+    S.undo.group++;
+    S.undo.boundary = 0;
+    S.undo.coalesce = 1;
+  }
+  if (op != EDIT_INSERT_TEXT)
+    S.undo.coalesce = 0;
+
+  struct UndoOp u = { op, row, col, len, malloc(len ? len : 1), S.undo.group,
+    S.undo.cx, S.undo.cy };
+  memcpy(u.text, s, len);
+  undoPush(&S.undo.done, &u);
+  S.undo.bytes += sizeof(struct UndoOp) + len;
+  undoTrim();
+}
+
+void undoApply(struct UndoOp* u, int inverse)
+{
+  int op = u->op;
+  if (inverse) {
+    switch (op) {
+    case EDIT_INSERT_ROW:
+      op = EDIT_DEL_ROW;
+      break;
+    case EDIT_DEL_ROW:
+      op = EDIT_INSERT_ROW;
+      break;
+    case EDIT_INSERT_TEXT:
+      op = EDIT_DEL_TEXT;
+      break;
+    case EDIT_DEL_TEXT:
+      op = EDIT_INSERT_TEXT;
+      break;
+    }
+  }
+
+  if (op != EDIT_INSERT_ROW && u->row >= S.numrows)
+    return;
+  switch (op) {
+  case EDIT_INSERT_ROW:
+    insertRow(u->row, u->text, u->len);
+    break;
+  case EDIT_DEL_ROW:
+    delRow(u->row);
+    break;
+  case EDIT_INSERT_TEXT:
+    rowInsertString(&S.row[u->row], u->col, u->text, u->len);
+    break;
+  case EDIT_DEL_TEXT:
+    rowDelRange(&S.row[u->row], u->col, u->len);
+    break;
+  }
+}
+
+/*
+ * Move the most recent group from one log to the other, applying each op
+ * (or its inverse when undoing) inside a single batch.
+ */
+int undoMoveGroup(struct UndoLog* from, struct UndoLog* to, int inverse)
+{
+  struct UndoOp* top = undoTop(from);
+  if (top == NULL)
+    return 0;
+
+  unsigned int group = top->group;
+  S.undo.applying = 1;
+  beginBatch();
+  while ((top = undoTop(from)) && top->group == group) {
+    struct UndoOp u = *top;
+    from->len--;
+    undoApply(&u, inverse);
+    undoPush(to, &u);
+    if (inverse) {
+      S.cx = u.cx;
+      S.cy = u.cy;
+    } else {
+      S.cy = u.row;
+      S.cx = u.col + (u.op == EDIT_INSERT_TEXT ? u.len : 0);
+    }
+  }
+  endBatch();
+  S.undo.applying = 0;
+  S.undo.coalesce = 0;
+
+  if (S.cy > S.numrows)
+    S.cy = S.numrows;
+  int rowlen = S.cy < S.numrows ? S.row[S.cy].size : 0;
+  if (S.cx > rowlen)
+    S.cx = rowlen;
+  return 1;
+}
+
+void ares_undo()
+{
+  if (!undoMoveGroup(&S.undo.done, &S.undo.undone, 1))
+    setStatusMessage("Nothing to undo");
+}
+
+void ares_redo()
+{
+  if (!undoMoveGroup(&S.undo.undone, &S.undo.done, 0))
+    setStatusMessage("Nothing to redo");
+}
+
+void insertChar(int c)
+{
+  if (S.cy == S.numrows) {
+    insertRow(S.numrows, "", 0);
+  }
+  rowInsertChar(&S.row[S.cy], S.cx, c);
+  S.cx++;
+}
+
+void insertNewline()
+{
+  if (S.cx == 0) {
+    insertRow(S.cy, "", 0);
+  } else {
+    erow* row = &S.row[S.cy];
+    insertRow(S.cy + 1, &row->chars[S.cx], row->size - S.cx);
+    rowTruncate(&S.row[S.cy], S.cx);
+  }
+  S.cy++;
+  S.cx = 0;
+}
+
+void delChar()
+{
+  if (S.cy == S.numrows)
+    return;
+  if (S.cx == 0 && S.cy == 0)
+    return;
+
+  erow* row = &S.row[S.cy];
+  if (S.cx > 0) {
+    int prev = utf8Prev(row->chars, S.cx);
+    rowDelRange(row, prev, S.cx - prev);
+    S.cx = prev;
+  } else {
+    S.cx = S.row[S.cy - 1].size;
+    rowAppendString(&S.row[S.cy - 1], row->chars, row->size);
+    delRow(S.cy);
+    S.cy--;
+  }
+}
+
+/*
+ * Write an iovec array to fd, retrying on short writes and EINTR so that a
+ * partial write never gets mistaken for success or failure.
+ */
+int writeAllv(int fd, struct iovec* iov, int iovcnt)
+{
+  while (iovcnt > 0) {
+    ssize_t n = writev(fd, iov, iovcnt);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char*)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Stream every snapshot row straight from the row buffers to fd, a batch of
+ * SAVE_IOV_BATCH / 2 rows (row chunk + newline) per writev call. No copy of
+ * the file is ever built in memory.
+ */
+int writeRows(int fd, struct SaveJob* job)
+{
+  struct iovec iov[SAVE_IOV_BATCH];
+  int iovcnt = 0;
+  long long pending = 0;
+
+  for (int j = 0; j < job->numrows; j++) {
+    if (job->rows[j].size > 0) {
+      iov[iovcnt].iov_base = job->rows[j].chars;
+      iov[iovcnt].iov_len = job->rows[j].size;
+      iovcnt++;
+    }
+    iov[iovcnt].iov_base = "\n";
+    iov[iovcnt].iov_len = 1;
+    iovcnt++;
+    pending += job->rows[j].size + 1;
+
+    if (iovcnt >= SAVE_IOV_BATCH - 1) {
+      if (writeAllv(fd, iov, iovcnt) == -1)
+        return -1;
+      atomic_fetch_add(&job->written, pending);
+      iovcnt = 0;
+      pending = 0;
+    }
+  }
+  if (iovcnt > 0 && writeAllv(fd, iov, iovcnt) == -1)
+    return -1;
+  atomic_fetch_add(&job->written, pending);
+
+  return 0;
+}
+
+/*
+ * Deflate len bytes into the gzip stream, writing the output out a full
+ * buffer at a time; Z_FINISH ends the stream and writes what's left.
+ */
+int gzipPut(z_stream* z, int fd, unsigned char* out, const void* s, int len,
+    int flush)
+{
+  z->next_in = (unsigned char*)s;
+  z->avail_in = len;
+  for (;;) {
+    int r = deflate(z, flush);
+    if (r == Z_STREAM_ERROR) {
+      errno = EIO;
+      return -1;
+    }
+    if (z->avail_out == 0 || flush == Z_FINISH) {
+      struct iovec iov = { out, GZIP_BUF - z->avail_out };
+      if (iov.iov_len && writeAllv(fd, &iov, 1) == -1)
+        return -1;
+      z->next_out = out;
+      z->avail_out = GZIP_BUF;
+    }
+    if (flush == Z_FINISH ? r == Z_STREAM_END : z->avail_in == 0)
+      return 0;
+  }
+}
+
+// writeRows for a gzip file: the rows are compressed as they're streamed.
+int writeRowsGzip(int fd, struct SaveJob* job)
+{
+  z_stream z;
+  memset(&z, 0, sizeof(z));
+  if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+          Z_DEFAULT_STRATEGY)
+      != Z_OK) {
+    errno = ENOMEM;
+    return -1;
+  }
+  unsigned char* out = malloc(GZIP_BUF);
+  z.next_out = out;
+  z.avail_out = GZIP_BUF;
+
+  int result = 0;
+  long long pending = 0;
+  for (int j = 0; j < job->numrows && result == 0; j++) {
+    result = gzipPut(&z, fd, out, job->rows[j].chars, job->rows[j].size,
+        Z_NO_FLUSH);
+    if (result == 0)
+      result = gzipPut(&z, fd, out, "\n", 1, Z_NO_FLUSH);
+    pending += job->rows[j].size + 1;
+    if (j % (SAVE_IOV_BATCH / 2) == 0) {
+      atomic_fetch_add(&job->written, pending);
+      pending = 0;
+    }
+  }
+  if (result == 0)
+    result = gzipPut(&z, fd, out, NULL, 0, Z_FINISH);
+  atomic_fetch_add(&job->written, pending);
+
+  int saved_errno = errno;
+  deflateEnd(&z);
+  free(out);
+  errno = saved_errno;
+  return result;
+}
+
+/*
+ * Append text read from the file to the end of the buffer, splitting it into
+ * rows; *partial carries over a last line still missing its newline. This is
+ * file content rather than an edit, so it is neither journaled nor undoable
+ * and leaves the dirty count alone. Rows are highlighted once, at endBatch.
+ */
+void appendText(char* buf, int len, int* partial)
+{
+  int dirty = S.dirty;
+  S.journal.suspended++;
+  S.undo.suspended++;
+  beginBatch();
+
+  char* end = buf + len;
+  while (buf < end) {
+    char* nl = memchr(buf, '\n', end - buf);
+    int linelen = (nl ? nl : end) - buf;
+    if (nl && linelen > 0 && buf[linelen - 1] == '\r')
+      linelen--;
+    if (*partial && S.numrows > 0) {
+      erow* row = &S.row[S.numrows - 1];
+      rowAppendString(row, buf, linelen);
+      if (nl && linelen == 0 && row->size > 0
+          && row->chars[row->size - 1] == '\r')
+        rowTruncate(row, row->size - 1);
+    } else {
+      insertRow(S.numrows, buf, linelen);
+    }
+    *partial = nl == NULL;
+    buf = nl ? nl + 1 : end;
+  }
+
+  endBatch();
+  S.undo.suspended--;
+  S.journal.suspended--;
+  S.dirty = dirty;
+}
+
+void followStart(int fd, int pipe)
+{
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  S.follow.fd = fd;
+  S.follow.pipe = pipe;
+}
+
+// Keep reading the open file from where ares_open stopped, like tail -f.
+void followFile()
+{
+  int fd = open(S.filename, O_RDONLY);
+  if (fd == -1 || lseek(fd, S.follow.offset, SEEK_SET) == -1)
+    die("open");
+  followStart(fd, 0);
+  S.follow.tail = 1;
+  S.cy = S.numrows ? S.numrows - 1 : 0;
+  timerArm(&S.loop.follow, FOLLOW_POLL_MS);
+}
+
+// Read the buffer from the pipe on stdin, and keys from the terminal.
+void followStdin()
+{
+  int fd = dup(STDIN_FILENO);
+  int tty = open("/dev/tty", O_RDWR);
+  if (fd == -1 || tty == -1 || dup2(tty, STDIN_FILENO) == -1)
+    die("/dev/tty");
+  close(tty);
+  followStart(fd, 1);
+}
+
+void followStop(const char* why)
+{
+  close(S.follow.fd);
+  S.follow.fd = -1;
+  setStatusMessage("%s %s", S.filename ? S.filename : "stdin", why);
+}
+
+/*
+ * Append whatever the followed file or pipe has ready, spending at most
+ * FOLLOW_BUDGET_MS so a fast writer can't starve the keyboard. Returns 1 if
+ * the buffer changed.
+ */
+int followPoll()
+{
+  struct Follow* F = &S.follow;
+  if (F->fd == -1)
+    return 0;
+
+  int tail = F->tail && S.cy >= S.numrows - 1;
+  int changed = 0;
+  long long start = nowMs();
+  char buf[READ_CHUNK];
+  while (nowMs() - start < FOLLOW_BUDGET_MS) {
+    ssize_t n = read(F->fd, buf, sizeof(buf));
+    if (n > 0) {
+      appendText(buf, n, &F->partial);
+      F->offset += n;
+      changed = 1;
+      continue;
+    }
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1 && errno == EAGAIN)
+      break;
+    if (n == 0 && !F->pipe) {
+      // A log rotated or truncated under us can't be followed any further.
+      struct stat st;
+      if (fstat(F->fd, &st) == 0 && st.st_size < F->offset) {
+        followStop("was truncated, stopped following");
+        changed = 1;
+      }
+      break;
+    }
+    if (n == 0 && S.gzip.job)
+      gzipDone();
+    else
+      followStop(n == 0 ? "fully read" : "read failed");
+    changed = 1;
+    break;
+  }
+  if (changed && tail) {
+    S.cy = S.numrows ? S.numrows - 1 : 0;
+    S.cx = 0;
+  }
+  return changed;
+}
+
+// Regular files never poll readable, so they're re-read on a timer instead.
+void followTimer()
+{
+  if (S.follow.fd == -1)
+    return;
+  if (followPoll())
+    S.loop.redraw = 1;
+  timerArm(&S.loop.follow, FOLLOW_POLL_MS);
+}
+
+void* gzipThread(void* arg)
+{
+  struct GzipJob* job = arg;
+  gzFile gz = gzdopen(job->in, "rb");
+  if (gz == NULL) {
+    close(job->in);
+    job->err = Z_MEM_ERROR;
+    close(job->out);
+    return NULL;
+  }
+  gzbuffer(gz, GZIP_BUF);
+
+  char* buf = malloc(GZIP_BUF);
+  int n;
+  while ((n = gzread(gz, buf, GZIP_BUF)) > 0) {
+    struct iovec iov = { buf, n };
+    if (writeAllv(job->out, &iov, 1) == -1)
+      break;
+  }
+  int err;
+  gzerror(gz, &err);
+  if (n < 0 || (err != Z_OK && err != Z_STREAM_END))
+    job->err = err ? err : Z_DATA_ERROR;
+  gzclose(gz);
+  free(buf);
+  close(job->out);
+  return NULL;
+}
+
+/*
+ * Inflate a gzip file on a thread into a pipe that is read like a pipe on
+ * stdin: rows come in between keys, so the first screen shows as soon as
+ * it's inflated.
+ */
+void gzipStart(int fd)
+{
+  int pipefd[2];
+  if (pipe(pipefd) == -1)
+    die("pipe");
+  fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+  fcntl(pipefd[1], F_SETFD, FD_CLOEXEC);
+
+  struct GzipJob* job = calloc(1, sizeof(struct GzipJob));
+  job->in = fd;
+  job->out = pipefd[1];
+  if (pthread_create(&job->thread, NULL, gzipThread, job) != 0)
+    die("pthread_create");
+  S.gzip.on = 1;
+  S.gzip.job = job;
+  followStart(pipefd[0], 1);
+}
+
+// The thread is done: the whole file is in, or it stopped at bad data.
+void gzipDone()
+{
+  struct GzipJob* job = S.gzip.job;
+  pthread_join(job->thread, NULL);
+  S.gzip.job = NULL;
+  followStop(job->err ? "is corrupt, read up to the bad data" : "fully read");
+  free(job);
+}
+
+/*
+ * Inflate all of the gzip file fd into a malloc'd buffer of *len bytes,
+ * for a reload. Closes fd; returns NULL if the data is corrupt.
+ */
+char* gzipInflate(int fd, size_t* len)
+{
+  gzFile gz = gzdopen(fd, "rb");
+  if (gz == NULL) {
+    close(fd);
+    return NULL;
+  }
+  gzbuffer(gz, GZIP_BUF);
+
+  size_t cap = GZIP_BUF;
+  char* buf = malloc(cap);
+  int n;
+  *len = 0;
+  while ((n = gzread(gz, &buf[*len], cap - *len)) > 0) {
+    *len += n;
+    if (*len == cap)
+      buf = realloc(buf, cap *= 2);
+  }
+  int err;
+  gzerror(gz, &err);
+  gzclose(gz);
+  if (n < 0 || (err != Z_OK && err != Z_STREAM_END)) {
+    free(buf);
+    return NULL;
+  }
+  return buf;
+}
+
+// Read the rest of a gzip file still being inflated, waiting for it.
+void gzipDrain()
+{
+  if (S.gzip.job == NULL)
+    return;
+  fcntl(S.follow.fd, F_SETFL, fcntl(S.follow.fd, F_GETFL) & ~O_NONBLOCK);
+  while (S.gzip.job)
+    followPoll();
+}
+
+void ares_open(char* filename)
+{
+  free(S.filename);
+  S.filename = strdup(filename);
+
+  selectSyntaxHighlight();
+
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1)
+    die("open");
+
+  unsigned char magic[2];
+  if (pread(fd, magic, 2, 0) == 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+    gzipStart(fd);
+    // Swap file records and replays are for the whole file.
+    char* swap = sidecarPath(filename, JOURNAL_SUFFIX);
+    if (S.rec.data || access(swap, F_OK) == 0)
+      gzipDrain();
+    free(swap);
+  } else {
+    char buf[READ_CHUNK];
+    ssize_t n = cacheLoad(fd, &st) ? 0 : -1;
+    while (n != 0 && (n = read(fd, buf, sizeof(buf))) != 0) {
+      if (n == -1) {
+        if (errno == EINTR)
+          continue;
+        die("read");
+      }
+      appendText(buf, n, &S.follow.partial);
+      S.follow.offset += n;
+    }
+    close(fd);
+  }
+  S.dirty = 0;
+
+  journalRecover();
+  diffLoad();
+  watchStart();
+}
+
+int saveWrite(int fd, struct SaveJob* job)
+{
+  return job->gzip ? writeRowsGzip(fd, job) : writeRows(fd, job);
+}
+
+/*
+ * Overwrite the file itself, for when a rename would lose something: the
+ * other names of a hard-linked file, or any save at all in a directory we
+ * can't create files in. Not crash safe, but no worse than before.
+ */
+int saveInPlace(struct SaveJob* job, const char* path)
+{
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+    return -1;
+  if (saveWrite(fd, job) == -1 || fsync(fd) == -1) {
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return -1;
+  }
+  return close(fd);
+}
+
+/*
+ * Save the buffer to filename atomically: rows are streamed into a temporary
+ * file next to the target, which is fsync'd and then renamed over it. A crash
+ * at any point leaves either the old or the new file on disk, never a
+ * truncated one. Symlinks are followed so the link itself survives, and the
+ * owner and mode are carried over to the new file.
+ */
+int saveRowsTo(struct SaveJob* job)
+{
+  char* path = realpath(job->filename, NULL);
+  if (path == NULL)
+    path = strdup(job->filename);
+
+  char* dir = strdup(path);
+  char* slash = strrchr(dir, '/');
+  if (slash == dir)
+    slash[1] = '\0';
+  else if (slash)
+    *slash = '\0';
+  const char* dirpath = slash ? dir : ".";
+
+  struct stat st;
+  int exists = stat(path, &st) == 0;
+  if ((exists && st.st_nlink > 1) || access(dirpath, W_OK) == -1) {
+    int result = saveInPlace(job, path);
+    free(dir);
+    free(path);
+    return result;
+  }
+
+  size_t tmplen = strlen(path) + sizeof(SAVE_TMP_SUFFIX);
+  char* tmp = malloc(tmplen);
+  snprintf(tmp, tmplen, "%s" SAVE_TMP_SUFFIX, path);
+
+  int fd = mkstemp(tmp);
+  if (fd == -1) {
+    int saved_errno = errno;
+    free(tmp);
+    free(dir);
+    free(path);
+    errno = saved_errno;
+    return -1;
+  }
+
+  // Only root can give a file away, so keeping the owner is best effort.
+  if (exists && fchown(fd, st.st_uid, st.st_gid) == -1)
+    errno = 0;
+
+  if (fchmod(fd, exists ? st.st_mode & 07777 : 0644) == -1
+      || saveWrite(fd, job) == -1 || fsync(fd) == -1) {
+    int saved_errno = errno;
+    close(fd);
+    unlink(tmp);
+    free(tmp);
+    free(dir);
+    free(path);
+    errno = saved_errno;
+    return -1;
+  }
+  if (close(fd) == -1 || rename(tmp, path) == -1) {
+    int saved_errno = errno;
+    unlink(tmp);
+    free(tmp);
+    free(dir);
+    free(path);
+    errno = saved_errno;
+    return -1;
+  }
+  free(tmp);
+  free(path);
+
+  // Persist the rename itself.
+  int dfd = open(dirpath, O_RDONLY | O_DIRECTORY);
+  if (dfd != -1) {
+    fsync(dfd);
+    close(dfd);
+  }
+  free(dir);
+
+  return 0;
+}
+
+// Hidden file next to filename, such as its swap journal.
+char* sidecarPath(const char* filename, const char* suffix)
+{
+  const char* slash = strrchr(filename, '/');
+  int dirlen = slash ? slash - filename + 1 : 0;
+  const char* base = filename + dirlen;
+  size_t len = dirlen + strlen(base) + strlen(suffix) + 2;
+  char* path = malloc(len);
+  snprintf(path, len, "%.*s.%s%s", dirlen, filename, base, suffix);
+  return path;
+}
+
+long long nowMs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+long long nowUs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+long long nowNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Header: magic, then the size and mtime of the file the records apply to.
+int journalWriteHeader(int fd)
+{
+  char hdr[JOURNAL_HEADER_SIZE] = JOURNAL_MAGIC;
+  struct stat st;
+  long long base[2] = { 0, 0 };
+  if (S.filename && stat(S.filename, &st) == 0) {
+    base[0] = st.st_size;
+    base[1] = st.st_mtime;
+  }
+  memcpy(&hdr[8], base, sizeof(base));
+  struct iovec iov = { hdr, sizeof(hdr) };
+  return writeAllv(fd, &iov, 1);
+}
+
+int journalOpen()
+{
+  struct Journal* J = &S.journal;
+  free(J->path);
+  J->path = sidecarPath(S.filename, JOURNAL_SUFFIX);
+  J->fd = open(J->path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+  if (J->fd == -1)
+    return -1;
+  if (journalWriteHeader(J->fd) == -1) {
+    close(J->fd);
+    J->fd = -1;
+    return -1;
+  }
+  J->size = JOURNAL_HEADER_SIZE;
+  return 0;
+}
+
+void journalPut(const void* p, int len)
+{
+  struct Journal* J = &S.journal;
+  if (J->len + len > J->cap) {
+    J->cap = J->cap ? J->cap * 2 : 4096;
+    while (J->cap < J->len + len)
+      J->cap *= 2;
+    J->buf = realloc(J->buf, J->cap);
+  }
+  memcpy(&J->buf[J->len], p, len);
+  J->len += len;
+  J->size += len;
+}
+
+void journalVarint(unsigned long long v)
+{
+  unsigned char b[10];
+  int n = 0;
+  do {
+    b[n] = v & 0x7f;
+    v >>= 7;
+    if (v)
+      b[n] |= 0x80;
+    n++;
+  } while (v);
+  journalPut(b, n);
+}
+
+/*
+ * Append one edit record: op, two varint arguments (row and column) and a
+ * length-prefixed byte string, the inserted or deleted text. Only touches
+ * memory.
+ */
+void journalRecord(int op, int a, int b, const char* s, int len)
+{
+  struct Journal* J = &S.journal;
+  if (J->suspended || S.filename == NULL)
+    return;
+  if (J->fd == -1 && journalOpen() == -1) {
+    J->suspended = 1;
+    setStatusMessage("Can't create swap file: %s", strerror(errno));
+    return;
+  }
+
+  unsigned char opc = op;
+  journalPut(&opc, 1);
+  journalVarint(a);
+  journalVarint(b);
+  journalVarint(len);
+  if (len)
+    journalPut(s, len);
+
+  if (!J->dirty_since) {
+    J->dirty_since = nowMs();
+    timerArm(&S.loop.journal, JOURNAL_SYNC_MS);
+  }
+  if (J->len >= JOURNAL_BUF_MAX)
+    journalFlush(0);
+}
+
+void journalFlush(int sync)
+{
+  struct Journal* J = &S.journal;
+  if (J->fd == -1)
+    return;
+  if (J->len) {
+    struct iovec iov = { J->buf, J->len };
+    writeAllv(J->fd, &iov, 1);
+    J->len = 0;
+  }
+  if (sync) {
+    fdatasync(J->fd);
+    J->dirty_since = 0;
+  }
+}
+
+void journalTimer()
+{
+  if (S.journal.dirty_since)
+    journalFlush(1);
+  // Hidden buffers' records were written when they were left.
+  for (int k = 0; k < S.nbuffers; k++) {
+    struct Journal* J = &S.buffers[k]->journal;
+    if (k != S.current && J->dirty_since) {
+      fdatasync(J->fd);
+      J->dirty_since = 0;
+    }
+  }
+}
+
+void journalClose(int remove)
+{
+  struct Journal* J = &S.journal;
+  if (J->fd != -1) {
+    if (!remove)
+      journalFlush(1);
+    close(J->fd);
+    if (remove)
+      unlink(J->path);
+  }
+  J->fd = -1;
+  J->len = 0;
+  J->size = 0;
+  J->dirty_since = 0;
+}
+
+/*
+ * The buffer up to journal offset mark is now on disk. Drop those records,
+ * keeping any made while the save was running on top of the new file.
+ */
+void journalRebase(long long mark)
+{
+  struct Journal* J = &S.journal;
+  if (J->fd == -1)
+    return;
+  journalFlush(0);
+  if (J->size <= mark || mark < JOURNAL_HEADER_SIZE) {
+    journalClose(1);
+    return;
+  }
+
+  long long tail = J->size - mark;
+  char* buf = malloc(tail);
+  int rfd = open(J->path, O_RDONLY);
+  if (rfd == -1 || pread(rfd, buf, tail, mark) != tail) {
+    if (rfd != -1)
+      close(rfd);
+    free(buf);
+    return;
+  }
+  close(rfd);
+
+  size_t tmplen = strlen(J->path) + sizeof(SAVE_TMP_SUFFIX);
+  char* tmp = malloc(tmplen);
+  snprintf(tmp, tmplen, "%s" SAVE_TMP_SUFFIX, J->path);
+  int fd = mkstemp(tmp);
+  if (fd != -1) {
+    struct iovec iov = { buf, tail };
+    if (journalWriteHeader(fd) == 0 && writeAllv(fd, &iov, 1) == 0
+        && fdatasync(fd) == 0 && rename(tmp, J->path) == 0) {
+      close(J->fd);
+      J->fd = fd;
+      fcntl(fd, F_SETFL, O_APPEND);
+      J->size = JOURNAL_HEADER_SIZE + tail;
+      J->dirty_since = 0;
+    } else {
+      close(fd);
+      unlink(tmp);
+    }
+  }
+  free(tmp);
+  free(buf);
+}
+
+int journalVarintAt(const unsigned char* p, long long len, long long* pos,
+    unsigned long long* v)
+{
+  *v = 0;
+  for (int shift = 0; *pos < len && shift < 64; shift += 7) {
+    unsigned char b = p[(*pos)++];
+    *v |= (unsigned long long)(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return 0;
+  }
+  return -1;
+}
+
+/*
+ * Apply the records in p to the buffer. Stops at the first incomplete or
+ * inconsistent record, which is where a crash cut the journal short, and
+ * returns the length of the valid prefix.
+ */
+long long journalReplay(const unsigned char* p, long long len, int* applied)
+{
+  long long pos = JOURNAL_HEADER_SIZE;
+  *applied = 0;
+
+  while (pos < len) {
+    long long start = pos;
+    int op = p[pos++];
+    unsigned long long a, b, n;
+    if (journalVarintAt(p, len, &pos, &a) == -1
+        || journalVarintAt(p, len, &pos, &b) == -1
+        || journalVarintAt(p, len, &pos, &n) == -1
+        || n > (unsigned long long)(len - pos))
+      return start;
+    const char* s = (const char*)&p[pos];
+    pos += n;
+
+    int rowop = op != EDIT_INSERT_ROW;
+    if ((rowop && a >= (unsigned long long)S.numrows)
+        || (!rowop && a > (unsigned long long)S.numrows))
+      return start;
+    erow* row = rowop ? &S.row[a] : NULL;
+
+    switch (op) {
+    case EDIT_INSERT_ROW:
+      insertRow(a, (char*)s, n);
+      break;
+    case EDIT_DEL_ROW:
+      if (n != (unsigned long long)row->size || memcmp(row->chars, s, n) != 0)
+        return start;
+      delRow(a);
+      break;
+    case EDIT_INSERT_TEXT:
+      if (b > (unsigned long long)row->size)
+        return start;
+      rowInsertString(row, b, (char*)s, n);
+      break;
+    case EDIT_DEL_TEXT:
+      if (b + n > (unsigned long long)row->size
+          || memcmp(&row->chars[b], s, n) != 0)
+        return start;
+      rowDelRange(row, b, n);
+      break;
+    default:
+      return start;
+    }
+    (*applied)++;
+  }
+  return pos;
+}
+
+/*
+ * Look for a swap file left behind by a crashed session and offer to replay
+ * it on top of the freshly opened file.
+ */
+void journalRecover()
+{
+  struct Journal* J = &S.journal;
+  if (J->suspended)
+    return;
+  char* path = sidecarPath(S.filename, JOURNAL_SUFFIX);
+  int fd = open(path, O_RDWR);
+  if (fd == -1) {
+    free(path);
+    return;
+  }
+
+  struct stat jst, st;
+  if (fstat(fd, &jst) == -1 || jst.st_size < JOURNAL_HEADER_SIZE
+      || stat(S.filename, &st) == -1) {
+    close(fd);
+    free(path);
+    return;
+  }
+  unsigned char* p
+      = mmap(NULL, jst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED) {
+    close(fd);
+    free(path);
+    return;
+  }
+
+  long long base[2];
+  memcpy(base, &p[8], sizeof(base));
+  if (memcmp(p, JOURNAL_MAGIC, 8) != 0 || base[0] != st.st_size
+      || base[1] != st.st_mtime) {
+    setStatusMessage("Ignoring stale swap file %s", path);
+  } else if (jst.st_size > JOURNAL_HEADER_SIZE
+      && ares_confirm("Swap file found. Recover unsaved edits? (y/n)")) {
+    int applied;
+    J->suspended++;
+    beginBatch();
+    long long valid = journalReplay(p, jst.st_size, &applied);
+    endBatch();
+    J->suspended--;
+
+    // Keep appending to the recovered journal, minus any torn tail.
+    if (ftruncate(fd, valid) == 0) {
+      fcntl(fd, F_SETFL, O_APPEND);
+      free(J->path);
+      J->path = path;
+      J->fd = fd;
+      J->size = valid;
+      fd = -1;
+      path = NULL;
+    }
+    setStatusMessage("Recovered %d edits from swap file", applied);
+  } else {
+    unlink(path);
+  }
+
+  munmap(p, jst.st_size);
+  if (fd != -1)
+    close(fd);
+  free(path);
+}
+
+void* saveThread(void* arg)
+{
+  struct SaveJob* job = arg;
+  job->result = saveRowsTo(job);
+  job->err = errno;
+  atomic_store(&job->done, 1);
+  loopWake('s');
+  return NULL;
+}
+
+/*
+ * Reap the background save, blocking until it is done. Edits made while it
+ * ran stay counted in S.dirty.
+ */
+void finishSave()
+{
+  struct SaveJob* job = S.save;
+  if (job == NULL)
+    return;
+
+  if (job->threaded)
+    pthread_join(job->thread, NULL);
+  S.save = NULL;
+
+  for (int j = 0; j < job->norphans; j++)
+    free(job->orphans[j]);
+
+  if (job->result == 0) {
+    watchStart();
+    journalRebase(job->journal_mark);
+    S.dirty -= job->dirty;
+    if (S.dirty < 0)
+      S.dirty = 0;
+    // A gzip file's size is only known once it's written.
+    struct stat st;
+    long long total = job->total;
+    if (job->gzip && stat(job->filename, &st) == 0)
+      total = st.st_size;
+    setStatusMessage("%lld bytes written to disk", total);
+  } else {
+    setStatusMessage("Can't save! I/O error: %s", strerror(job->err));
+  }
+
+  free(job->orphans);
+  free(job->rows);
+  free(job->filename);
+  free(job);
+}
+
+// Copy the per-buffer fields of S into b, or from b into S if load is set.
+void bufferCopy(struct Buffer* b, int load)
+{
+#define BUFFER_FIELD(f)                                                        \
+  memcpy(load ? (void*)&S.f : (void*)&b->f, load ? (void*)&b->f : (void*)&S.f, \
+      sizeof(S.f))
+  BUFFER_FIELD(cx);
+  BUFFER_FIELD(cy);
+  BUFFER_FIELD(rx);
+  BUFFER_FIELD(rowoff);
+  BUFFER_FIELD(coloff);
+  BUFFER_FIELD(numrows);
+  BUFFER_FIELD(row);
+  BUFFER_FIELD(rowcap);
+  BUFFER_FIELD(dirty);
+  BUFFER_FIELD(filename);
+  BUFFER_FIELD(syntax);
+  BUFFER_FIELD(save);
+  BUFFER_FIELD(journal);
+  BUFFER_FIELD(undo);
+  BUFFER_FIELD(bytes);
+  BUFFER_FIELD(wrap);
+  BUFFER_FIELD(brackets);
+  BUFFER_FIELD(follow);
+  BUFFER_FIELD(gzip);
+  BUFFER_FIELD(watch);
+  BUFFER_FIELD(diff);
+#undef BUFFER_FIELD
+}
+
+/*
+ * Park the current buffer in its entry. A save in flight goes with it and
+ * is finished from the event loop (bufferSaves); pending journal records
+ * are written out and left for the journal timer to sync.
+ */
+void bufferLeave()
+{
+  while (S.batch)
+    endBatch();
+  journalFlush(0);
+  struct Buffer* b = S.buffers[S.current];
+  bufferCopy(b, 0);
+  b->evicted = 0;
+  idleQueue(&S.loop.evict);
+  S.complete.active = 0;
+}
+
+void bufferEnter(int k, int batch)
+{
+  S.current = k;
+  bufferCopy(S.buffers[k], 1);
+  if (S.wrap.on && S.wrap.cols != (textCols() > 0 ? textCols() : 1))
+    wrapReset();
+  if (S.follow.fd != -1 && !S.follow.pipe)
+    timerArm(&S.loop.follow, FOLLOW_POLL_MS);
+  while (S.batch < batch)
+    beginBatch();
+}
+
+// Make buffer k current, with its cursor, scroll and highlighting as left.
+void bufferSwitch(int k)
+{
+  if (k == S.current)
+    return;
+  int batch = S.batch;
+  bufferLeave();
+  bufferEnter(k, batch);
+}
+
+/*
+ * Open filename in a new buffer, or switch to the one that has it. An
+ * empty unnamed buffer is used for it instead of being kept around.
+ */
+void bufferOpen(char* filename)
+{
+  struct stat st, other;
+  if (stat(filename, &st) == 0) {
+    for (int k = 0; k < S.nbuffers; k++) {
+      char* name = k == S.current ? S.filename : S.buffers[k]->filename;
+      if (name && stat(name, &other) == 0 && st.st_dev == other.st_dev
+          && st.st_ino == other.st_ino) {
+        bufferSwitch(k);
+        return;
+      }
+    }
+  }
+
+  int batch = S.batch;
+  if (S.filename || S.numrows || S.dirty || S.follow.fd != -1) {
+    bufferLeave();
+    S.buffers = realloc(S.buffers, sizeof(struct Buffer*) * (S.nbuffers + 1));
+    S.buffers[S.nbuffers] = calloc(1, sizeof(struct Buffer));
+    S.current = S.nbuffers++;
+    bufferInit();
+  }
+  while (S.batch)
+    endBatch();
+  ares_open(filename);
+  while (S.batch < batch)
+    beginBatch();
+}
+
+/*
+ * Finish the saves of hidden buffers whose thread is done, with the
+ * buffer's fields loaded into S for finishSave. Returns 1 if any did.
+ */
+int bufferSaves()
+{
+  int finished = 0;
+  for (int k = 0; k < S.nbuffers; k++) {
+    struct Buffer* b = S.buffers[k];
+    if (k == S.current || b->save == NULL)
+      continue;
+    if (!atomic_load(&b->save->done)) {
+      timerArm(&S.loop.progress, PROGRESS_MS);
+      continue;
+    }
+    struct Buffer* current = S.buffers[S.current];
+    bufferCopy(current, 0);
+    bufferCopy(b, 1);
+    finishSave();
+    bufferCopy(b, 0);
+    bufferCopy(current, 1);
+    finished = 1;
+  }
+  return finished;
+}
+
+// Whether any buffer has unsaved changes.
+int buffersDirty()
+{
+  for (int k = 0; k < S.nbuffers; k++)
+    if (k == S.current ? S.dirty : S.buffers[k]->dirty)
+      return 1;
+  return 0;
+}
+
+// Before quitting: finish saves, write caches and drop every swap file.
+void buffersClose()
+{
+  for (int k = 0; k < S.nbuffers; k++) {
+    bufferSwitch(k);
+    finishSave();
+    cacheWrite();
+    journalClose(1);
+  }
+}
+
+// Idle task: evict the rows of hidden buffers, but the ones on their screen.
+int idleEvict(long long deadline)
+{
+  for (int k = 0; k < S.nbuffers; k++) {
+    struct Buffer* b = S.buffers[k];
+    if (k == S.current)
+      continue;
+    while (b->evicted < b->numrows) {
+      int at = b->evicted++;
+      if (at < b->rowoff || at >= b->rowoff + S.screenrows)
+        rowEvict(&b->row[at]);
+      if (b->evicted % 256 == 0 && nowUs() >= deadline)
+        return 1;
+    }
+  }
+  return 0;
+}
+
+void ares_open_buffer()
+{
+  char* filename = ares_prompt("Open: %s", NULL);
+  if (filename == NULL)
+    return;
+  struct stat st;
+  if (stat(filename, &st) == -1 || access(filename, R_OK) == -1)
+    setStatusMessage("Can't open %s: %s", filename, strerror(errno));
+  else if (S_ISDIR(st.st_mode))
+    setStatusMessage("Can't open %s: it's a directory", filename);
+  else
+    bufferOpen(filename);
+  free(filename);
+}
+
+void ares_next_buffer()
+{
+  if (S.nbuffers == 1) {
+    setStatusMessage("No other buffers open");
+    return;
+  }
+  bufferSwitch((S.current + 1) % S.nbuffers);
+  setStatusMessage("%s", S.filename ? S.filename : "[No Name]");
+}
+
+/*
+ * Read the .gitignore in dir, if there is one, as rules chained to the
+ * ones above it. Patterns are matched with fnmatch; a leading "**"
+ * directory wildcard is the only kind understood.
+ */
+struct Ignore* ignoreLoad(struct Grep* G, const char* dir, struct Ignore* parent)
+{
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/.gitignore", dir);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return parent;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return parent;
+  }
+  char* text = malloc(st.st_size + 1);
+  ssize_t len = 0, n;
+  while (len < st.st_size && (n = read(fd, &text[len], st.st_size - len)) > 0)
+    len += n;
+  close(fd);
+  text[len] = '\0';
+
+  struct Ignore* ig = calloc(1, sizeof(struct Ignore));
+  ig->parent = parent;
+  ig->baselen = strcmp(dir, ".") ? strlen(dir) + 1 : 0;
+  ig->text = text;
+  int cap = 0;
+  for (char* line = text; line < text + len;) {
+    char* end = memchr(line, '\n', text + len - line);
+    char* next = end ? end + 1 : text + len;
+    if (end == NULL)
+      end = text + len;
+    *end = '\0';
+    while (end > line && (end[-1] == ' ' || end[-1] == '\r'))
+      *--end = '\0';
+
+    struct IgnoreRule r = { line, 0, 0, 0 };
+    if (*r.pattern == '!') {
+      r.negate = 1;
+      r.pattern++;
+    }
+    if (end > r.pattern && end[-1] == '/') {
+      r.dir = 1;
+      *--end = '\0';
+    }
+    if (!strncmp(r.pattern, "**/", 3))
+      r.pattern += 3;
+    else if (*r.pattern == '/')
+      r.pattern++, r.anchored = 1;
+    if (strchr(r.pattern, '/'))
+      r.anchored = 1;
+    if (*r.pattern && *line != '#') {
+      if (ig->nrules == cap) {
+        cap = cap ? cap * 2 : 16;
+        ig->rules = realloc(ig->rules, sizeof(struct IgnoreRule) * cap);
+      }
+      ig->rules[ig->nrules++] = r;
+    }
+    line = next;
+  }
+
+  pthread_mutex_lock(&G->lock);
+  ig->next = G->ignores;
+  G->ignores = ig;
+  pthread_mutex_unlock(&G->lock);
+  return ig;
+}
+
+/*
+ * Whether a path is ignored: the last rule that matches it decides, and
+ * the rules of deeper directories come after those above them.
+ */
+int ignored(struct Ignore* ig, const char* path, const char* name, int dir)
+{
+  for (; ig; ig = ig->parent) {
+    for (int j = ig->nrules - 1; j >= 0; j--) {
+      struct IgnoreRule* r = &ig->rules[j];
+      if (r->dir && !dir)
+        continue;
+      if (r->anchored ? fnmatch(r->pattern, path + ig->baselen, FNM_PATHNAME)
+                      : fnmatch(r->pattern, name, 0))
+        continue;
+      return !r->negate;
+    }
+  }
+  return 0;
+}
+
+// List a directory, queueing what's in it that isn't ignored.
+void grepDir(struct Grep* G, struct GrepTask* task)
+{
+  DIR* d = opendir(task->path);
+  if (d == NULL)
+    return;
+  struct Ignore* ig = ignoreLoad(G, task->path, task->ignore);
+  int root = !strcmp(task->path, ".");
+  int plen = strlen(task->path);
+
+  struct GrepTask* list = NULL;
+  struct GrepTask* last = NULL;
+  struct dirent* e;
+  while ((e = readdir(d)) != NULL && !atomic_load(&G->cancel)) {
+    char* name = e->d_name;
+    if (!strcmp(name, ".") || !strcmp(name, "..") || !strcmp(name, ".git"))
+      continue;
+    int nlen = strlen(name);
+    char* path = malloc(plen + nlen + 2);
+    if (root)
+      memcpy(path, name, nlen + 1);
+    else
+      snprintf(path, plen + nlen + 2, "%s/%s", task->path, name);
+
+    // Symlinks are scanned if they point to a file, never walked into.
+    int dir = -1;
+    struct stat st;
+    if (e->d_type == DT_DIR)
+      dir = 1;
+    else if (e->d_type == DT_REG)
+      dir = 0;
+    else if (e->d_type == DT_LNK && stat(path, &st) == 0 && S_ISREG(st.st_mode))
+      dir = 0;
+    else if (e->d_type == DT_UNKNOWN && lstat(path, &st) == 0)
+      dir = S_ISDIR(st.st_mode) ? 1 : S_ISREG(st.st_mode) ? 0 : -1;
+    if (dir == -1 || ignored(ig, path, name, dir)) {
+      free(path);
+      continue;
+    }
+
+    struct GrepTask* t = malloc(sizeof(struct GrepTask));
+    t->path = path;
+    t->dir = dir;
+    t->ignore = ig;
+    t->next = list;
+    if (list == NULL)
+      last = t;
+    list = t;
+  }
+  closedir(d);
+
+  if (list) {
+    pthread_mutex_lock(&G->lock);
+    last->next = G->tasks;
+    G->tasks = list;
+    pthread_cond_broadcast(&G->more);
+    pthread_mutex_unlock(&G->lock);
+  }
+}
+
+// Index of the byte of s least likely to show up in text, for memchr.
+int rareByte(const char* s, int len)
+{
+  static const char common[] = " etaoinsrlcdhupmf_()=;,.gbyw\t";
+  int best = 0, rank = -1;
+  for (int j = 0; j < len; j++) {
+    const char* c = memchr(common, s[j], sizeof(common) - 1);
+    int r = c ? (int)(sizeof(common) - (c - common)) : (int)sizeof(common) + 1;
+    if (r > rank) {
+      rank = r;
+      best = j;
+    }
+  }
+  return best;
+}
+
+/*
+ * Find the lines of a file that have the query. memchr, which libc
+ * vectorizes, skips to the next place the query's rarest byte is, and
+ * lines are only counted up to a match.
+ */
+void grepScan(struct Grep* G, const char* path, const char* data, size_t size)
+{
+  const char* q = G->query;
+  size_t qlen = G->qlen, rare = G->rare;
+  size_t last = size - qlen + rare + 1;  // the rare byte can't be past this
+  size_t counted = 0, bol = 0, i = rare;
+  int line = 1, cap = 0;
+  struct GrepFile* f = NULL;
+
+  while (i < last) {
+    const char* p = memchr(&data[i], q[rare], last - i);
+    if (p == NULL)
+      break;
+    size_t m = p - data - rare;
+    if (memcmp(&data[m], q, qlen)) {
+      i = p - data + 1;
+      continue;
+    }
+    const char* nl;
+    while ((nl = memchr(&data[counted], '\n', m - counted)) != NULL) {
+      line++;
+      counted = bol = nl - data + 1;
+    }
+    counted = m;
+    nl = memchr(&data[m], '\n', size - m);
+    size_t eol = nl ? (size_t)(nl - data) : size;
+
+    if (atomic_fetch_add(&G->nmatches, 1) >= GREP_MAX_MATCHES) {
+      atomic_store(&G->cancel, 1);
+      break;
+    }
+    if (f == NULL) {
+      f = calloc(1, sizeof(struct GrepFile));
+      f->path = strdup(path);
+    }
+    if (f->nhits == cap) {
+      cap = cap ? cap * 2 : 4;
+      f->hits = realloc(f->hits, sizeof(struct GrepHit) * cap);
+    }
+    struct GrepHit* h = &f->hits[f->nhits++];
+    h->file = f;
+    h->line = line;
+    h->col = m - bol;
+    h->len = eol - bol < GREP_LINE_MAX ? eol - bol : GREP_LINE_MAX;
+    h->text = malloc(h->len);
+    memcpy(h->text, &data[bol], h->len);
+    i = eol + 1 + rare;
+  }
+
+  if (f) {
+    pthread_mutex_lock(&G->lock);
+    int wake = G->done == NULL;
+    f->next = G->done;
+    G->done = f;
+    pthread_mutex_unlock(&G->lock);
+    if (wake)
+      loopWake('g');
+  }
+}
+
+/*
+ * Scan a file, mapped if it's big. Small ones, most of a source tree, are
+ * read into the thread's buffer instead: mapping costs more than copying
+ * a few pages.
+ */
+void grepFile(struct Grep* G, struct GrepTask* task, char* buf)
+{
+  int fd = open(task->path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size < G->qlen) {
+    close(fd);
+    return;
+  }
+  size_t size = st.st_size;
+  char* data = buf;
+  if (size > GREP_READ_MAX) {
+    data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+  } else {
+    ssize_t n;
+    size_t len = 0;
+    while (len < size && (n = read(fd, &buf[len], size - len)) > 0)
+      len += n;
+    size = len;
+  }
+  close(fd);
+
+  atomic_fetch_add(&G->scanned, 1);
+  size_t check = size < GREP_BINARY_CHECK ? size : GREP_BINARY_CHECK;
+  if (size >= (size_t)G->qlen && memchr(data, '\0', check) == NULL)
+    grepScan(G, task->path, data, size);
+  if (data != buf)
+    munmap(data, st.st_size);
+}
+
+/*
+ * Take tasks until the queue is empty with no thread left working on one,
+ * since any of them may still queue more.
+ */
+void* grepThread(void* arg)
+{
+  struct Grep* G = arg;
+  char* buf = malloc(GREP_READ_MAX);
+  pthread_mutex_lock(&G->lock);
+  for (;;) {
+    while (G->tasks == NULL && G->busy && !atomic_load(&G->cancel))
+      pthread_cond_wait(&G->more, &G->lock);
+    if (G->tasks == NULL || atomic_load(&G->cancel))
+      break;
+    struct GrepTask* t = G->tasks;
+    G->tasks = t->next;
+    G->busy++;
+    pthread_mutex_unlock(&G->lock);
+
+    if (t->dir)
+      grepDir(G, t);
+    else
+      grepFile(G, t, buf);
+    free(t->path);
+    free(t);
+
+    pthread_mutex_lock(&G->lock);
+    G->busy--;
+  }
+  G->running--;
+  pthread_cond_broadcast(&G->more);
+  pthread_mutex_unlock(&G->lock);
+  loopWake('g');
+  free(buf);
+  return NULL;
+}
+
+// Tell the threads to stop; grepPoll reaps them.
+void grepCancel()
+{
+  struct Grep* G = &S.grep;
+  pthread_mutex_lock(&G->lock);
+  atomic_store(&G->cancel, 1);
+  pthread_cond_broadcast(&G->more);
+  pthread_mutex_unlock(&G->lock);
+}
+
+// Wait for the threads and free what only they used.
+void grepJoin()
+{
+  struct Grep* G = &S.grep;
+  for (int j = 0; j < G->nthreads; j++)
+    pthread_join(G->threads[j], NULL);
+  G->nthreads = 0;
+  G->active = 0;
+  while (G->tasks) {
+    struct GrepTask* t = G->tasks;
+    G->tasks = t->next;
+    free(t->path);
+    free(t);
+  }
+  while (G->ignores) {
+    struct Ignore* ig = G->ignores;
+    G->ignores = ig->next;
+    free(ig->rules);
+    free(ig->text);
+    free(ig);
+  }
+}
+
+void grepFreeFiles(struct GrepFile* f)
+{
+  while (f) {
+    struct GrepFile* next = f->next;
+    for (int j = 0; j < f->nhits; j++)
+      free(f->hits[j].text);
+    free(f->hits);
+    free(f->path);
+    free(f);
+    f = next;
+  }
+}
+
+// Move the files the threads finished into the list.
+int grepPoll()
+{
+  struct Grep* G = &S.grep;
+  if (!G->active)
+    return 0;
+  pthread_mutex_lock(&G->lock);
+  struct GrepFile* done = G->done;
+  G->done = NULL;
+  int running = G->running;
+  pthread_mutex_unlock(&G->lock);
+
+  // They were pushed on a stack, put them back in the order they came.
+  struct GrepFile* f = NULL;
+  while (done) {
+    struct GrepFile* next = done->next;
+    done->next = f;
+    f = done;
+    done = next;
+  }
+  while (f) {
+    struct GrepFile* next = f->next;
+    f->next = G->files;
+    G->files = f;
+    G->nfiles++;
+    if (G->nlist + f->nhits > G->listcap) {
+      while (G->nlist + f->nhits > G->listcap)
+        G->listcap = G->listcap ? G->listcap * 2 : 256;
+      G->list = realloc(G->list, sizeof(struct GrepHit*) * G->listcap);
+    }
+    for (int j = 0; j < f->nhits; j++)
+      G->list[G->nlist++] = &f->hits[j];
+    f = next;
+  }
+
+  long long scanned = atomic_load(&G->scanned);
+  if (running) {
+    setStatusMessage("Grep: %d matches in %d files, %lld files scanned...",
+        G->nlist, G->nfiles, scanned);
+    return 1;
+  }
+  int stopped = atomic_load(&G->cancel);
+  grepJoin();
+  setStatusMessage("Grep: %d matches in %d files, %lld files scanned%s",
+      G->nlist, G->nfiles, scanned, stopped ? " (stopped)" : "");
+  return 1;
+}
+
+// Stop a scan and drop its results, before starting another.
+void grepReset()
+{
+  struct Grep* G = &S.grep;
+  if (G->active) {
+    grepCancel();
+    grepJoin();
+  }
+  grepFreeFiles(G->done);
+  grepFreeFiles(G->files);
+  G->done = NULL;
+  G->files = NULL;
+  G->nfiles = 0;
+  free(G->list);
+  G->list = NULL;
+  G->nlist = 0;
+  G->listcap = 0;
+  free(G->query);
+  G->query = NULL;
+}
+
+// Search every file under the working directory, in the background.
+void grepStart(char* query)
+{
+  struct Grep* G = &S.grep;
+  grepReset();
+  G->query = query;
+  G->qlen = strlen(query);
+  G->rare = rareByte(query, G->qlen);
+  atomic_store(&G->cancel, 0);
+  atomic_store(&G->nmatches, 0);
+  atomic_store(&G->scanned, 0);
+  G->sel = 0;
+  G->scroll = 0;
+
+  G->tasks = calloc(1, sizeof(struct GrepTask));
+  G->tasks->path = strdup(".");
+  G->tasks->dir = 1;
+  G->busy = 0;
+
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1)
+    n = 1;
+  if (n > GREP_THREADS)
+    n = GREP_THREADS;
+  pthread_mutex_lock(&G->lock);
+  for (int j = 0; j < n; j++)
+    if (pthread_create(&G->threads[G->nthreads], NULL, grepThread, G) == 0)
+      G->nthreads++;
+  G->running = G->nthreads;
+  pthread_mutex_unlock(&G->lock);
+  G->active = 1;
+  G->visible = 1;
+  if (G->nthreads == 0) {
+    setStatusMessage("Can't grep: %s", strerror(errno));
+    grepJoin();
+    G->visible = 0;
+  }
+}
+
+// Open the file of the selected match, at its line.
+void grepOpen()
+{
+  struct Grep* G = &S.grep;
+  if (G->nlist == 0)
+    return;
+  struct GrepHit* h = G->list[G->sel];
+  struct stat st;
+  if (stat(h->file->path, &st) == -1 || access(h->file->path, R_OK) == -1) {
+    setStatusMessage("Can't open %s: %s", h->file->path, strerror(errno));
+    return;
+  }
+  G->visible = 0;
+  bufferOpen(h->file->path);
+  S.cy = h->line - 1 < S.numrows ? h->line - 1 : S.numrows;
+  S.cx = 0;
+  if (S.cy < S.numrows) {
+    erow* row = &S.row[S.cy];
+    S.cx = h->col < row->size ? h->col : row->size;
+  }
+  S.rowoff = S.numrows;
+}
+
+void ares_grep()
+{
+  char* query = ares_prompt("Grep: %s (ESC for the last results)", NULL);
+  if (query)
+    grepStart(query);
+  else if (S.grep.nlist || S.grep.active)
+    S.grep.visible = 1;
+}
+
+/*
+ * Called while readKey waits for input. Returns 1 when something changed
+ * that should be redrawn.
+ */
+int processBackground()
+{
+  timersRun();
+  if (S.rec.fp)
+    fflush(S.rec.fp);
+
+  int redraw = pollJobs();
+  if (S.loop.resized && !S.loop.resize.armed)
+    resizeTimer();
+  redraw |= followPoll();
+  redraw |= watchPoll();
+  redraw |= grepPoll();
+  redraw |= bufferSaves();
+
+  if (S.save) {
+    if (atomic_load(&S.save->done)) {
+      finishSave();
+    } else {
+      long long total = S.save->total ? S.save->total : 1;
+      setStatusMessage("Saving %s... %lld%%", S.save->filename,
+          atomic_load(&S.save->written) * 100 / total);
+      timerArm(&S.loop.progress, PROGRESS_MS);
+    }
+    redraw = 1;
+  }
+  redraw |= S.loop.redraw;
+  S.loop.redraw = 0;
+  return redraw;
+}
+
+void ares_save()
+{
+  if (S.filename == NULL) {
+    S.filename = ares_prompt("Save as: %s (ESC to cancel)", NULL);
+    if (S.filename == NULL) {
+      setStatusMessage("Save aborted");
+      return;
+    }
+    selectSyntaxHighlight();
+    int len = strlen(S.filename);
+    S.gzip.on = len > 3 && !strcmp(&S.filename[len - 3], ".gz");
+  }
+
+  if (S.save) {
+    setStatusMessage("Save already in progress");
+    return;
+  }
+  gzipDrain();
+  if (S.watch.conflict
+      && !ares_confirm("File changed on disk. Overwrite it? (y/n)")) {
+    setStatusMessage("Save aborted");
+    return;
+  }
+
+  struct SaveJob* job = calloc(1, sizeof(struct SaveJob));
+  job->gen = ++S.save_gen;
+  job->gzip = S.gzip.on;
+  job->filename = strdup(S.filename);
+  job->rows = malloc(sizeof(struct SaveRow) * (S.numrows ? S.numrows : 1));
+  job->numrows = S.numrows;
+  job->dirty = S.dirty;
+  job->journal_mark = S.journal.size;
+  for (int j = 0; j < S.numrows; j++) {
+    job->rows[j].chars = S.row[j].chars;
+    job->rows[j].size = S.row[j].size;
+    job->total += S.row[j].size + 1;
+    S.row[j].snap = job->gen;
+  }
+  S.save = job;
+
+  if (pthread_create(&job->thread, NULL, saveThread, job) != 0) {
+    saveThread(job);
+    finishSave();
+    return;
+  }
+  job->threaded = 1;
+  setStatusMessage("Saving %s...", S.filename);
+}
+
+extern char** environ;
+
+/*
+ * Run argv[0] from PATH with stdin on /dev/null and stdout and stderr on a
+ * pipe. Returns immediately; done is called from processBackground once the
+ * child has exited.
+ */
+struct Job* spawnJob(char* const argv[], void (*done)(struct Job*, int),
+    void* arg)
+{
+  int pipefd[2];
+  if (pipe(pipefd) == -1)
+    return NULL;
+  fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+  fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+
+  // Keep git from prompting for credentials on top of the editor.
+  int envc = 0;
+  while (environ[envc])
+    envc++;
+  char** envp = malloc(sizeof(char*) * (envc + 2));
+  memcpy(envp, environ, sizeof(char*) * envc);
+  envp[envc] = "GIT_TERMINAL_PROMPT=0";
+  envp[envc + 1] = NULL;
+
+  posix_spawn_file_actions_t fa;
+  posix_spawn_file_actions_init(&fa);
+  posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+  posix_spawn_file_actions_adddup2(&fa, pipefd[1], STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&fa, pipefd[1], STDERR_FILENO);
+  posix_spawn_file_actions_addclose(&fa, pipefd[1]);
+
+  pid_t pid;
+  int err = posix_spawnp(&pid, argv[0], &fa, NULL, argv, envp);
+  posix_spawn_file_actions_destroy(&fa);
+  free(envp);
+  close(pipefd[1]);
+  if (err != 0) {
+    close(pipefd[0]);
+    errno = err;
+    return NULL;
+  }
+
+  struct Job* job = calloc(1, sizeof(struct Job));
+  job->pid = pid;
+  job->fd = pipefd[0];
+  job->done = done;
+  job->arg = arg;
+  job->next = S.jobs;
+  S.jobs = job;
+  return job;
+}
+
+/*
+ * Drain output from running jobs and finish the ones whose child exited.
+ * Returns 1 if any job finished.
+ */
+int pollJobs()
+{
+  int finished = 0;
+  struct Job** pp = &S.jobs;
+  while (*pp) {
+    struct Job* job = *pp;
+
+    while (job->fd != -1) {
+      if (job->outcap - job->outlen < 4096) {
+        job->outcap = job->outcap ? job->outcap * 2 : 8192;
+        job->out = realloc(job->out, job->outcap);
+      }
+      ssize_t n = read(
+          job->fd, &job->out[job->outlen], job->outcap - job->outlen - 1);
+      if (n > 0) {
+        job->outlen += n;
+        continue;
+      }
+      if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+        close(job->fd);
+        job->fd = -1;
+      }
+      break;
+    }
+    if (job->out)
+      job->out[job->outlen] = '\0';
+
+    int status;
+    if (job->fd == -1 && waitpid(job->pid, &status, WNOHANG) == job->pid) {
+      *pp = job->next;
+      job->done(job, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+      free(job->out);
+      free(job);
+      finished = 1;
+      continue;
+    }
+    pp = &job->next;
+  }
+  return finished;
+}
+
+void paneAppend(const char* s, int len)
+{
+  struct Pane* P = &S.pane;
+  P->text = realloc(P->text, P->len + len);
+  memcpy(&P->text[P->len], s, len);
+
+  for (int j = P->len; j < P->len + len; j++) {
+    if (j == 0 || P->text[j - 1] == '\n') {
+      if (P->numlines == P->linecap) {
+        P->linecap = P->linecap ? P->linecap * 2 : 64;
+        P->lines = realloc(P->lines, sizeof(int) * P->linecap);
+      }
+      P->lines[P->numlines++] = j;
+    }
+  }
+  P->len += len;
+}
+
+// Log a finished git command and its output to the pane.
+void gitLog(char* const argv[], struct Job* job)
+{
+  paneAppend("$", 1);
+  for (int j = 0; argv[j]; j++) {
+    paneAppend(" ", 1);
+    paneAppend(argv[j], strlen(argv[j]));
+  }
+  paneAppend("\n", 1);
+  if (job->outlen) {
+    paneAppend(job->out, job->outlen);
+    if (job->out[job->outlen - 1] != '\n')
+      paneAppend("\n", 1);
+  }
+  S.pane.scroll = S.pane.numlines - S.screenrows;
+  if (S.pane.scroll < 0)
+    S.pane.scroll = 0;
+}
+
+/*
+ * git runs as "git -C <dir of file> ..." so the file's own repository is
+ * used whatever the editor's working directory is.
+ */
+struct GitCommit {
+  char* message;
+  char* dir;
+  char* file;
+  int push;
+};
+
+void gitCommitFree(struct GitCommit* gc)
+{
+  free(gc->message);
+  free(gc->dir);
+  free(gc->file);
+  free(gc);
+}
+
+// Split path into a malloc'd directory and a pointer to the file name.
+char* splitPath(const char* path, char** file)
+{
+  char* dir = strdup(path);
+  char* slash = strrchr(dir, '/');
+  if (slash == NULL) {
+    free(dir);
+    *file = (char*)path;
+    return strdup(".");
+  }
+  *file = (char*)path + (slash - dir) + 1;
+  if (slash == dir)
+    slash[1] = '\0';
+  else
+    *slash = '\0';
+  return dir;
+}
+
+void gitPushDone(struct Job* job, int status)
+{
+  char* argv[] = { "git", "-C", job->arg, "push", NULL };
+  gitLog(argv, job);
+  if (status != 0) {
+    setStatusMessage("Git push failed");
+    S.pane.visible = 1;
+  } else {
+    setStatusMessage("Push successful (Ctrl-E = output)");
+  }
+  free(job->arg);
+}
+
+void gitCommitDone(struct Job* job, int status)
+{
+  struct GitCommit* gc = job->arg;
+  char* argv[] = { "git", "-C", gc->dir, "commit", "-m", gc->message, NULL };
+  gitLog(argv, job);
+
+  if (status != 0) {
+    setStatusMessage("Commit failed");
+    S.pane.visible = 1;
+  } else if (gc->push) {
+    char* dir = strdup(gc->dir);
+    char* push[] = { "git", "-C", dir, "push", NULL };
+    if (spawnJob(push, gitPushDone, dir)) {
+      setStatusMessage("Commit successful, pushing...");
+    } else {
+      setStatusMessage("Git push failed: %s", strerror(errno));
+      free(dir);
+    }
+  } else {
+    setStatusMessage("Commit successful (Ctrl-E = output)");
+  }
+  if (status == 0)
+    diffLoad();
+  gitCommitFree(gc);
+}
+
+void gitAddDone(struct Job* job, int status)
+{
+  struct GitCommit* gc = job->arg;
+  char* argv[] = { "git", "-C", gc->dir, "add", "--", gc->file, NULL };
+  gitLog(argv, job);
+
+  if (status != 0) {
+    setStatusMessage("Git add failed");
+    S.pane.visible = 1;
+    gitCommitFree(gc);
+    return;
+  }
+
+  char* commit[]
+      = { "git", "-C", gc->dir, "commit", "-m", gc->message, NULL };
+  if (spawnJob(commit, gitCommitDone, gc) == NULL) {
+    setStatusMessage("Commit failed: %s", strerror(errno));
+    gitCommitFree(gc);
+  }
+}
+
+void ares_commit()
+{
+  if (S.filename == NULL) {
+    setStatusMessage("Save the file before committing");
+    return;
+  }
+
+  int saved_cx = S.cx;
+  int saved_cy = S.cy;
+  int saved_coloff = S.coloff;
+  int saved_rowoff = S.rowoff;
+
+  char* query = ares_prompt("Commit Message: %s", NULL);
+  if (query == NULL) {
+    S.cx = saved_cx;
+    S.cy = saved_cy;
+    S.coloff = saved_coloff;
+    S.rowoff = saved_rowoff;
+    return;
+  }
+
+  struct GitCommit* gc = malloc(sizeof(struct GitCommit));
+  gc->message = query;
+  char* file;
+  gc->dir = splitPath(S.filename, &file);
+  gc->file = strdup(file);
+  gc->push = ares_confirm("Push changes (y/n)");
+
+  char* argv[] = { "git", "-C", gc->dir, "add", "--", gc->file, NULL };
+  if (spawnJob(argv, gitAddDone, gc) == NULL) {
+    setStatusMessage("Git add failed: %s", strerror(errno));
+    gitCommitFree(gc);
+    return;
+  }
+  setStatusMessage("Committing...");
+}
+
+// FNV-1a
+unsigned long long hashUpdate(unsigned long long h, const char* s, int len)
+{
+  for (int j = 0; j < len; j++) {
+    h ^= (unsigned char)s[j];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+unsigned long long hashBytes(const char* s, int len)
+{
+  return hashUpdate(FNV_OFFSET, s, len);
+}
+
+/*
+ * Note that row at changed, as edit op of recordEdit. Called before a row
+ * is deleted and after one is inserted, so the stale range can follow the
+ * row shift.
+ */
+void diffTouch(int op, int at)
+{
+  struct Diff* D = &S.diff;
+  if (op == EDIT_DEL_ROW) {
+    if (at > 0)
+      S.row[at - 1].diff_stale = 1;
+    if (at + 1 < S.numrows)
+      S.row[at + 1].diff_stale = 1;
+    if (at < D->hi)
+      D->hi--;
+    if (at < D->lo)
+      D->lo--;
+    at = at > 0 ? at - 1 : 0;
+  } else {
+    if (op == EDIT_INSERT_ROW && at <= D->hi)
+      D->hi++;
+    S.row[at].diff_stale = 1;
+  }
+  if (at < D->lo)
+    D->lo = at;
+  if (at > D->hi)
+    D->hi = at;
+}
+
+/*
+ * Myers' O(ND) diff of a[0..n) against b[0..m). Fills bmatch[y] with the
+ * index in a that line y of b is matched to, or -1. Gives up and returns
+ * -1 past DIFF_MAX_EDITS differences.
+ */
+int myersDiff(
+    const unsigned long long* a, int n, const unsigned long long* b, int m,
+    int* bmatch)
+{
+  for (int y = 0; y < m; y++)
+    bmatch[y] = -1;
+
+  // V for edit distance d holds the furthest x for k = -d, -d+2, ..., d.
+  int maxd = n + m < DIFF_MAX_EDITS ? n + m : DIFF_MAX_EDITS;
+  int* trace = malloc(sizeof(int) * ((long)(maxd + 1) * (maxd + 2) / 2));
+#define V(d, k) trace[(long)(d) * ((d) + 1) / 2 + ((k) + (d)) / 2]
+
+  int d, found = 0;
+  for (d = 0; d <= maxd && !found; d++) {
+    for (int k = -d; k <= d; k += 2) {
+      int x;
+      if (d == 0)
+        x = 0;
+      else if (k == -d || (k != d && V(d - 1, k - 1) < V(d - 1, k + 1)))
+        x = V(d - 1, k + 1);
+      else
+        x = V(d - 1, k - 1) + 1;
+      int y = x - k;
+      while (x < n && y < m && a[x] == b[y]) {
+        x++;
+        y++;
+      }
+      V(d, k) = x;
+      if (x >= n && y >= m) {
+        found = 1;
+        break;
+      }
+    }
+  }
+  if (!found) {
+    free(trace);
+    return -1;
+  }
+
+  int x = n, y = m;
+  for (d = d - 1; d > 0; d--) {
+    int k = x - y;
+    int pk = (k == -d || (k != d && V(d - 1, k - 1) < V(d - 1, k + 1)))
+        ? k + 1
+        : k - 1;
+    int px = V(d - 1, pk), py = px - pk;
+    while (x > px && y > py)
+      bmatch[--y] = --x;
+    x = px;
+    y = py;
+  }
+  while (x > 0 && y > 0)
+    bmatch[--y] = --x;
+#undef V
+
+  free(trace);
+  return 0;
+}
+
+/*
+ * Re-diff buffer rows [a, b) against HEAD lines [h0, h1) and set their
+ * gutter marks. Row b, if any, is the matched anchor after the region and
+ * carries the mark for lines deleted right before it.
+ */
+void diffRegion(int a, int b, int h0, int h1)
+{
+  struct Diff* D = &S.diff;
+  int n = h1 - h0, m = b - a;
+
+  unsigned long long* rows = calloc(m + 1, sizeof(unsigned long long));
+  int* match = malloc(sizeof(int) * (m + 1));
+  for (int y = 0; y < m; y++)
+    rows[y] = hashBytes(S.row[a + y].chars, S.row[a + y].size);
+
+  // Common prefix and suffix are cheap to peel off before Myers.
+  int pre = 0, suf = 0;
+  while (pre < n && pre < m && D->head[h0 + pre] == rows[pre]) {
+    match[pre] = pre;
+    pre++;
+  }
+  while (suf < n - pre && suf < m - pre
+      && D->head[h1 - 1 - suf] == rows[m - 1 - suf]) {
+    match[m - 1 - suf] = n - 1 - suf;
+    suf++;
+  }
+  if (myersDiff(&D->head[h0 + pre], n - pre - suf, &rows[pre], m - pre - suf,
+          &match[pre])
+      == 0) {
+    for (int y = pre; y < m - suf; y++)
+      if (match[y] >= 0)
+        match[y] += pre;
+  }
+  // Too different to align: the middle stays unmatched, shown as modified.
+
+  int hp = 0, ins = 0;
+  for (int y = 0; y <= m; y++) {
+    if (y < m) {
+      S.row[a + y].diff_stale = 0;
+      S.row[a + y].diff = 0;
+      S.row[a + y].head = match[y] >= 0 ? h0 + match[y] : -1;
+      if (match[y] < 0) {
+        ins++;
+        continue;
+      }
+    }
+
+    // Close the hunk of ins added rows and del removed lines before y.
+    int del = (y < m ? match[y] : n) - hp;
+    for (int j = 0; j < ins; j++)
+      S.row[a + y - ins + j].diff = j < del ? DIFF_MODIFIED : DIFF_ADDED;
+    if (del > ins) {
+      if (a + y < S.numrows)
+        S.row[a + y].diff |= DIFF_DELETED;
+      else if (a + y > 0)
+        S.row[a + y - 1].diff |= DIFF_DELETED;
+    } else if (y == m && a + y < S.numrows
+        && (a + y + 1 < S.numrows || S.row[a + y].head + 1 == D->nhead)) {
+      // The last row's mark may be for lines deleted after it instead.
+      S.row[a + y].diff &= ~DIFF_DELETED;
+    }
+    if (y < m)
+      hp = match[y] + 1;
+    ins = 0;
+  }
+
+  free(match);
+  free(rows);
+}
+
+int diffAnchor(int r)
+{
+  return !S.row[r].diff_stale && S.row[r].head >= 0;
+}
+
+/*
+ * Bring the gutter up to date by re-diffing only the regions around rows
+ * edited since the last call, each bounded by the nearest unchanged rows
+ * that are matched to a HEAD line. Those are looked for at most
+ * DIFF_WINDOW rows away, so an edit deep inside a long run of rows that
+ * aren't in HEAD costs the same as any other.
+ */
+void diffUpdate()
+{
+  struct Diff* D = &S.diff;
+  if (!D->active || D->hi < D->lo)
+    return;
+
+  int hi = D->hi < S.numrows ? D->hi : S.numrows - 1;
+  for (int r = D->lo < 0 ? 0 : D->lo; r <= hi; r++) {
+    if (!S.row[r].diff_stale)
+      continue;
+    int a = r;
+    while (a > 0 && !diffAnchor(a - 1) && r - a < DIFF_WINDOW)
+      a--;
+    int b = r + 1;
+    while (b < S.numrows && !diffAnchor(b) && b - r < DIFF_WINDOW)
+      b++;
+    if ((a > 0 && !diffAnchor(a - 1)) || (b < S.numrows && !diffAnchor(b))) {
+      // The rows around are new, so the edited ones are taken as new too.
+      for (; r < b; r++) {
+        if (!S.row[r].diff_stale)
+          continue;
+        S.row[r].diff_stale = 0;
+        S.row[r].diff = DIFF_ADDED | (S.row[r].diff & DIFF_DELETED);
+        S.row[r].head = -1;
+      }
+      r = b - 1;
+      continue;
+    }
+    int h0 = a > 0 ? S.row[a - 1].head + 1 : 0;
+    int h1 = b < S.numrows ? S.row[b].head : D->nhead;
+    diffRegion(a, b, h0, h1);
+    r = b;
+  }
+
+  D->lo = INT_MAX;
+  D->hi = -1;
+}
+
+void diffApply(struct Job* job, int status)
+{
+  struct Diff* D = &S.diff;
+  D->loading = 0;
+  if (status != 0 || S.filename == NULL) {
+    D->active = 0;
+    return;
+  }
+
+  D->nhead = 0;
+  for (int j = 0; j < job->outlen; j++)
+    if (job->out[j] == '\n')
+      D->nhead++;
+  if (job->outlen && job->out[job->outlen - 1] != '\n')
+    D->nhead++;
+  free(D->head);
+  D->head = malloc(sizeof(unsigned long long) * (D->nhead + 1));
+
+  char* p = job->out;
+  char* end = job->out + job->outlen;
+  for (int j = 0; j < D->nhead; j++) {
+    char* nl = memchr(p, '\n', end - p);
+    int len = nl ? nl - p : end - p;
+    while (len > 0 && p[len - 1] == '\r')
+      len--;
+    D->head[j] = hashBytes(p, len);
+    p = nl ? nl + 1 : end;
+  }
+
+  for (int r = 0; r < S.numrows; r++)
+    S.row[r].diff_stale = 1;
+  D->lo = 0;
+  D->hi = S.numrows - 1;
+  D->active = 1;
+  diffUpdate();
+}
+
+// The HEAD version came back, for whichever buffer asked for it.
+void diffLoadDone(struct Job* job, int status)
+{
+  struct Buffer* b = job->arg;
+  struct Buffer* cur = S.buffers[S.current];
+  if (b == cur) {
+    diffApply(job, status);
+    return;
+  }
+  bufferCopy(cur, 0);
+  bufferCopy(b, 1);
+  diffApply(job, status);
+  bufferCopy(b, 0);
+  bufferCopy(cur, 1);
+}
+
+// Fetch the HEAD version of the file for the diff gutter.
+void diffLoad()
+{
+  if (S.filename == NULL || S.diff.loading || S.rec.data || S.gzip.on)
+    return;
+
+  char* file;
+  char* dir = splitPath(S.filename, &file);
+  size_t speclen = strlen(file) + sizeof("HEAD:./");
+  char* spec = malloc(speclen);
+  snprintf(spec, speclen, "HEAD:./%s", file);
+
+  char* argv[] = { "git", "-C", dir, "show", spec, NULL };
+  if (spawnJob(argv, diffLoadDone, S.buffers[S.current]))
+    S.diff.loading = 1;
+  free(spec);
+  free(dir);
+}
+
+// Put the cursor on the char holding byte offset off.
+void gotoOffset(long long off)
+{
+  S.cy = offsetRow(off);
+  S.cx = 0;
+  if (S.cy < S.numrows)
+    S.cx = rowSeek(&S.row[S.cy], COL_CX, off - rowOffset(S.cy)).cx;
+}
+
+// Watch the file for changes made by other programs.
+void watchStart()
+{
+  struct Watch* W = &S.watch;
+  if (S.filename == NULL || S.rec.data)
+    return;
+  if (W->fd == -1 && (W->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+    return;
+  if (W->wd != -1)
+    inotify_rm_watch(W->fd, W->wd);
+
+  char* file;
+  char* dir = splitPath(S.filename, &file);
+  W->wd = inotify_add_watch(
+      W->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE);
+  free(dir);
+  if (stat(S.filename, &W->st) == -1)
+    memset(&W->st, 0, sizeof(W->st));
+  W->pending = 0;
+  W->conflict = 0;
+}
+
+int sameFile(struct stat* a, struct stat* b)
+{
+  return a->st_dev == b->st_dev && a->st_ino == b->st_ino
+      && a->st_size == b->st_size && a->st_mtim.tv_sec == b->st_mtim.tv_sec
+      && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+// The line of the file at p, less its newline. Returns the next line.
+char* nextLine(char* p, char* end, int* len)
+{
+  char* nl = memchr(p, '\n', end - p);
+  *len = (nl ? nl : end) - p;
+  if (nl && *len > 0 && p[*len - 1] == '\r')
+    (*len)--;
+  return nl ? nl + 1 : end;
+}
+
+int rowIs(int at, const char* s, int len)
+{
+  return S.row[at].size == len && memcmp(S.row[at].chars, s, len) == 0;
+}
+
+// Whether the line of the file at p is row at. Sets *next to the line after.
+int rowMatchesAt(int at, char* p, char* e, char** next)
+{
+  erow* row = &S.row[at];
+  char* q = p + row->size;
+  if (q > e || memcmp(p, row->chars, row->size))
+    return 0;
+  if (q + 1 < e && q[0] == '\r' && q[1] == '\n')
+    q++;
+  if (q < e && *q != '\n')
+    return 0;
+  *next = q < e ? q + 1 : e;
+  return 1;
+}
+
+// Whether the last line of [p, e) is row at. Sets *start to where it begins.
+int rowMatchesBefore(int at, char* p, char* e, char** start)
+{
+  erow* row = &S.row[at];
+  char* ce = e;
+  if (ce > p && ce[-1] == '\n') {
+    ce--;
+    if (ce > p && ce[-1] == '\r')
+      ce--;
+  }
+  char* ls = ce - row->size;
+  if (ls < p || memcmp(ls, row->chars, row->size) || (ls > p && ls[-1] != '\n'))
+    return 0;
+  *start = ls;
+  return 1;
+}
+
+/*
+ * Bring a buffer without unsaved edits in line with the file on disk,
+ * replacing only the rows that differ. Leading and trailing rows that still
+ * match are skipped with memcmp against the mapped file, and whatever is
+ * left in between is aligned with myersDiff. The reload is one undo group,
+ * unless it is too different to diff. A gzip file is inflated first.
+ */
+void reloadFile()
+{
+  int fd = open(S.filename, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    if (fd != -1)
+      close(fd);
+    setStatusMessage("Can't reload %s: %s", S.filename, strerror(errno));
+    return;
+  }
+  unsigned char magic[2];
+  int gz = pread(fd, magic, 2, 0) == 2 && magic[0] == 0x1f && magic[1] == 0x8b;
+  size_t size = st.st_size;
+  char* map;
+  if (gz) {
+    map = gzipInflate(fd, &size);
+    if (map == NULL) {
+      // Keep the rows, but don't let a save pass for an unchanged file.
+      S.watch.st = st;
+      S.watch.conflict = 1;
+      setStatusMessage("%s changed on disk and is corrupt! Saving will "
+                       "overwrite it",
+          S.filename);
+      return;
+    }
+  } else {
+    map = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (map == MAP_FAILED) {
+      setStatusMessage("Can't reload %s: %s", S.filename, strerror(errno));
+      return;
+    }
+  }
+  char* p = map;
+  char* e = map + size;
+
+  int pre = 0, suf = 0, len;
+  while (pre < S.numrows && p < e && rowMatchesAt(pre, p, e, &p))
+    pre++;
+  while (pre + suf < S.numrows && p < e
+      && rowMatchesBefore(S.numrows - 1 - suf, p, e, &e))
+    suf++;
+
+  int n = S.numrows - pre - suf, m = 0;
+  for (char* q = p; q < e; m++)
+    q = nextLine(q, e, &len);
+  char** lines = malloc(sizeof(char*) * (m + 1));
+  int* lens = malloc(sizeof(int) * (m + 1));
+  unsigned long long* a = malloc(sizeof(unsigned long long) * (n + 1));
+  unsigned long long* b = malloc(sizeof(unsigned long long) * (m + 1));
+  int* match = malloc(sizeof(int) * (m + 1));
+  for (int y = 0; y < m; y++) {
+    lines[y] = p;
+    p = nextLine(p, e, &lens[y]);
+    b[y] = hashBytes(lines[y], lens[y]);
+  }
+  for (int x = 0; x < n; x++)
+    a[x] = hashBytes(S.row[pre + x].chars, S.row[pre + x].size);
+
+  S.journal.suspended++;
+  int wholesale = myersDiff(a, n, b, m, match) == -1;
+  if (wholesale) {
+    // Too different to keep undo for: replace the middle outright.
+    undoClear(&S.undo.done);
+    undoClear(&S.undo.undone);
+    S.undo.suspended++;
+  }
+  // Old rows before limit[y] are free to reuse for line y.
+  int* limit = malloc(sizeof(int) * (m + 1));
+  for (int y = m - 1, lim = n; y >= 0; y--) {
+    if (match[y] >= 0 && !rowIs(pre + match[y], lines[y], lens[y]))
+      match[y] = -1;  // hash collision
+    limit[y] = lim;
+    if (match[y] >= 0)
+      lim = match[y];
+  }
+  undoBoundary(0);
+  beginBatch();
+  int r = pre, x = 0;
+  for (int y = 0; y < m; y++) {
+    if (match[y] >= 0) {
+      for (; x < match[y]; x++)
+        delRow(r);
+      x++;
+    } else if (x < limit[y]) {
+      // A changed line: rewrite the old row rather than shift every row.
+      rowDelRange(&S.row[r], 0, S.row[r].size);
+      if (lens[y])
+        rowInsertString(&S.row[r], 0, lines[y], lens[y]);
+      x++;
+    } else {
+      insertRow(r, lines[y], lens[y]);
+    }
+    r++;
+  }
+  for (; x < n; x++)
+    delRow(r);
+  endBatch();
+  undoBoundary(0);
+  if (wholesale)
+    S.undo.suspended--;
+  S.journal.suspended--;
+  journalRebase(S.journal.size);
+
+  free(limit);
+  free(match);
+  free(b);
+  free(a);
+  free(lens);
+  free(lines);
+  if (gz)
+    free(map);
+  else if (map)
+    munmap(map, size);
+
+  S.dirty = 0;
+  S.gzip.on = gz;
+  S.watch.st = st;
+  if (S.cy > S.numrows)
+    S.cy = S.numrows;
+  if (S.cy < S.numrows && S.cx > S.row[S.cy].size)
+    S.cx = S.row[S.cy].size;
+  setStatusMessage("Reloaded %s, %d lines changed", S.filename, m > n ? m : n);
+  diffLoad();
+}
+
+/*
+ * Check for changes to the file by other programs. A buffer without unsaved
+ * edits follows them; one with edits keeps them and warns before saving
+ * over the new file. Returns 1 if the screen needs a redraw.
+ */
+int watchPoll()
+{
+  struct Watch* W = &S.watch;
+  if (W->fd == -1 || S.filename == NULL)
+    return 0;
+
+  union {
+    struct inotify_event ev;
+    char buf[4096];
+  } u;
+  char* file;
+  free(splitPath(S.filename, &file));
+  ssize_t n;
+  while ((n = read(W->fd, u.buf, sizeof(u.buf))) > 0) {
+    for (char* p = u.buf; p < u.buf + n;) {
+      struct inotify_event* ev = (struct inotify_event*)p;
+      if (ev->len && strcmp(ev->name, file) == 0)
+        W->pending = 1;
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+  // A followed file grows through followPoll, and our own save lands first.
+  if (!W->pending || S.save || S.follow.fd != -1)
+    return 0;
+  W->pending = 0;
+
+  struct stat st;
+  if (stat(S.filename, &st) == -1) {
+    setStatusMessage("%s was removed on disk", S.filename);
+    return 1;
+  }
+  if (sameFile(&st, &W->st))
+    return 0;
+  if (S.dirty) {
+    W->st = st;
+    W->conflict = 1;
+    setStatusMessage("%s changed on disk! Saving will overwrite it", S.filename);
+    return 1;
+  }
+  reloadFile();
+  return 1;
+}
+
+// The cached lexer states are only good for the same definition.
+unsigned long long syntaxHash()
+{
+  if (S.syntax == NULL)
+    return 0;
+  return hashBytes(S.syntax->source, strlen(S.syntax->source));
+}
+
+// The part of a cache header that has to match the file for it to be used.
+void cacheKey(struct CacheHeader* h, const char* map, struct stat* st)
+{
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, CACHE_MAGIC, sizeof(h->magic));
+  h->syntax = syntaxHash();
+  long long head = st->st_size < CACHE_SAMPLE ? st->st_size : CACHE_SAMPLE;
+  long long tail = st->st_size - head < CACHE_SAMPLE ? st->st_size - head
+                                                     : CACHE_SAMPLE;
+  h->sample = hashBytes(map, head);
+  h->sample = hashUpdate(h->sample, map + st->st_size - tail, tail);
+  h->size = st->st_size;
+  h->mtime_sec = st->st_mtim.tv_sec;
+  h->mtime_nsec = st->st_mtim.tv_nsec;
+  h->ino = st->st_ino;
+}
+
+/*
+ * Build the rows from a cache of len bytes for the file mapped at map. The
+ * rows are only copied in: each is left stale with the lexer state it
+ * ends in, to be rendered and lexed by rowReady when first shown.
+ */
+int cacheRows(struct CacheHeader* h, long long len, char* map, struct stat* st)
+{
+  struct CacheHeader key;
+  cacheKey(&key, map, st);
+  long long n = h->numrows;
+  if (memcmp(h, &key, offsetof(struct CacheHeader, numrows)) || n < 0
+      || n >= INT_MAX
+      || len != (long long)sizeof(*h)
+              + (n + 1) * (long long)sizeof(long long)
+              + n * (long long)sizeof(unsigned int))
+    return 0;
+
+  long long* off = (long long*)(h + 1);
+  unsigned int* states = (unsigned int*)&off[n + 1];
+  int terminated = off[n] == st->st_size;
+  if (off[0] != 0 || (!terminated && off[n] != st->st_size + 1))
+    return 0;
+  for (long long j = 0; j < n; j++)
+    if (off[j + 1] <= off[j])
+      return 0;
+
+  S.rowcap = n ? n : 1;
+  S.row = malloc(sizeof(erow) * S.rowcap);
+  long long total = 0;
+  for (int j = 0; j < n; j++) {
+    int linelen = off[j + 1] - off[j] - 1;
+    if ((j + 1 < n || terminated) && linelen > 0
+        && map[off[j] + linelen - 1] == '\r')
+      linelen--;
+    initRow(&S.row[j], &map[off[j]], linelen);
+    S.row[j].stale = 1;
+    S.row[j].hl_state = states[j];
+    total += linelen + 1;
+  }
+  S.numrows = n;
+  S.bytes.total = total;
+  S.loop.hl_next = 0;
+  idleQueue(&S.loop.highlight);
+  S.follow.offset = st->st_size;
+  S.follow.partial = !terminated;
+  S.cy = h->cy < 0 || h->cy > n ? 0 : h->cy;
+  S.cx = S.cy < n && h->cx >= 0 && h->cx <= S.row[S.cy].size ? h->cx : 0;
+  return 1;
+}
+
+/*
+ * Load the open file fd from its cache instead of reading and lexing it,
+ * if there is one and it still matches. Returns 1 if the rows were loaded.
+ */
+int cacheLoad(int fd, struct stat* st)
+{
+  if (st->st_size < CACHE_MIN_SIZE || S.numrows || S.rec.data)
+    return 0;
+  char* path = sidecarPath(S.filename, CACHE_SUFFIX);
+  int cfd = open(path, O_RDONLY);
+  free(path);
+  if (cfd == -1)
+    return 0;
+
+  struct stat cst;
+  void* cache = MAP_FAILED;
+  if (fstat(cfd, &cst) == 0 && cst.st_size >= (off_t)sizeof(struct CacheHeader))
+    cache = mmap(NULL, cst.st_size, PROT_READ, MAP_PRIVATE, cfd, 0);
+  close(cfd);
+  if (cache == MAP_FAILED)
+    return 0;
+
+  int loaded = 0;
+  char* map = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map != MAP_FAILED) {
+    loaded = cacheRows(cache, cst.st_size, map, st);
+    munmap(map, st->st_size);
+  }
+  munmap(cache, cst.st_size);
+  return loaded;
+}
+
+/*
+ * Write the cache for a big file, at quit. The line offsets come from the
+ * file and the lexer states from the rows, so this is only done while the
+ * buffer and the file agree.
+ */
+void cacheWrite()
+{
+  struct stat st;
+  if (S.filename == NULL || S.dirty || S.watch.conflict || S.rec.data
+      || S.gzip.on || stat(S.filename, &st) == -1 || st.st_size < CACHE_MIN_SIZE
+      || !sameFile(&st, &S.watch.st))
+    return;
+  int fd = open(S.filename, O_RDONLY);
+  if (fd == -1)
+    return;
+  char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return;
+
+  struct CacheHeader h;
+  cacheKey(&h, map, &st);
+  h.numrows = S.numrows;
+  h.cy = S.cy;
+  h.cx = S.cx;
+  long long* off = malloc(sizeof(long long) * (S.numrows + 1));
+  unsigned int* states = malloc(sizeof(unsigned int) * (S.numrows + 1));
+  long long pos = 0;
+  int n = 0;
+  while (pos < st.st_size && n < S.numrows) {
+    char* nl = memchr(&map[pos], '\n', st.st_size - pos);
+    states[n] = S.row[n].hl_state;
+    off[n++] = pos;
+    pos = nl ? nl - map + 1 : st.st_size + 1;
+  }
+  off[n] = pos;
+  munmap(map, st.st_size);
+
+  char* path = sidecarPath(S.filename, CACHE_SUFFIX);
+  size_t tmplen = strlen(path) + sizeof(SAVE_TMP_SUFFIX);
+  char* tmp = malloc(tmplen);
+  snprintf(tmp, tmplen, "%s" SAVE_TMP_SUFFIX, path);
+  int tfd = n == S.numrows && pos >= st.st_size ? mkstemp(tmp) : -1;
+  if (tfd != -1) {
+    struct iovec iov[3] = { { &h, sizeof(h) },
+      { off, sizeof(long long) * (n + 1) },
+      { states, sizeof(unsigned int) * n } };
+    int ok = writeAllv(tfd, iov, 3) == 0;
+    close(tfd);
+    if (!ok || rename(tmp, path) == -1)
+      unlink(tmp);
+  }
+  free(tmp);
+  free(path);
+  free(states);
+  free(off);
+}
+
+void ares_goto_cb(char* query, int key)
+{
+  if (key == '\r' || key == '\x1b') {
+    char* end;
+    long long total = rowOffset(S.numrows);
+    if (query[0] == '@') {
+      long long off = strtoll(&query[1], &end, 0);
+      if (end != &query[1] && *end == '\0' && off >= 0 && off <= total)
+        gotoOffset(off);
+      else
+        setStatusMessage("Offset out of range");
+      return;
+    }
+    long long pct = strtoll(query, &end, 10);
+    if (end != query && strcmp(end, "%") == 0) {
+      if (pct >= 0 && pct <= 100)
+        gotoOffset(total * pct / 100);
+      else
+        setStatusMessage("You cant do that :(");
+      return;
+    }
+    int target = atoi(query) - 1;
+    if (target <= S.numrows && target >= 0) {
+      S.cy = target;
+      S.cx = 0;
+    } else {
+      setStatusMessage("You cant do that :(");
+    }
+    return;
+  }
+}
+
+void ares_goto()
+{
+  char* query = ares_prompt("Goto line, @offset or n%%: %s", ares_goto_cb);
+
+  if (query) {
+    free(query);
+  }
+}
+
+// Offset of the first occurrence of query in the row's chars, or -1.
+int rowFindChars(erow* row, const char* query)
+{
+  int qlen = strlen(query);
+  if (qlen == 0)
+    return 0;
+  const char* end = row->chars + row->size;
+  const char* p = row->chars;
+  while ((p = memchr(p, query[0], end - p)) != NULL) {
+    if (end - p < qlen)
+      break;
+    if (!memcmp(p, query, qlen))
+      return p - row->chars;
+    p++;
+  }
+  return -1;
+}
+
+void ares_find_cb(char* query, int key)
+{
+  static int last_match = -1;
+  static int direction = 1;
+
+  static int saved_hl_line;
+  static char* saved_hl = NULL;
+  static int saved_segs = 0;
+  STAT_START(find_start);
+
+  if (saved_hl) {
+    memcpy(S.row[saved_hl_line].hl, saved_hl, S.row[saved_hl_line].rsize);
+    free(saved_hl);
+    saved_hl = NULL;
+  }
+  if (saved_segs) {
+    segEvict(&S.row[saved_hl_line], 0, -1);
+    saved_segs = 0;
+  }
+
+  if (key == '\r' || key == '\x1b') {
+    last_match = -1;
+    direction = 1;
+    return;
+  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+    direction = 1;
+  } else if (key == ARROW_LEFT || key == ARROW_UP) {
+    direction = -1;
+  } else {
+    last_match = -1;
+    direction = 1;
+  }
+
+  if (last_match == -1)
+    direction = 1;
+  int current = last_match;
+  int i;
+  for (i = 0; i < S.numrows; i++) {
+    current += direction;
+    if (current == -1)
+      current = S.numrows - 1;
+    else if (current == S.numrows)
+      current = 0;
+
+    erow* row = &S.row[current];
+    // Unrendered rows are only rendered if the text is there; a space might
+    // still match an expanded tab.
+    if (row->stale && !strchr(query, ' ') && rowFindChars(row, query) == -1)
+      continue;
+    rowReady(row);
+    if (row->segs) {
+      int cx = rowFindChars(row, query);
+      if (cx == -1)
+        continue;
+      last_match = current;
+      S.cy = current;
+      S.cx = cx;
+      S.rowoff = S.numrows;
+
+      segHighlight(row, cx, strlen(query), HL_MATCH);
+      saved_hl_line = current;
+      saved_segs = 1;
+      break;
+    }
+    char* match = strstr(row->render, query);
+    if (match) {
+      last_match = current;
+      S.cy = current;
+      S.cx = rowSeek(row, COL_RI, match - row->render).cx;
+      S.rowoff = S.numrows;
+
+      saved_hl_line = current;
+      saved_hl = malloc(row->rsize);
+      memcpy(saved_hl, row->hl, row->rsize);
+      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
+      break;
+    }
+  }
+  STAT_STOP(STAT_FIND, find_start);
+}
+
+void ares_find()
+{
+  char* query = ares_prompt("Search: %s (Use ESC/Arrows/Enter)", ares_find_cb);
+
+  if (query) {
+    free(query);
+  }
+}
+
+// Node of the word s in the word index, or -1 if no word starts with it.
+int wordFind(const char* s, int len)
+{
+  struct Words* W = &S.words;
+  if (W->nnodes == 0)
+    return -1;
+  int k = 0;
+  for (int i = 0; i < len; i++) {
+    int j = W->node[k].child;
+    while (j && W->node[j].c != (unsigned char)s[i])
+      j = W->node[j].next;
+    if (j == 0)
+      return -1;
+    k = j;
+  }
+  return k;
+}
+
+// Write the word ending at node k into buf (WORD_MAX bytes), returns its length.
+int wordText(int k, char* buf)
+{
+  int len = S.words.node[k].len;
+  for (int i = len - 1; i >= 0; i--, k = S.words.node[k].parent)
+    buf[i] = S.words.node[k].c;
+  return len;
+}
+
+/*
+ * Offer node k, dist rows from the cursor, to the ranked completions:
+ * nearer words first, then more frequent ones, then the one offered first.
+ */
+void completeOffer(int k, int dist)
+{
+  struct Completion* C = &S.complete;
+  int count = S.words.node[k].count;
+  int i;
+  for (i = 0; i < C->n && C->node[i] != k; i++)
+    ;
+  if (i < C->n) {
+    if (C->dist[i] <= dist)
+      return;
+    C->n--;
+    memmove(&C->node[i], &C->node[i + 1], sizeof(int) * (C->n - i));
+    memmove(&C->dist[i], &C->dist[i + 1], sizeof(int) * (C->n - i));
+  }
+
+  for (i = C->n; i > 0; i--) {
+    int before = C->dist[i - 1] != dist
+        ? C->dist[i - 1] < dist
+        : S.words.node[C->node[i - 1]].count >= count;
+    if (before)
+      break;
+  }
+  if (i == COMPLETE_MAX)
+    return;
+  if (C->n < COMPLETE_MAX)
+    C->n++;
+  memmove(&C->node[i + 1], &C->node[i], sizeof(int) * (C->n - i - 1));
+  memmove(&C->dist[i + 1], &C->dist[i], sizeof(int) * (C->n - i - 1));
+  C->node[i] = k;
+  C->dist[i] = dist;
+}
+
+// Offer the words in a row's list that extend the prefix at node p.
+void completeList(int* words, int n, int p, int dist)
+{
+  int plen = S.words.node[p].len;
+  for (int j = 0; j < n; j++) {
+    int k = words[j];
+    if (S.words.node[k].len <= plen)
+      continue;
+    while (S.words.node[k].len > plen)
+      k = S.words.node[k].parent;
+    if (k == p)
+      completeOffer(words[j], dist);
+  }
+}
+
+/*
+ * Offer the words below node k by frequency. A subtree is skipped once
+ * the list is full of words it can't beat: its total bounds any count in it.
+ */
+void completeWalk(int k)
+{
+  struct Completion* C = &S.complete;
+  struct WordNode* w = &S.words.node[k];
+  if (C->n == COMPLETE_MAX
+      && (C->dist[C->n - 1] <= COMPLETE_NEAR
+          || w->total <= S.words.node[C->node[C->n - 1]].count))
+    return;
+  if (w->count > 0 && w->len > C->plen)
+    completeOffer(k, COMPLETE_NEAR + 1);
+  for (int j = w->child; j; j = S.words.node[j].next)
+    if (S.words.node[j].total > 0)
+      completeWalk(j);
+}
+
+// Take the word before the cursor as the prefix, returns its length.
+int completeStart()
+{
+  struct Completion* C = &S.complete;
+  if (S.cy >= S.numrows)
+    return 0;
+  erow* row = &S.row[S.cy];
+  int start = S.cx;
+  while (start > 0 && S.cx - start < WORD_MAX
+      && isWordChar(row->chars[start - 1]))
+    start--;
+  C->cy = S.cy;
+  C->cx = S.cx;
+  C->plen = S.cx - start;
+  return C->plen;
+}
+
+/*
+ * Rank the words that extend the prefix: those in the rows around the
+ * cursor by distance, then the rest of the index by frequency.
+ */
+void completeQuery()
+{
+  struct Completion* C = &S.complete;
+  C->n = 0;
+  C->sel = 0;
+  int p = wordFind(&S.row[C->cy].chars[C->cx - C->plen], C->plen);
+  if (p == -1)
+    return;
+  for (int d = 0; d <= COMPLETE_NEAR; d++) {
+    int at[2] = { C->cy - d, C->cy + d };
+    for (int j = 0; j < (d ? 2 : 1); j++) {
+      if (at[j] < 0 || at[j] >= S.numrows)
+        continue;
+      erow* row = &S.row[at[j]];
+      completeList(row->words, row->nwords, p, d);
+      for (int s = 0; s < row->nsegs; s++)
+        completeList(row->segs[s].words, row->segs[s].nwords, p, d);
+    }
+  }
+  completeWalk(p);
+}
+
+void completeAccept()
+{
+  struct Completion* C = &S.complete;
+  char word[WORD_MAX];
+  int len = wordText(C->node[C->sel], word);
+  C->active = 0;
+  beginBatch();
+  rowInsertString(&S.row[C->cy], C->cx, &word[C->plen], len - C->plen);
+  endBatch();
+  S.cx = C->cx + len - C->plen;
+}
+
+// Complete the word before the cursor from the words in the buffer.
+void ares_complete()
+{
+  struct Completion* C = &S.complete;
+  if (completeStart() == 0) {
+    setStatusMessage("No word to complete");
+    return;
+  }
+  completeQuery();
+  if (C->n == 0)
+    setStatusMessage("No completions");
+  else if (C->n == 1)
+    completeAccept();
+  else
+    C->active = 1;
+}
+
+/*
+ * Keys for the open popup. Returns 0 for a key the editor should handle:
+ * typing or deleting word chars keeps the popup and narrows it, anything
+ * else closes it.
+ */
+int completeKeypress(int c)
+{
+  struct Completion* C = &S.complete;
+  switch (c) {
+  case CTRL_KEY('n'):
+  case ARROW_DOWN:
+    C->sel = (C->sel + 1) % C->n;
+    return 1;
+  case ARROW_UP:
+    C->sel = (C->sel + C->n - 1) % C->n;
+    return 1;
+  case '\r':
+  case '\t':
+    undoBoundary(c);
+    completeAccept();
+    return 1;
+  case '\x1b':
+    C->active = 0;
+    return 1;
+  }
+  if (c != BACKSPACE && c != CTRL_KEY('h') && (c > 255 || !isWordChar(c)))
+    C->active = 0;
+  return 0;
+}
+
+// Requery after the word before the cursor changed.
+void completeUpdate()
+{
+  struct Completion* C = &S.complete;
+  if (S.cy != C->cy || completeStart() == 0) {
+    C->active = 0;
+    return;
+  }
+  completeQuery();
+  if (C->n == 0)
+    C->active = 0;
+}
+
+struct abuf {
+  char* b;
+  int len;
+};
+
+#define ABUF_INIT                                                              \
+  {                                                                            \
+    NULL, 0                                                                    \
+  }
+
+void abAppend(struct abuf* ab, const char* s, int len)
+{
+  char* new = realloc(ab->b, ab->len + len);
+
+  if (new == NULL)
+    return;
+  memcpy(&new[ab->len], s, len);
+  ab->b = new;
+  ab->len += len;
+}
+
+void abFree(struct abuf* ab) { free(ab->b); }
+
+// Columns left for text once the diff gutter is drawn.
+int textCols()
+{
+  return S.screencols - (S.diff.active ? 1 : 0);
+}
+
+/*
+ * Scroll by visual lines: rowoff and wrap.skip give the top screen line,
+ * which the cursor's line is kept on screen from. coloff becomes the start
+ * of the cursor's line, so the cursor column stays rx - coloff.
+ */
+void wrapScroll()
+{
+  struct Wrap* W = &S.wrap;
+  if (W->cols != textCols())
+    wrapReset();
+  erow* row = S.cy < S.numrows ? &S.row[S.cy] : NULL;
+  int k = row ? wrapLineOf(row, S.rx) : 0;
+  long long cur = indexSum(&W->lines, S.cy) + k;
+  long long top = indexSum(&W->lines, S.rowoff) + W->skip;
+  if (cur < top)
+    top = cur;
+  if (cur >= top + S.screenrows)
+    top = cur - S.screenrows + 1;
+  S.rowoff = indexFind(&W->lines, top);
+  W->skip = top - indexSum(&W->lines, S.rowoff);
+  W->y = cur - top;
+  S.coloff = row ? wrapStart(row, k) : 0;
+}
+
+// Put the cursor on a visual line, col columns in or at its end.
+void wrapGoto(long long line, int col)
+{
+  S.cy = indexFind(&S.wrap.lines, line);
+  if (S.cy >= S.numrows) {
+    S.cy = S.numrows;
+    S.cx = 0;
+    return;
+  }
+  erow* row = &S.row[S.cy];
+  int k = line - indexSum(&S.wrap.lines, S.cy);
+  int rx = wrapStart(row, k) + col;
+  // The start of the next line belongs to it, stop at the char before.
+  if (k + 1 < wrapLines(row) && rx >= wrapStart(row, k + 1))
+    rx = wrapStart(row, k + 1) - 1;
+  S.cx = rowRxToCx(row, rx);
+}
+
+// Move the cursor a visual line up or down, keeping its screen column.
+void wrapMove(int dir)
+{
+  long long line = indexSum(&S.wrap.lines, S.cy);
+  int col = 0;
+  if (S.cy < S.numrows) {
+    erow* row = &S.row[S.cy];
+    int rx = rowCxToRx(row, S.cx);
+    int k = wrapLineOf(row, rx);
+    line += k;
+    col = rx - wrapStart(row, k);
+  }
+  if (line + dir >= 0)
+    wrapGoto(line + dir, col);
+}
+
+void scroll()
+{
+  int cols = textCols();
+  int width = 1;
+  S.rx = 0;
+  if (S.cy < S.numrows) {
+    erow* row = &S.row[S.cy];
+    S.rx = rowCxToRx(row, S.cx);
+    // A wide char under the cursor has to fit on screen whole.
+    if (S.cx < row->size && row->chars[S.cx] != '\t') {
+      int cp;
+      utf8Decode(&row->chars[S.cx], row->size - S.cx, &cp);
+      if (charWidth(cp) > 1)
+        width = charWidth(cp);
+    }
+  }
+
+  if (S.wrap.on) {
+    wrapScroll();
+    return;
+  }
+  if (S.cy < S.rowoff) {
+    S.rowoff = S.cy;
+  }
+  if (S.cy >= S.rowoff + S.screenrows) {
+    S.rowoff = S.cy - S.screenrows + 1;
+  }
+  if (S.rx < S.coloff) {
+    S.coloff = S.rx;
+  }
+  if (S.rx + width > S.coloff + cols) {
+    S.coloff = S.rx + width - cols;
+  }
+}
+
+void drawGutter(struct abuf* ab, erow* row)
+{
+  char* mark = " ";
+  if (row->diff & DIFF_MODIFIED)
+    mark = "\x1b[" DIFF_MODIFIED_COLOR "m~\x1b[39m";
+  else if (row->diff & DIFF_ADDED)
+    mark = "\x1b[" DIFF_ADDED_COLOR "m+\x1b[39m";
+  else if (row->diff & DIFF_DELETED)
+    mark = "\x1b[" DIFF_DELETED_COLOR "m-\x1b[39m";
+  abAppend(ab, mark, strlen(mark));
+}
+
+/*
+ * Draw render text into at most *room screen columns, leaving out the first
+ * skip columns. A wide char cut by the left edge shows as spaces, and one
+ * that doesn't fit at the right edge ends the line (*room becomes 0).
+ */
+void drawText(struct abuf* ab, const char* c, const unsigned char* hl, int len,
+    int skip, int* room, char* current_color)
+{
+  int j = 0;
+  while (j < len && *room > 0) {
+    int cp;
+    int n = utf8Decode(&c[j], len - j, &cp);
+    int w = charWidth(cp);
+    if (skip > 0) {
+      int hidden = w < skip ? w : skip;
+      for (int k = hidden; k < w && *room > 0; k++, (*room)--)
+        abAppend(ab, " ", 1);
+      skip -= hidden;
+      j += n;
+      continue;
+    }
+    if (w > *room) {
+      *room = 0;
+      break;
+    }
+
+    if (cp < 0 || (cp < 0x80 && iscntrl(cp))) {
+      char sym = (cp >= 0 && cp <= 26) ? '@' + cp : '?';
+      abAppend(ab, "\x1b[7m", 4);
+      abAppend(ab, &sym, 1);
+      abAppend(ab, "\x1b[m", 3);
+      if (*current_color != -1) {
+        char buf[16];
+        int clen = snprintf(
+            buf, sizeof(buf), "\x1b[%sm", syntaxToColor(*current_color));
+        abAppend(ab, buf, clen);
+      }
+    } else if (hl[j] == HL_NORMAL) {
+      if (*current_color != -1) {
+        abAppend(ab, "\x1b[39m", 5);
+        *current_color = -1;
+      }
+      abAppend(ab, &c[j], n);
+    } else {
+      if (hl[j] != *current_color) {
+        *current_color = hl[j];
+        char buf[16];
+        int clen = snprintf(buf, sizeof(buf), "\x1b[%sm", syntaxToColor(hl[j]));
+        abAppend(ab, buf, clen);
+      }
+      abAppend(ab, &c[j], n);
+    }
+    *room -= w;
+    j += n;
+  }
+}
+
+// Draw the visible columns of a long row from the segments they fall in.
+void drawLongRow(struct abuf* ab, erow* row, int coloff, char* current_color)
+{
+  int room = textCols();
+  int first = segFindRx(row, coloff);
+  struct ColPos p = rowSeek(row, COL_RX, coloff);
+  int ri = p.ri;
+  int skip = coloff - p.rx;
+  int j;
+  for (j = first; j < row->nsegs && room > 0; j++) {
+    struct Segment* seg = segCached(row, j);
+    drawText(ab, &seg->render[ri], &seg->hl[ri], seg->rsize - ri, skip, &room,
+        current_color);
+    ri = 0;
+    skip = 0;
+  }
+  segEvict(row, first, j - 1);
+}
+
+void drawRows(struct abuf* ab)
+{
+  int y;
+  int filerow = S.rowoff;
+  int line = S.wrap.on ? S.wrap.skip : 0;
+  for (y = 0; y < S.screenrows; y++) {
+    if (filerow >= S.numrows) {
+      if (S.numrows == 0 && y == S.screenrows / 3) {
+        char welcome[80];
+        int welcomelen = snprintf(
+            welcome, sizeof(welcome), "Ares -- version %s", ARES_VERSION);
+        if (welcomelen > S.screencols)
+          welcomelen = S.screencols;
+        int padding = (S.screencols - welcomelen) / 2;
+        if (padding) {
+          abAppend(ab, SIDE_CHARACTER, 1);
+          padding--;
+        }
+        while (padding--)
+          abAppend(ab, " ", 1);
+        abAppend(ab, welcome, welcomelen);
+      } else {
+        abAppend(ab, SIDE_CHARACTER, 1);
+      }
+      filerow++;
+    } else {
+      erow* row = &S.row[filerow];
+      rowReady(row);
+      if (S.diff.active) {
+        if (line == 0)
+          drawGutter(ab, row);
+        else
+          abAppend(ab, " ", 1);
+      }
+      int coloff = S.wrap.on ? wrapStart(row, line) : S.coloff;
+      bracketMark(row, HL_BRACKET);
+      char current_color = -1;
+      if (row->segs) {
+        drawLongRow(ab, row, coloff, &current_color);
+      } else {
+        struct ColPos p = rowSeek(row, COL_RX, coloff);
+        int room = textCols();
+        drawText(ab, &row->render[p.ri], &row->hl[p.ri], row->rsize - p.ri,
+            coloff - p.rx, &room, &current_color);
+      }
+      bracketMark(row, HL_NORMAL);
+      abAppend(ab, "\x1b[39m", 5);
+      if (!S.wrap.on || ++line >= wrapLines(row)) {
+        filerow++;
+        line = 0;
+      }
+    }
+
+    abAppend(ab, "\x1b[K", 3);
+    abAppend(ab, "\r\n", 2);
+  }
+}
+
+void drawPane(struct abuf* ab)
+{
+  struct Pane* P = &S.pane;
+  for (int y = 0; y < S.screenrows; y++) {
+    int line = y + P->scroll;
+    if (line < P->numlines) {
+      int start = P->lines[line];
+      int end = line + 1 < P->numlines ? P->lines[line + 1] : P->len;
+      // Progress output redraws its line with \r; show the final state.
+      for (int j = start; j < end - 1; j++)
+        if (P->text[j] == '\r' && P->text[j + 1] != '\n')
+          start = j + 1;
+      int col = 0;
+      for (int j = start; j < end && col < S.screencols; j++, col++) {
+        char c = P->text[j];
+        if (c == '\n' || c == '\r')
+          break;
+        if (iscntrl(c))
+          c = '?';
+        abAppend(ab, &c, 1);
+      }
+    } else {
+      abAppend(ab, SIDE_CHARACTER, 1);
+    }
+    abAppend(ab, "\x1b[K", 3);
+    abAppend(ab, "\r\n", 2);
+  }
+}
+
+// Grep results, one matching line per row with the match highlighted.
+void drawGrep(struct abuf* ab)
+{
+  struct Grep* G = &S.grep;
+  for (int y = 0; y < S.screenrows; y++) {
+    int k = y + G->scroll;
+    if (k >= G->nlist) {
+      abAppend(ab, SIDE_CHARACTER, 1);
+      abAppend(ab, "\x1b[K", 3);
+      abAppend(ab, "\r\n", 2);
+      continue;
+    }
+    struct GrepHit* h = G->list[k];
+    if (k == G->sel)
+      abAppend(ab, "\x1b[7m", 4);
+    char head[PATH_MAX + 16];
+    int col = snprintf(head, sizeof(head), "%s:%d: ", h->file->path, h->line);
+    if (col > (int)sizeof(head) - 1)
+      col = sizeof(head) - 1;
+    if (col > S.screencols)
+      col = S.screencols;
+    abAppend(ab, head, col);
+
+    int j = 0;
+    while (j < h->len && j < h->col && (h->text[j] == ' ' || h->text[j] == '\t'))
+      j++;
+    for (; j < h->len && col < S.screencols; j++, col++) {
+      if (j == h->col && k != G->sel)
+        abAppend(ab, "\x1b[" SEARCH_MATCH_HIGHLIGHT_COLOR "m",
+            strlen("\x1b[" SEARCH_MATCH_HIGHLIGHT_COLOR "m"));
+      else if (j == h->col + G->qlen && k != G->sel)
+        abAppend(ab, "\x1b[39m", 5);
+      char c = h->text[j];
+      if (c == '\t')
+        c = ' ';
+      else if (iscntrl(c))
+        c = '?';
+      abAppend(ab, &c, 1);
+    }
+    abAppend(ab, "\x1b[m", 3);
+    abAppend(ab, "\x1b[K", 3);
+    abAppend(ab, "\r\n", 2);
+  }
+}
+
+// Completion popup over the text, below the word or above it near the bottom.
+void drawCompletion(struct abuf* ab)
+{
+  struct Completion* C = &S.complete;
+  char word[WORD_MAX];
+  int width = 0;
+  for (int i = 0; i < C->n; i++) {
+    int len = wordText(C->node[i], word), w = 0;
+    for (int j = 0, cp; j < len; w += charWidth(cp))
+      j += utf8Decode(&word[j], len - j, &cp);
+    if (w > width)
+      width = w;
+  }
+  width += 2;
+  if (width > S.screencols)
+    width = S.screencols;
+
+  int y = (S.wrap.on ? S.wrap.y : S.cy - S.rowoff) + 1;
+  if (y + C->n > S.screenrows)
+    y -= C->n + 1;
+  if (y < 0)
+    y = 0;
+  int gutter = S.screencols - textCols();
+  int x = rowSeek(&S.row[C->cy], COL_CX, C->cx - C->plen).rx - S.coloff
+      + gutter - 1;
+  if (x < gutter)
+    x = gutter;
+  if (x + width > S.screencols)
+    x = S.screencols - width;
+
+  unsigned char hl[WORD_MAX];
+  memset(hl, HL_NORMAL, sizeof(hl));
+  for (int i = 0; i < C->n && y + i < S.screenrows; i++) {
+    char buf[48];
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH\x1b[%sm ", y + i + 1,
+        x + 1, i == C->sel ? COMPLETE_SELECTED_COLOR : COMPLETE_MENU_COLOR);
+    abAppend(ab, buf, len);
+    int room = width - 1;
+    char color = HL_NORMAL;
+    drawText(ab, word, hl, wordText(C->node[i], word), 0, &room, &color);
+    while (room-- > 0)
+      abAppend(ab, " ", 1);
+    abAppend(ab, "\x1b[m", 3);
+  }
+}
+
+#ifdef ARES_STATS
+/*
+ * Allocation counters. The stats build links with --wrap for the malloc
+ * family so every call, including ones made inside libc, lands here first.
+ */
+_Atomic unsigned long stat_allocs;
+_Atomic unsigned long stat_alloc_bytes;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t nmemb, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size)
+{
+  stat_allocs++;
+  stat_alloc_bytes += size;
+  return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t nmemb, size_t size)
+{
+  stat_allocs++;
+  stat_alloc_bytes += nmemb * size;
+  return __real_calloc(nmemb, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size)
+{
+  stat_allocs++;
+  stat_alloc_bytes += size;
+  return __real_realloc(ptr, size);
+}
+
+const char* stat_names[STAT_COUNT] = { "key_latency_ns", "frame_ns",
+  "draw_rows_ns", "update_syntax_ns", "find_ns", "frame_bytes",
+  "frame_allocs" };
+
+int statBucket(unsigned long long v)
+{
+  if (v < 4)
+    return v;
+  int msb = 63 - __builtin_clzll(v);
+  return (msb - 1) * 4 + ((v >> (msb - 2)) & 3);
+}
+
+unsigned long long statBucketLow(int b)
+{
+  if (b < 4)
+    return b;
+  return (4ULL + b % 4) << (b / 4 - 1);
 }
 
-void ares_find()
+void statAdd(int id, long long v)
 {
-  char* query = ares_prompt("Search: %s (Use ESC/Arrows/Enter)", ares_find_cb);
-
-  if (query) {
-    free(query);
-  }
+  struct Histogram* h = &S.stats.hist[id];
+  if (v < 0)
+    v = 0;
+  h->count++;
+  h->sum += v;
+  if ((unsigned long long)v > h->max)
+    h->max = v;
+  h->buckets[statBucket(v)]++;
 }
 
-struct abuf {
-  char* b;
-  int len;
-};
-
-#define ABUF_INIT                                                              \
-  {                                                                            \
-    NULL, 0                                                                    \
+// Upper edge of the bucket holding the p-th quantile, capped at the max seen.
+unsigned long long statPercentile(struct Histogram* h, double p)
+{
+  if (h->count == 0)
+    return 0;
+  unsigned long long want = p * h->count, seen = 0;
+  for (int b = 0; b < STATS_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen > want) {
+      unsigned long long hi = b + 1 < STATS_BUCKETS ? statBucketLow(b + 1) - 1
+                                                    : h->max;
+      return hi < h->max ? hi : h->max;
+    }
   }
+  return h->max;
+}
 
-void abAppend(struct abuf* ab, const char* s, int len)
+int formatNs(char* buf, int size, long long ns)
 {
-  char* new = realloc(ab->b, ab->len + len);
-
-  if (new == NULL)
-    return;
-  memcpy(&new[ab->len], s, len);
-  ab->b = new;
-  ab->len += len;
+  if (ns < 1000)
+    return snprintf(buf, size, "%lldns", ns);
+  if (ns < 1000000)
+    return snprintf(buf, size, "%.1fus", ns / 1e3);
+  return snprintf(buf, size, "%.1fms", ns / 1e6);
 }
 
-void abFree(struct abuf* ab) { free(ab->b); }
-
-void scroll()
+// Account for a finished frame; start is when refreshScreen was entered.
+void statsFrame(long long start, long long draw, int bytes)
 {
-  S.rx = 0;
-  if (S.cy < S.numrows) {
-    S.rx = rowCxToRx(&S.row[S.cy], S.cx);
+  long long now = nowNs();
+  unsigned long allocs = stat_allocs;
+  struct Stats* st = &S.stats;
+  if (st->key_ns) {
+    statAdd(STAT_KEY, now - st->key_ns);
+    st->key_ns = 0;
   }
+  st->last_frame = now - start;
+  st->last_draw = draw;
+  st->last_bytes = bytes;
+  st->last_allocs = allocs - st->frame_allocs;
+  st->frame_allocs = allocs;
+  statAdd(STAT_FRAME, st->last_frame);
+  statAdd(STAT_DRAW, draw);
+  statAdd(STAT_BYTES, bytes);
+  statAdd(STAT_ALLOCS, st->last_allocs);
+}
 
-  if (S.cy < S.rowoff) {
-    S.rowoff = S.cy;
-  }
-  if (S.cy >= S.rowoff + S.screenrows) {
-    S.rowoff = S.cy - S.screenrows + 1;
-  }
-  if (S.rx < S.coloff) {
-    S.coloff = S.rx;
-  }
-  if (S.rx >= S.coloff + S.screencols) {
-    S.coloff = S.rx - S.screencols + 1;
-  }
+int statsOverlay(char* buf, int size)
+{
+  struct Histogram* key = &S.stats.hist[STAT_KEY];
+  char p50[16], p99[16], frame[16];
+  formatNs(p50, sizeof(p50), statPercentile(key, 0.5));
+  formatNs(p99, sizeof(p99), statPercentile(key, 0.99));
+  formatNs(frame, sizeof(frame), S.stats.last_frame);
+  return snprintf(buf, size, "key p50 %s p99 %s | frame %s %lldB %lld allocs | ",
+      p50, p99, frame, S.stats.last_bytes, S.stats.last_allocs);
 }
 
-void drawRows(struct abuf* ab)
+void ares_stats_dump()
 {
-  int y;
-  for (y = 0; y < S.screenrows; y++) {
-    int filerow = y + S.rowoff;
-    if (filerow >= S.numrows) {
-      if (S.numrows == 0 && y == S.screenrows / 3) {
-        char welcome[80];
-        int welcomelen = snprintf(
-            welcome, sizeof(welcome), "Ares -- version %s", ARES_VERSION);
-        if (welcomelen > S.screencols)
-          welcomelen = S.screencols;
-        int padding = (S.screencols - welcomelen) / 2;
-        if (padding) {
-          abAppend(ab, SIDE_CHARACTER, 1);
-          padding--;
-        }
-        while (padding--)
-          abAppend(ab, " ", 1);
-        abAppend(ab, welcome, welcomelen);
-      } else {
-        abAppend(ab, SIDE_CHARACTER, 1);
-      }
-    } else {
-      int len = S.row[filerow].rsize - S.coloff;
-      if (len < 0)
-        len = 0;
-      if (len > S.screencols)
-        len = S.screencols;
-      char* c = &S.row[filerow].render[S.coloff];
-      unsigned char* hl = &S.row[filerow].hl[S.coloff];
-      char current_color;
-      int j;
-      for (j = 0; j < len; j++) {
-        if (iscntrl(c[j])) {
-          char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-          abAppend(ab, "\x1b[7m", 4);
-          abAppend(ab, &sym, 1);
-          abAppend(ab, "\x1b[m", 3);
-          if (current_color != -1) {
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-            abAppend(ab, buf, clen);
-          }
-        } else if (hl[j] == HL_NORMAL) {
-          if (current_color != -1) {
-            abAppend(ab, "\x1b[39m", 5);
-            current_color = -1;
-          }
-          abAppend(ab, &c[j], 1);
-        } else {
-          char* color = syntaxToColor(hl[j]);
-          if (*color != current_color) {
-            current_color = *color;
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%sm", color);
-            abAppend(ab, buf, clen);
-          }
-          abAppend(ab, &c[j], 1);
-        }
-      }
-      abAppend(ab, "\x1b[39m", 5);
-    }
+  char* path = ares_prompt("Dump stats to: %s (ESC to cancel)", NULL);
+  if (path == NULL)
+    return;
 
-    abAppend(ab, "\x1b[K", 3);
-    abAppend(ab, "\r\n", 2);
+  FILE* fp = fopen(path, "w");
+  if (fp == NULL) {
+    setStatusMessage("Can't write %s: %s", path, strerror(errno));
+    free(path);
+    return;
   }
+  fprintf(fp, "# ares %s stats, %lu allocations totalling %lu bytes\n",
+      ARES_VERSION, (unsigned long)stat_allocs,
+      (unsigned long)stat_alloc_bytes);
+  for (int id = 0; id < STAT_COUNT; id++) {
+    struct Histogram* h = &S.stats.hist[id];
+    fprintf(fp, "\n%s count %llu mean %.1f p50 %llu p90 %llu p99 %llu "
+                "p999 %llu max %llu\n",
+        stat_names[id], h->count, h->count ? (double)h->sum / h->count : 0.0,
+        statPercentile(h, 0.5), statPercentile(h, 0.9),
+        statPercentile(h, 0.99), statPercentile(h, 0.999), h->max);
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+      if (h->buckets[b] == 0)
+        continue;
+      unsigned long long hi = b + 1 < STATS_BUCKETS ? statBucketLow(b + 1) - 1
+                                                    : ~0ULL;
+      fprintf(fp, "%llu %llu %llu\n", statBucketLow(b), hi, h->buckets[b]);
+    }
+  }
+  if (fclose(fp) == EOF)
+    setStatusMessage("Can't write %s: %s", path, strerror(errno));
+  else
+    setStatusMessage("Stats written to %s", path);
+  free(path);
 }
+#endif
 
 void drawStatusBar(struct abuf* ab)
 {
   abAppend(ab, "\x1b[7m", 4);
-  char status[80], rstatus[80];
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
+  char status[96], rstatus[160];
+  int len = 0;
+  if (S.nbuffers > 1)
+    len = snprintf(status, sizeof(status), "[%d/%d] ", S.current + 1,
+        S.nbuffers);
+  len += snprintf(&status[len], sizeof(status) - len, "%.20s - %d lines %s",
       S.filename ? S.filename : "[No Name]", S.numrows,
       S.dirty ? "(modified)" : "");
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-      S.syntax ? S.syntax->filetype : "no ft", S.cy + 1, S.numrows);
+  int rlen = 0;
+#ifdef ARES_STATS
+  if (S.stats.overlay)
+    rlen = statsOverlay(rstatus, sizeof(rstatus));
+#endif
+  long long total = rowOffset(S.numrows);
+  long long off = S.cy < S.numrows ? rowOffset(S.cy) + S.cx : total;
+  rlen += snprintf(&rstatus[rlen], sizeof(rstatus) - rlen, "%s | %d/%d %d%%",
+      S.syntax ? S.syntax->filetype : "no ft", S.cy + 1, S.numrows,
+      total ? (int)(off * 100 / total) : 0);
+#ifdef ARES_STATS
+  // The overlay wins over the file name when both don't fit.
+  if (S.stats.overlay && len + rlen > S.screencols && rlen <= S.screencols)
+    len = S.screencols - rlen;
+#endif
   if (len > S.screencols)
     len = S.screencols;
   abAppend(ab, status, len);
@@ -987,31 +7225,52 @@ void drawMessageBar(struct abuf* ab)
   int msglen = strlen(S.statusmsg);
   if (msglen > S.screencols)
     msglen = S.screencols;
-  if (msglen && time(NULL) - S.statusmsg_time < 5)
+  if (msglen && time(NULL) - S.statusmsg_time < MESSAGE_SECONDS)
     abAppend(ab, S.statusmsg, msglen);
 }
 
 void refreshScreen()
 {
+  STAT_START(frame_start);
+  diffUpdate();
   scroll();
+  if (!S.pane.visible && !S.grep.visible)
+    bracketHighlight();
 
   struct abuf ab = ABUF_INIT;
 
   abAppend(&ab, "\x1b[?25l", 6);
   abAppend(&ab, "\x1b[H", 3);
 
-  drawRows(&ab);
+  STAT_START(draw_start);
+  if (S.pane.visible)
+    drawPane(&ab);
+  else if (S.grep.visible)
+    drawGrep(&ab);
+  else
+    drawRows(&ab);
+#ifdef ARES_STATS
+  long long draw = nowNs() - draw_start;
+#endif
   drawStatusBar(&ab);
   drawMessageBar(&ab);
+  if (S.complete.active && !S.pane.visible && !S.grep.visible)
+    drawCompletion(&ab);
 
   char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (S.cy - S.rowoff) + 1,
-      (S.rx - S.coloff) + 1);
+  int y = S.wrap.on ? S.wrap.y : S.cy - S.rowoff;
+  if (S.grep.visible && !S.pane.visible)
+    y = S.grep.sel - S.grep.scroll;
+  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1,
+      (S.rx - S.coloff) + 1 + (S.screencols - textCols()));
   abAppend(&ab, buf, strlen(buf));
 
   abAppend(&ab, "\x1b[?25h", 6);
 
-  write(STDOUT_FILENO, ab.b, ab.len);
+  S.output(ab.b, ab.len);
+#ifdef ARES_STATS
+  statsFrame(frame_start, draw, ab.len);
+#endif
   abFree(&ab);
 }
 
@@ -1022,6 +7281,7 @@ void setStatusMessage(const char* fmt, ...)
   vsnprintf(S.statusmsg, sizeof(S.statusmsg), fmt, ap);
   va_end(ap);
   S.statusmsg_time = time(NULL);
+  timerArm(&S.loop.message, MESSAGE_SECONDS * 1000);
 }
 
 char* ares_prompt(char* prompt, void (*callback)(char*, int))
@@ -1038,8 +7298,10 @@ char* ares_prompt(char* prompt, void (*callback)(char*, int))
 
     int c = readKey();
     if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
-      if (buflen != 0)
-        buf[--buflen] = '\0';
+      if (buflen != 0) {
+        buflen = utf8Prev(buf, buflen);
+        buf[buflen] = '\0';
+      }
     } else if (c == '\x1b') {
       setStatusMessage("");
       if (callback)
@@ -1053,7 +7315,7 @@ char* ares_prompt(char* prompt, void (*callback)(char*, int))
           callback(buf, c);
         return buf;
       }
-    } else if (!iscntrl(c) && c < 128) {
+    } else if (!iscntrl(c) && c < 256) {
       if (buflen == bufsize - 1) {
         bufsize *= 2;
         buf = realloc(buf, bufsize);
@@ -1067,6 +7329,15 @@ char* ares_prompt(char* prompt, void (*callback)(char*, int))
   }
 }
 
+int ares_confirm(char* prompt)
+{
+  setStatusMessage("%s", prompt);
+  refreshScreen();
+  int c = readKey();
+  setStatusMessage("");
+  return c == 'y' || c == 'Y';
+}
+
 void moveCursor(int key)
 {
   erow* row = (S.cy >= S.numrows) ? NULL : &S.row[S.cy];
@@ -1074,23 +7345,26 @@ void moveCursor(int key)
   switch (key) {
   case ARROW_LEFT:
     if (S.cx != 0) {
-      S.cx--;
+      S.cx = utf8Prev(row->chars, S.cx);
     }
     break;
   case ARROW_RIGHT:
     if (row && S.cx < row->size) {
-      S.cx++;
+      int cp;
+      S.cx += utf8Decode(&row->chars[S.cx], row->size - S.cx, &cp);
     }
     break;
   case ARROW_UP:
-    if (S.cy != 0) {
+    if (S.wrap.on)
+      wrapMove(-1);
+    else if (S.cy != 0)
       S.cy--;
-    }
     break;
   case ARROW_DOWN:
-    if (S.cy < S.numrows) {
+    if (S.wrap.on)
+      wrapMove(1);
+    else if (S.cy < S.numrows)
       S.cy++;
-    }
     break;
   }
 
@@ -1099,6 +7373,87 @@ void moveCursor(int key)
   if (S.cx > rowlen) {
     S.cx = rowlen;
   }
+  // Don't leave the cursor inside a multibyte char.
+  if (row)
+    S.cx = rowSeek(row, COL_CX, S.cx).cx;
+}
+
+void paneKeypress(int c)
+{
+  struct Pane* P = &S.pane;
+  switch (c) {
+  case ARROW_UP:
+    P->scroll--;
+    break;
+  case ARROW_DOWN:
+    P->scroll++;
+    break;
+  case PAGE_UP:
+    P->scroll -= S.screenrows;
+    break;
+  case PAGE_DOWN:
+    P->scroll += S.screenrows;
+    break;
+  case HOME_KEY:
+    P->scroll = 0;
+    break;
+  case END_KEY:
+    P->scroll = P->numlines;
+    break;
+  case '\x1b':
+  case 'q':
+  case CTRL_KEY('e'):
+    P->visible = 0;
+    break;
+  }
+  if (P->scroll > P->numlines - S.screenrows)
+    P->scroll = P->numlines - S.screenrows;
+  if (P->scroll < 0)
+    P->scroll = 0;
+}
+
+void grepKeypress(int c)
+{
+  struct Grep* G = &S.grep;
+  switch (c) {
+  case ARROW_UP:
+    G->sel--;
+    break;
+  case ARROW_DOWN:
+    G->sel++;
+    break;
+  case PAGE_UP:
+    G->sel -= S.screenrows;
+    break;
+  case PAGE_DOWN:
+    G->sel += S.screenrows;
+    break;
+  case HOME_KEY:
+    G->sel = 0;
+    break;
+  case END_KEY:
+    G->sel = G->nlist - 1;
+    break;
+  case '\r':
+    grepOpen();
+    return;
+  case CTRL_KEY('c'):
+    if (G->active)
+      grepCancel();
+    break;
+  case '\x1b':
+  case 'q':
+    G->visible = 0;
+    break;
+  }
+  if (G->sel > G->nlist - 1)
+    G->sel = G->nlist - 1;
+  if (G->sel < 0)
+    G->sel = 0;
+  if (G->scroll > G->sel)
+    G->scroll = G->sel;
+  if (G->scroll < G->sel - S.screenrows + 1)
+    G->scroll = G->sel - S.screenrows + 1;
 }
 
 void processKeypress()
@@ -1106,22 +7461,37 @@ void processKeypress()
   static int quit_times = QUIT_TIMES;
 
   int c = readKey();
+  if (S.pane.visible) {
+    paneKeypress(c);
+    return;
+  }
+  if (S.grep.visible) {
+    grepKeypress(c);
+    return;
+  }
+  if (S.complete.active && completeKeypress(c))
+    return;
+  int completing = S.complete.active;
+  undoBoundary(c);
 
+  beginBatch();
   switch (c) {
   case '\r':
     insertNewline();
     break;
 
   case CTRL_KEY(EXIT_KEY):
-    if (S.dirty && quit_times > 0) {
-      setStatusMessage("File has unsaved changes. "
+    if (buffersDirty() && quit_times > 0) {
+      setStatusMessage("%s has unsaved changes. "
                        "Press Ctrl-Q %d more times to quit.",
-          quit_times);
+          S.dirty ? "File" : "Another buffer", quit_times);
       quit_times--;
+      endBatch();
       return;
     }
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
+    buffersClose();
+    S.output("\x1b[2J", 4);
+    S.output("\x1b[H", 3);
     exit(0);
     break;
 
@@ -1150,6 +7520,60 @@ void processKeypress()
     ares_find();
     break;
 
+  case CTRL_KEY('e'):
+    if (S.pane.numlines)
+      S.pane.visible = 1;
+    else
+      setStatusMessage("No command output yet");
+    break;
+
+  case CTRL_KEY('z'):
+    ares_undo();
+    break;
+
+  case CTRL_KEY('b'):
+    ares_bracket();
+    break;
+
+  case CTRL_KEY('n'):
+    ares_complete();
+    break;
+
+  case CTRL_KEY('o'):
+    ares_open_buffer();
+    break;
+
+  case CTRL_KEY('p'):
+    ares_grep();
+    break;
+
+  case CTRL_KEY('x'):
+    ares_next_buffer();
+    break;
+
+  case CTRL_KEY('w'):
+    S.wrap.on = !S.wrap.on;
+    if (S.wrap.on)
+      wrapReset();
+    S.wrap.skip = 0;
+    S.coloff = 0;
+    setStatusMessage("Soft wrap %s", S.wrap.on ? "on" : "off");
+    break;
+
+  case CTRL_KEY('y'):
+    ares_redo();
+    break;
+
+#ifdef ARES_STATS
+  case CTRL_KEY('t'):
+    S.stats.overlay = !S.stats.overlay;
+    break;
+
+  case CTRL_KEY('d'):
+    ares_stats_dump();
+    break;
+#endif
+
   case BACKSPACE:
   case CTRL_KEY('h'):
   case DEL_KEY:
@@ -1160,6 +7584,13 @@ void processKeypress()
 
   case PAGE_UP:
   case PAGE_DOWN: {
+    if (S.wrap.on) {
+      long long top = indexSum(&S.wrap.lines, S.rowoff) + S.wrap.skip;
+      long long line = c == PAGE_UP ? top - S.screenrows
+                                    : top + 2 * S.screenrows - 1;
+      wrapGoto(line > 0 ? line : 0, 0);
+      break;
+    }
     if (c == PAGE_UP) {
       S.cy = S.rowoff;
     } else if (c == PAGE_DOWN) {
@@ -1210,11 +7641,15 @@ void processKeypress()
     insertChar(c);
     break;
   }
+  endBatch();
+  if (completing)
+    completeUpdate();
 
   quit_times = QUIT_TIMES;
 }
 
-void initEditor()
+// Set the per-buffer fields of S up for an empty buffer.
+void bufferInit()
 {
   S.cx = 0;
   S.cy = 0;
@@ -1223,27 +7658,431 @@ void initEditor()
   S.coloff = 0;
   S.numrows = 0;
   S.row = NULL;
+  S.rowcap = 0;
+  memset(&S.bytes, 0, sizeof(S.bytes));
+  S.bytes.weight = byteWeight;
+  memset(&S.wrap, 0, sizeof(S.wrap));
+  memset(&S.brackets, 0, sizeof(S.brackets));
+  S.wrap.lines.weight = wrapLines;
+  S.follow.fd = -1;
+  S.follow.pipe = 0;
+  S.follow.tail = 0;
+  S.follow.partial = 0;
+  S.follow.offset = 0;
+  S.gzip.on = 0;
+  S.gzip.job = NULL;
+  S.watch.fd = -1;
+  S.watch.wd = -1;
+  S.watch.pending = 0;
+  S.watch.conflict = 0;
   S.dirty = 0;
   S.filename = NULL;
+  S.syntax = NULL;
+  S.save = NULL;
+  S.journal.fd = -1;
+  S.journal.path = NULL;
+  S.journal.buf = NULL;
+  S.journal.len = 0;
+  S.journal.cap = 0;
+  S.journal.size = 0;
+  S.journal.dirty_since = 0;
+  S.journal.suspended = 0;
+  memset(&S.undo, 0, sizeof(S.undo));
+  memset(&S.diff, 0, sizeof(S.diff));
+  S.diff.lo = INT_MAX;
+  S.diff.hi = -1;
+}
+
+void initEditor()
+{
+  bufferInit();
+  S.buffers = malloc(sizeof(struct Buffer*));
+  S.buffers[0] = calloc(1, sizeof(struct Buffer));
+  S.nbuffers = 1;
+  S.current = 0;
   S.statusmsg[0] = '\0';
   S.statusmsg_time = 0;
-  S.syntax = NULL;
+  S.save_gen = 0;
+  S.batch = 0;
+  S.jobs = NULL;
+  memset(&S.pane, 0, sizeof(S.pane));
+  memset(&S.grep, 0, sizeof(S.grep));
+  pthread_mutex_init(&S.grep.lock, NULL);
+  pthread_cond_init(&S.grep.more, NULL);
+  S.input = ttyRead;
+  S.output = ttyWrite;
+  memset(&S.rec, 0, sizeof(S.rec));
+  memset(&S.loop, 0, sizeof(S.loop));
+  S.loop.input_fd = -1;
+  S.loop.wake[0] = S.loop.wake[1] = -1;
+  S.loop.message.fn = loopRedraw;
+  S.loop.progress.fn = loopRedraw;
+  S.loop.journal.fn = journalTimer;
+  S.loop.follow.fn = followTimer;
+  S.loop.resize.fn = resizeTimer;
+  S.loop.highlight.run = idleHighlight;
+  S.loop.index.run = idleIndex;
+  S.loop.brackets.run = idleBrackets;
+  S.loop.evict.run = idleEvict;
+  syntaxInit();
+}
 
-  if (getWindowSize(&S.screenrows, &S.screencols) == -1)
-    die("getWindowSize");
-  S.screenrows -= 2;
+// Size of the whole terminal; two lines go to the status and message bars.
+void setScreenSize(int rows, int cols)
+{
+  S.screenrows = rows - 2;
+  S.screencols = cols;
+}
+
+/*
+ * The terminal changed size. Frames are drawn whole, so there is nothing
+ * to resize but the wrap layout, and that only when the text width changed;
+ * rows are then wrapped again as they're drawn. Returns 1 if the size is
+ * new.
+ */
+int resizeScreen(int rows, int cols)
+{
+  if (rows < 3)
+    rows = 3;
+  if (cols < 1)
+    cols = 1;
+  if (rows == S.screenrows + 2 && cols == S.screencols)
+    return 0;
+  setScreenSize(rows, cols);
+  if (S.wrap.on && S.wrap.cols != (textCols() > 0 ? textCols() : 1))
+    wrapReset();
+  S.loop.redraw = 1;
+  return 1;
+}
+
+void recVarint(FILE* fp, unsigned long long v)
+{
+  do {
+    unsigned char b = v & 0x7f;
+    v >>= 7;
+    if (v)
+      b |= 0x80;
+    putc(b, fp);
+  } while (v);
+}
+
+int recordInput(char* c)
+{
+  int n = ttyRead(c);
+  if (n == 1) {
+    long long now = nowUs();
+    recVarint(S.rec.fp, now - S.rec.last_us);
+    recVarint(S.rec.fp, (unsigned char)*c);
+    S.rec.last_us = now;
+  }
+  return n;
+}
+
+void recordResize(int rows, int cols)
+{
+  long long now = nowUs();
+  recVarint(S.rec.fp, now - S.rec.last_us);
+  recVarint(S.rec.fp, REC_RESIZE);
+  recVarint(S.rec.fp, rows);
+  recVarint(S.rec.fp, cols);
+  S.rec.last_us = now;
+}
+
+/*
+ * Take the terminal's new size, from the kernel rather than by moving the
+ * cursor. Later resizes are held back for RESIZE_MS, so dragging a pane
+ * border redraws at that rate however many signals it sends.
+ */
+void resizeTimer()
+{
+  if (!S.loop.resized)
+    return;
+  S.loop.resized = 0;
+  struct winsize ws;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col
+      && resizeScreen(ws.ws_row, ws.ws_col) && S.rec.fp)
+    recordResize(ws.ws_row, ws.ws_col);
+  timerArm(&S.loop.resize, RESIZE_MS);
+}
+
+/*
+ * Record the raw input of this session to path. The file starts with
+ * REC_MAGIC and the terminal size, followed by one record per input byte: a
+ * varint microsecond delay since the previous byte and a varint code, the
+ * byte itself or REC_RESIZE and the new size.
+ */
+void recordStart(const char* path, int rows, int cols)
+{
+  S.rec.fp = fopen(path, "wb");
+  if (S.rec.fp == NULL)
+    die("fopen");
+  fwrite(REC_MAGIC, 1, 8, S.rec.fp);
+  recVarint(S.rec.fp, rows);
+  recVarint(S.rec.fp, cols);
+  S.rec.last_us = nowUs();
+  S.input = recordInput;
 }
 
+int replayVarint(unsigned long long* v)
+{
+  long long pos = S.rec.pos;
+  if (journalVarintAt(S.rec.data, S.rec.len, &pos, v) == -1)
+    return -1;
+  S.rec.pos = pos;
+  return 0;
+}
+
+/*
+ * Input source for replay. Returns recorded bytes as fast as they are
+ * asked for, or at their recorded times with realtime set. Once the
+ * recording runs out it keeps returning ESC to back out of any prompt.
+ */
+int replayInput(char* c)
+{
+  struct Recording* R = &S.rec;
+  unsigned long long dt, code;
+
+  for (;;) {
+    if (!R->have_next) {
+      if (replayVarint(&dt) == -1 || replayVarint(&code) == -1) {
+        R->done = 1;
+        *c = '\x1b';
+        return 1;
+      }
+      R->due_us += dt;
+      R->next = code;
+      R->have_next = 1;
+    }
+
+    if (R->realtime) {
+      long long wait = R->start_us + R->due_us - nowUs();
+      if (wait > 0) {
+        long long slice = wait < 100000 ? wait : 100000;
+        long long before = nowUs();
+        usleep(slice);
+        R->waited_us += nowUs() - before;
+        if (wait > slice)
+          return 0;
+      }
+    }
+
+    R->have_next = 0;
+    if (R->next == REC_RESIZE) {
+      unsigned long long rows, cols;
+      if (replayVarint(&rows) == 0 && replayVarint(&cols) == 0)
+        resizeScreen(rows, cols);
+      continue;
+    }
+    *c = R->next;
+    R->keys++;
+    return 1;
+  }
+}
+
+// Whether a key is left in the recording, past any size changes.
+int replayHasKey()
+{
+  struct Recording* R = &S.rec;
+  long long pos = R->pos;
+  unsigned long long code = R->next, v;
+  int have = R->have_next;
+  for (;;) {
+    if (!have
+        && (journalVarintAt(R->data, R->len, &pos, &v) == -1
+            || journalVarintAt(R->data, R->len, &pos, &code) == -1))
+      return 0;
+    if (code != REC_RESIZE)
+      return 1;
+    if (journalVarintAt(R->data, R->len, &pos, &v) == -1
+        || journalVarintAt(R->data, R->len, &pos, &v) == -1)
+      return 0;
+    have = 0;
+  }
+}
+
+void replaySink(const char* s, int len)
+{
+  (void)s;
+  S.rec.out_bytes += len;
+}
+
+int cmpLongLong(const void* a, const void* b)
+{
+  long long x = *(const long long*)a, y = *(const long long*)b;
+  return (x > y) - (x < y);
+}
+
+unsigned long long bufferChecksum()
+{
+  unsigned long long h = FNV_OFFSET;
+  for (int j = 0; j < S.numrows; j++) {
+    h = hashUpdate(h, S.row[j].chars, S.row[j].size);
+    h = hashUpdate(h, "\n", 1);
+  }
+  return h;
+}
+
+// Print frame timings and the buffer checksum; also runs if replay quits.
+void replayReport()
+{
+  struct Recording* R = &S.rec;
+  if (R->reported)
+    return;
+  R->reported = 1;
+  finishSave();
+
+  if (R->print_frames)
+    for (int j = 0; j < R->frames; j++)
+      printf("frame %d: %lld us\n", j, R->frame_us[j]);
+
+  long long total = 0;
+  for (int j = 0; j < R->frames; j++)
+    total += R->frame_us[j];
+  qsort(R->frame_us, R->frames, sizeof(long long), cmpLongLong);
+
+  printf("keys: %lld  frames: %d  total: %.1f ms  output: %lld bytes\n",
+      R->keys, R->frames, total / 1e3, R->out_bytes);
+  if (R->frames) {
+    printf("frame us: p50 %lld  p90 %lld  p99 %lld  max %lld\n",
+        R->frame_us[(R->frames - 1) / 2], R->frame_us[(R->frames - 1) * 9 / 10],
+        R->frame_us[(R->frames - 1) * 99 / 100], R->frame_us[R->frames - 1]);
+  }
+  printf("checksum: %016llx\n", bufferChecksum());
+
+  if (R->scratch) {
+    unlink(R->scratch);
+    journalClose(1);
+  }
+}
+
+/*
+ * Feed a recorded session through processKeypress without a terminal and
+ * report per-frame timings. The file is opened normally, but saves go to a
+ * scratch copy so replaying never touches it.
+ */
+int replaySession(const char* path, char* filename, int realtime, int frames)
+{
+  struct Recording* R = &S.rec;
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1)
+    die(path);
+  R->len = st.st_size;
+  R->data = mmap(NULL, R->len ? R->len : 1, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (R->data == MAP_FAILED)
+    die("mmap");
+
+  unsigned long long rows, cols;
+  R->pos = 8;
+  if (R->len < 8 || memcmp(R->data, REC_MAGIC, 8) != 0
+      || replayVarint(&rows) == -1 || replayVarint(&cols) == -1) {
+    fprintf(stderr, "%s: not an ares recording\n", path);
+    return 1;
+  }
+  setScreenSize(rows, cols);
+  R->realtime = realtime;
+  R->print_frames = frames;
+  S.output = replaySink;
+  S.journal.suspended++;
+
+  if (filename) {
+    ares_open(filename);
+    char scratch[] = "/tmp/ares-replay-XXXXXX";
+    int sfd = mkstemp(scratch);
+    if (sfd == -1)
+      die("mkstemp");
+    close(sfd);
+    free(S.filename);
+    S.filename = strdup(scratch);
+    R->scratch = strdup(scratch);
+  }
+  S.journal.suspended--;
+
+  S.input = replayInput;
+  atexit(replayReport);
+  refreshScreen();
+  R->start_us = nowUs();
+
+  // The ESC a finished recording returns is only for prompts, so stop
+  // before it would reach processKeypress as a key.
+  while (!R->done && replayHasKey()) {
+    if (R->frames == R->framecap) {
+      R->framecap = R->framecap ? R->framecap * 2 : 1024;
+      R->frame_us = realloc(R->frame_us, sizeof(long long) * R->framecap);
+    }
+    long long waited = R->waited_us;
+    long long start = nowUs();
+    processKeypress();
+    refreshScreen();
+    R->frame_us[R->frames++] = nowUs() - start - (R->waited_us - waited);
+  }
+
+  replayReport();
+  return 0;
+}
+
+#ifndef ARES_NO_MAIN
 int main(int argc, char* argv[])
 {
-  enableRawMode();
-  initEditor();
-  if (argc >= 2) {
-    ares_open(argv[1]);
+  int rows, cols;
+  char* filename = NULL;
+  char* record = NULL;
+  char* replay = NULL;
+  char** more = malloc(sizeof(char*) * argc);
+  int nmore = 0;
+  int realtime = 0, frames = 0, follow = 0;
+
+  for (int j = 1; j < argc; j++) {
+    if (!strcmp(argv[j], "--record") && j + 1 < argc)
+      record = argv[++j];
+    else if (!strcmp(argv[j], "--replay") && j + 1 < argc)
+      replay = argv[++j];
+    else if (!strcmp(argv[j], "--realtime"))
+      realtime = 1;
+    else if (!strcmp(argv[j], "--frames"))
+      frames = 1;
+    else if (!strcmp(argv[j], "--follow") || !strcmp(argv[j], "+F"))
+      follow = 1;
+    else if (filename == NULL)
+      filename = argv[j];
+    else
+      more[nmore++] = argv[j];
   }
 
-  setStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | "
-                   "Ctrl-L = goto line");
+  initEditor();
+  if (replay)
+    return replaySession(replay, filename, realtime, frames);
+
+  if (filename && !strcmp(filename, "-"))
+    filename = NULL;
+  if (filename == NULL && !isatty(STDIN_FILENO))
+    followStdin();
+
+  enableRawMode();
+  loopStart();
+  if (getWindowSize(&rows, &cols) == -1)
+    die("getWindowSize");
+  setScreenSize(rows, cols);
+  if (record)
+    recordStart(record, rows, cols);
+
+  // An error in a syntax definition is shown instead of the help.
+  if (S.statusmsg[0] == '\0')
+    setStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | "
+                     "Ctrl-L = goto line | Ctrl-O = open");
+
+  if (filename) {
+    ares_open(filename);
+    if (follow && S.follow.fd == -1)
+      followFile();
+  }
+  if (nmore) {
+    for (int j = 0; j < nmore; j++)
+      bufferOpen(more[j]);
+    bufferSwitch(0);
+  }
+  free(more);
 
   for (;;) {
     refreshScreen();
@@ -1252,3 +8091,4 @@ int main(int argc, char* argv[])
 
   return 0;
 }
+#endif
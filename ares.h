@@ -34,8 +34,18 @@
 #define KEYWORD_PRIMARY_HIGHLIGHT_COLOR   "38;5;98"
 #define KEYWORD_SECONDARY_HIGHLIGHT_COLOR "38;5;104"
 #define COMMENT_HIGHLIGHT_COLOR           "38;5;119"
+#define BRACKET_MATCH_HIGHLIGHT_COLOR     "38;5;208"
 #define DEFAULT_HIGHLIGHT_COLOR           "32"
 
+// Completion popup colors
+#define COMPLETE_MENU_COLOR               "48;5;237"
+#define COMPLETE_SELECTED_COLOR           "7"
+
+// Diff gutter colors
+#define DIFF_ADDED_COLOR                  "32"
+#define DIFF_MODIFIED_COLOR               "33"
+#define DIFF_DELETED_COLOR                "31"
+
 // Configuration settings
 #define SIDE_CHARACTER      "~"
 #define TAB_STOP            8
@@ -43,9 +53,119 @@
 #define QUIT_TIMES          1
 #define EXIT_KEY            113  // q
 
-// Highlight flags
-#define HL_HIGHLIGHT_NUMBERS    (1 << 0)
-#define HL_HIGHLIGHT_STRINGS    (1 << 1)
+// Saving
+#define SAVE_IOV_BATCH      1024  // iovecs per writev, must not exceed IOV_MAX
+#define SAVE_TMP_SUFFIX     ".ares-XXXXXX"
+
+// Swap file journal
+#define JOURNAL_SUFFIX      ".ares-swp"
+#define JOURNAL_MAGIC       "ARESJRN1"
+#define JOURNAL_HEADER_SIZE 24
+#define JOURNAL_SYNC_MS     1000  // fsync pending edit records this often
+#define JOURNAL_BUF_MAX     65536
+
+// Undo history, oldest edits are dropped past this many bytes
+#define UNDO_MEMORY_MAX     (64 * 1024 * 1024)
+
+// Diff gutter, past this many changed lines a region is shown as modified
+#define DIFF_MAX_EDITS      2000
+// An edit with no row matched to HEAD this near is marked added, unaligned
+#define DIFF_WINDOW         4096
+
+// Rows longer than LONG_ROW are split into segments that are rendered and
+// highlighted separately, and only kept rendered while on screen
+#define LONG_ROW            16384
+#define SEGMENT_SIZE        4096
+#define LEX_LOOKAHEAD       32  // longer than any keyword or comment marker
+
+// Syntax definitions, the built in ones are overridden by files in
+// SYNTAX_DIR, then ~/.config/ares/syntax, then $ARES_SYNTAX
+#ifndef SYNTAX_DIR
+#define SYNTAX_DIR          "/usr/local/share/ares/syntax"
+#endif
+#define SYNTAX_SUFFIX       ".syntax"
+#define LEX_RULES           24  // comments and strings in one language
+#define LEX_DELIM           8  // longest comment or string marker
+#define LEX_RAW_DELIM       16  // longest raw string delimiter, as in C++
+#define LEX_CHAR_MAX        12  // an escaped char literal closes within this
+
+// Column index, cx to screen column lookups walk at most this many bytes
+#define COL_CHECKPOINT      64
+
+// Loading, and following a growing file or a pipe on stdin (--follow)
+#define READ_CHUNK          65536
+#define FOLLOW_BUDGET_MS    50  // most time one poll spends appending rows
+
+// gzip files are inflated on a thread while the rows come in, and saved
+// compressed
+#define GZIP_BUF            (256 * 1024)
+
+// Cache of the line index and lexer states next to big files, for reopening
+#define CACHE_SUFFIX        ".ares-cache"
+#define CACHE_MAGIC         "ARESCCH2"
+#define CACHE_MIN_SIZE      (8 * 1024 * 1024)  // smaller files aren't cached
+#define CACHE_SAMPLE        65536  // bytes hashed at each end of the file
+
+// Word completion
+#define WORD_MIN            2  // shorter words aren't indexed
+#define WORD_MAX            64  // nor are longer ones
+#define COMPLETE_MAX        8  // entries in the popup
+#define COMPLETE_NEAR       100  // words this many rows around the cursor rank first
+
+// Project grep
+#define GREP_THREADS        16  // at most, fewer on machines with fewer cores
+#define GREP_READ_MAX       65536  // bigger files are mapped instead of read
+#define GREP_BINARY_CHECK   8192  // a NUL in this many leading bytes means binary
+#define GREP_LINE_MAX       256  // longest text kept for a matching line
+#define GREP_MAX_MATCHES    100000  // the scan stops after this many
+
+// Event loop timers and idle-time work
+#define TIMER_TICK_MS       10
+#define TIMER_SLOTS         256  // one turn of the wheel is 2.56s
+#define IDLE_SLICE_US       5000  // longest an idle task runs before input is checked
+#define POLL_MAX            32  // fds waited on, extra jobs are polled on a timer
+#define MESSAGE_SECONDS     5
+#define PROGRESS_MS         100  // save progress updates
+#define FOLLOW_POLL_MS      100  // growing files can't be polled, only re-read
+#define RESIZE_MS           30  // a burst of resizes redraws at most this often
+
+// Session recordings
+#define REC_MAGIC           "ARESREC1"
+#define REC_RESIZE          256  // record code for a terminal size change
+
+#define FNV_OFFSET          14695981039346656037ULL
+
+// Instrumentation, only compiled in with -DARES_STATS (make ares-stats)
+#define STATS_BUCKETS       256  // 4 per power of two, covers 64-bit values
+
+// Lexer state a row hands to the next, and a span of text to the next
+#define LEX_RULE(s)             ((s) & 0xff)  // 1 + the rule it is inside of
+#define LEX_DEPTH(s)            (((s) >> 8) & 0xff)  // or raw delimiter length
+#define LEX_DELIM_HASH(s)       ((s) >> 16)
+
+// Character classes of the lexer tables
+#define LEX_WORD                (1 << 0)
+#define LEX_DIGIT               (1 << 1)
+#define LEX_DOT                 (1 << 2)  // may start a number
+#define LEX_OPENS               (1 << 3)  // first byte of a comment or string
+#define LEX_KEYSTART            (1 << 4)  // starts a keyword, like # in C
+
+// Diff gutter marks
+#define DIFF_ADDED              (1 << 0)
+#define DIFF_MODIFIED           (1 << 1)
+#define DIFF_DELETED            (1 << 2)  // lines removed just above the row
+
+// What the event loop woke up for
+#define EV_KEY                  (1 << 0)
+#define EV_OTHER                (1 << 1)
+
+#ifdef ARES_STATS
+#define STAT_START(t) long long t = nowNs()
+#define STAT_STOP(id, t) statAdd(id, nowNs() - (t))
+#else
+#define STAT_START(t)
+#define STAT_STOP(id, t)
+#endif
 
 // Function to clear the CTRL key
 #define CTRL_KEY(k) (k & 0x1f)
@@ -53,6 +173,38 @@
 void die(const char *e);
 
 void setStatusMessage(const char *fmt, ...);
+int writeAllv(int fd, struct iovec *iov, int iovcnt);
+void refreshScreen();
+int processBackground();
+int pollJobs();
 char *ares_prompt(char *prompt, void (*callback)(char *, int));
+int ares_confirm(char *prompt);
+
+struct erow;
+void renderRow(struct erow *row);
+void rowReady(struct erow *row);
+void wrapChanged(struct erow *row);
+void rowBrackets(struct erow *row);
+int textCols();
+void resizeTimer();
+void bufferInit();
+
+void journalRecord(int op, int a, int b, const char *s, int len);
+void journalFlush(int sync);
+void journalRecover();
+void undoRecord(int op, int row, int col, const char *s, int len);
+void diffTouch(int op, int at);
+void diffLoad();
+void gzipDone();
+void watchStart();
+int watchPoll();
+char *sidecarPath(const char *filename, const char *suffix);
+int cacheLoad(int fd, struct stat *st);
+void cacheWrite();
+
+long long nowMs();
+long long nowUs();
+long long nowNs();
+void statAdd(int id, long long v);
 
 #endif
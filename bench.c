@@ -0,0 +1,535 @@
+/*
+ * Copyright (c) 2023 Torben Conto
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Scripted benchmark driver, run with `make bench`. The editor runs headless:
+ * keys come from an in-memory script and frames go to a sink that only counts
+ * bytes. Each scenario feeds the same keys a user would type and reports the
+ * latency of every operation (a keypress or a whole prompt, plus the redraw
+ * that follows it) and the allocations it made. It is built with ARES_STATS,
+ * which counts allocations by linking with --wrap for the malloc family.
+ */
+
+#define ARES_NO_MAIN
+#include "ares.c"
+
+#define BENCH_ROWS 1000000
+#define BENCH_SCREEN_ROWS 50
+#define BENCH_SCREEN_COLS 160
+#define BENCH_LEX_BYTES (64 * 1024 * 1024)
+
+static const char* script;
+static int script_len;
+static int script_pos;
+static long long frame_bytes;
+
+int benchInput(char* c)
+{
+  if (script_pos >= script_len) {
+    errno = EIO;
+    return -1;
+  }
+  *c = script[script_pos++];
+  return 1;
+}
+
+void benchOutput(const char* s, int len)
+{
+  (void)s;
+  frame_bytes += len;
+}
+
+struct Result {
+  double* lat;
+  int ops;
+  unsigned long allocs;
+  unsigned long alloc_bytes;
+  long long out_bytes;
+};
+
+// Run keys through the editor as one operation and record its cost.
+void benchOp(struct Result* r, const char* keys, int len, int wait_save)
+{
+  script = keys;
+  script_len = len;
+  script_pos = 0;
+
+  unsigned long allocs = stat_allocs;
+  unsigned long bytes = stat_alloc_bytes;
+  long long out = frame_bytes;
+  long long start = nowUs();
+
+  while (script_pos < script_len) {
+    processKeypress();
+    refreshScreen();
+  }
+  if (wait_save) {
+    finishSave();
+    refreshScreen();
+  }
+
+  r->lat[r->ops++] = nowUs() - start;
+  r->allocs += stat_allocs - allocs;
+  r->alloc_bytes += stat_alloc_bytes - bytes;
+  r->out_bytes += frame_bytes - out;
+}
+
+int cmpDouble(const void* a, const void* b)
+{
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+double percentile(struct Result* r, double p)
+{
+  int i = (int)(p * (r->ops - 1) + 0.5);
+  return r->lat[i];
+}
+
+void report(const char* name, struct Result* r)
+{
+  qsort(r->lat, r->ops, sizeof(double), cmpDouble);
+  printf("%-8s %7d %10.1f %10.1f %10.1f %10.1f %10.1f %12.0f %10.0f\n", name,
+      r->ops, percentile(r, 0.5), percentile(r, 0.9), percentile(r, 0.99),
+      r->lat[r->ops - 1], (double)r->allocs / r->ops,
+      (double)r->alloc_bytes / r->ops, (double)r->out_bytes / r->ops);
+  free(r->lat);
+}
+
+struct Result newResult(int ops)
+{
+  struct Result r = { malloc(sizeof(double) * ops), 0, 0, 0, 0 };
+  return r;
+}
+
+/*
+ * Fill the buffer with BENCH_ROWS lines of C-looking text, with a single
+ * "needle" near the end for the search scenario.
+ */
+void benchLoad()
+{
+  char line[128];
+  S.undo.suspended++;
+  S.journal.suspended++;
+  for (int j = 0; j < BENCH_ROWS; j++) {
+    int len;
+    if (j == BENCH_ROWS - 1000)
+      len = snprintf(line, sizeof(line), "  int needle = %d; // find me", j);
+    else if (j % 10 == 0)
+      len = snprintf(line, sizeof(line), "/* block %d */", j);
+    else
+      len = snprintf(line, sizeof(line),
+          "\tif (value_%d > %d) { total += \"str\"[%d]; }", j, j * 7, j % 3);
+    insertRow(S.numrows, line, len);
+  }
+  S.journal.suspended--;
+  S.undo.suspended--;
+  S.dirty = 0;
+}
+
+// Code for the lexer throughput table, by filetype.
+const char* lex_samples[][2] = {
+  { "c",
+      "#include <stdio.h>\n"
+      "/* Sum the values, skipping\n"
+      " * negative ones. */\n"
+      "static long sum(const int* v, unsigned int n)\n"
+      "{\n"
+      "  long total = 0;  // running sum\n"
+      "  for (unsigned int i = 0; i < n; i++)\n"
+      "    if (v[i] >= 0x10 && v[i] != '\\n')\n"
+      "      total += v[i] * 3.5e2;\n"
+      "  printf(\"total %ld \\\"done\\\"\\n\", total);\n"
+      "  return total;\n"
+      "}\n" },
+  { "go",
+      "package main\n"
+      "\n"
+      "import \"fmt\"\n"
+      "\n"
+      "// Sum the values, skipping negative ones.\n"
+      "func sum(v []int) (total int) {\n"
+      "\tfor _, x := range v {\n"
+      "\t\tif x >= 0x10 && x != '\\n' {\n"
+      "\t\t\ttotal += x * 35\n"
+      "\t\t}\n"
+      "\t}\n"
+      "\tfmt.Println(`raw \"text\"`, total)\n"
+      "\treturn\n"
+      "}\n" },
+  { "cpp",
+      "#include <vector>\n"
+      "/* Sum the values, skipping\n"
+      " * negative ones. */\n"
+      "template <typename T>\n"
+      "auto sum(const std::vector<T>& v) -> long\n"
+      "{\n"
+      "  long total = 0;  // running sum\n"
+      "  for (const auto& x : v)\n"
+      "    if (x >= 0x10 && x != '\\n')\n"
+      "      total += x * 1'000;\n"
+      "  std::string s = R\"x(raw \"text\")x\";\n"
+      "  return total;\n"
+      "}\n" },
+  { "rust",
+      "use std::collections::HashMap;\n"
+      "/* Sum the values, skipping\n"
+      " * /* nested */ negative ones. */\n"
+      "fn sum<'a>(v: &'a [i64], names: &HashMap<&'a str, u32>) -> i64 {\n"
+      "    let mut total = 0i64; // running sum\n"
+      "    for x in v.iter() {\n"
+      "        if *x >= 0x10 && *x != '\\n' as i64 {\n"
+      "            total += x * 1_000;\n"
+      "        }\n"
+      "    }\n"
+      "    println!(r#\"raw \"text\"\"#);\n"
+      "    total\n"
+      "}\n" },
+  { "python",
+      "import sys\n"
+      "\n"
+      "def total(values, skip=None):\n"
+      "    \"\"\"Sum the values,\n"
+      "    skipping negative ones.\"\"\"\n"
+      "    total = 0  # running sum\n"
+      "    for x in values:\n"
+      "        if x >= 0x10 and x != skip:\n"
+      "            total += x * 3.5e2\n"
+      "    print(f\"total {total}\", r'raw\\d', file=sys.stderr)\n"
+      "    return total\n" },
+  { "json",
+      "{\n"
+      "  \"name\": \"ares\",\n"
+      "  \"version\": \"1.0.0\",\n"
+      "  \"size\": 12345,\n"
+      "  \"ratio\": -0.25e3,\n"
+      "  \"tags\": [\"editor\", \"terminal\", \"fast\"],\n"
+      "  \"nested\": { \"ok\": true, \"none\": null,\n"
+      "    \"quote\": \"a \\\"b\\\"\" }\n"
+      "}\n" },
+  { "yaml",
+      "# Build settings\n"
+      "name: ares\n"
+      "version: '1.0.0'\n"
+      "jobs: 4  # one per core\n"
+      "debug: false\n"
+      "url: http://example.com/#top\n"
+      "paths:\n"
+      "  - \"src/*.c\"\n"
+      "  - 'it''s quoted'\n" },
+};
+
+/*
+ * The hand-written C lexer that the syntax tables replaced, kept as the
+ * baseline for the lexer table. Rows are lexed whole, so of its state only
+ * the open block comment is handed from row to row.
+ */
+char* old_c_keywords[] = { "switch", "if", "while", "for", "break",
+  "continue", "return", "else", "struct", "union", "typedef", "static",
+  "enum", "class", "case", "#include", "#define", "#ifndef", "#endif",
+  "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
+  "void|", NULL };
+
+int oldIsSeparator(int c)
+{
+  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+void oldLexRow(const char* buf, int len, unsigned char* hl, int* in_comment)
+{
+  memset(hl, HL_NORMAL, len);
+  int prev_sep = 1;
+  int in_string = 0;
+  int i = 0;
+  while (i < len) {
+    char c = buf[i];
+    unsigned char prev_hl = i > 0 ? hl[i - 1] : HL_NORMAL;
+
+    if (!in_string && !*in_comment && !strncmp(&buf[i], "//", 2)) {
+      memset(&hl[i], HL_COMMENT, len - i);
+      break;
+    }
+    if (!in_string) {
+      if (*in_comment) {
+        hl[i] = HL_ML_COMMENT;
+        if (!strncmp(&buf[i], "*/", 2)) {
+          memset(&hl[i], HL_ML_COMMENT, 2);
+          i += 2;
+          *in_comment = 0;
+          prev_sep = 1;
+        } else {
+          i++;
+        }
+        continue;
+      } else if (!strncmp(&buf[i], "/*", 2)) {
+        memset(&hl[i], HL_ML_COMMENT, 2);
+        i += 2;
+        *in_comment = 1;
+        continue;
+      }
+    }
+    if (in_string) {
+      hl[i] = HL_STRING;
+      if (c == '\\' && i + 1 < len) {
+        hl[i + 1] = HL_STRING;
+        i += 2;
+        continue;
+      }
+      if (c == in_string)
+        in_string = 0;
+      i++;
+      prev_sep = 1;
+      continue;
+    } else if (c == '"' || c == '\'') {
+      in_string = c;
+      hl[i] = HL_STRING;
+      i++;
+      continue;
+    }
+    if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER))
+        || (c == '.' && prev_hl == HL_NUMBER)) {
+      hl[i] = HL_NUMBER;
+      i++;
+      prev_sep = 0;
+      continue;
+    }
+    if (prev_sep) {
+      int j;
+      for (j = 0; old_c_keywords[j]; j++) {
+        int klen = strlen(old_c_keywords[j]);
+        int kw2 = old_c_keywords[j][klen - 1] == '|';
+        if (kw2)
+          klen--;
+        if (!strncmp(&buf[i], old_c_keywords[j], klen)
+            && oldIsSeparator(buf[i + klen])) {
+          memset(&hl[i], kw2 ? HL_KEYWORD_SECONDARY : HL_KEYWORD_PRIMARY,
+              klen);
+          i += klen;
+          break;
+        }
+      }
+      if (old_c_keywords[j] != NULL) {
+        prev_sep = 0;
+        continue;
+      }
+    }
+    prev_sep = oldIsSeparator(c);
+    i++;
+  }
+}
+
+/*
+ * Lex text over and over, row by row with the state handed down as
+ * updateSyntax does, with S.syntax or with the old C loop. Returns MB/s.
+ */
+double benchLexRate(const char* text, int old)
+{
+  int len = strlen(text);
+  unsigned char* hl = malloc(len + 1);
+  long long bytes = 0;
+  long long start = nowUs();
+  while (bytes < BENCH_LEX_BYTES) {
+    unsigned int state = 0;
+    int in_comment = 0;
+    for (const char* p = text; p < text + len;) {
+      const char* nl = strchr(p, '\n');
+      if (old) {
+        oldLexRow(p, nl - p, hl, &in_comment);
+      } else {
+        struct LexState st;
+        memset(&st, 0, sizeof(st));
+        st.prev_sep = 1;
+        st.state = state;
+        lexSpan(p, nl - p, nl - p, hl, &st);
+        state = lexRowEnd(st.state);
+      }
+      p = nl + 1;
+    }
+    bytes += len;
+  }
+  free(hl);
+  return bytes / (double)(nowUs() - start);
+}
+
+// Throughput of each language's sample, and of C with the old loop.
+void benchLex()
+{
+  struct Syntax* saved = S.syntax;
+  printf("\n%-8s %10s\n", "lexer", "MB/s");
+  for (unsigned int k = 0; k < sizeof(lex_samples) / sizeof(lex_samples[0]);
+       k++) {
+    S.syntax = NULL;
+    for (int j = 0; j < HLDB_ENTRIES; j++)
+      if (!strcmp(HLDB[j]->filetype, lex_samples[k][0]))
+        S.syntax = HLDB[j];
+    if (S.syntax == NULL) {
+      printf("%-8s %10s\n", lex_samples[k][0], "-");
+      continue;
+    }
+    printf("%-8s %10.0f\n", lex_samples[k][0],
+        benchLexRate(lex_samples[k][1], 0));
+    if (!strcmp(lex_samples[k][0], "c"))
+      printf("%-8s %10.0f\n", "c-old", benchLexRate(lex_samples[k][1], 1));
+  }
+  S.syntax = saved;
+}
+
+int main()
+{
+  initEditor();
+  S.input = benchInput;
+  S.output = benchOutput;
+  setScreenSize(BENCH_SCREEN_ROWS, BENCH_SCREEN_COLS);
+
+  S.filename = strdup("bench.c");
+  selectSyntaxHighlight();
+  free(S.filename);
+  S.filename = NULL;
+
+  long long start = nowUs();
+  benchLoad();
+  printf("loaded %d rows in %.0f ms\n\n", S.numrows, (nowUs() - start) / 1e3);
+  printf("%-8s %7s %10s %10s %10s %10s %10s %12s %10s\n", "scenario", "ops",
+      "p50 us", "p90 us", "p99 us", "max us", "allocs/op", "alloc B/op",
+      "out B/op");
+
+  // Typing in the middle of the file.
+  S.cy = BENCH_ROWS / 2;
+  S.cx = 4;
+  struct Result r = newResult(2000);
+  for (int j = 0; j < 2000; j++) {
+    char c = "abcdefghij klmnopqrst"[j % 21];
+    benchOp(&r, &c, 1, 0);
+  }
+  report("type", &r);
+
+  // Pasting a block of lines; the terminal delivers it as keystrokes.
+  char paste[4096];
+  int plen = 0;
+  for (int j = 0; j < 100; j++)
+    plen += snprintf(&paste[plen], sizeof(paste) - plen, "pasted %d;\r", j);
+  r = newResult(20);
+  for (int j = 0; j < 20; j++)
+    benchOp(&r, paste, plen, 0);
+  report("paste", &r);
+
+  // Search for a line near the end, from the top of the file.
+  r = newResult(10);
+  for (int j = 0; j < 10; j++) {
+    S.cy = 0;
+    S.cx = 0;
+    benchOp(&r, "\x06needle\r", 8, 0);
+  }
+  report("search", &r);
+
+  // Jump around by byte offset and by percentage.
+  long long total = rowOffset(S.numrows);
+  char jump[64];
+  r = newResult(200);
+  for (int j = 0; j < 200; j++) {
+    int len = j % 2 ? snprintf(jump, sizeof(jump), "\x0c%d%%\r", j / 2)
+                    : snprintf(jump, sizeof(jump), "\x0c@%lld\r",
+                        total / 200 * j);
+    benchOp(&r, jump, len, 0);
+  }
+  report("goto", &r);
+
+  // Scroll down a page at a time, then line by line.
+  S.cy = 0;
+  S.cx = 0;
+  r = newResult(2000);
+  for (int j = 0; j < 1000; j++)
+    benchOp(&r, "\x1b[6~", 4, 0);
+  for (int j = 0; j < 1000; j++)
+    benchOp(&r, "\x1b[B", 3, 0);
+  report("scroll", &r);
+
+  // Open and close the completion popup, after typing "value_9" on a new
+  // line: it matches 111111 words that occur once each, none of them near
+  // the cursor, the worst case for ranking. Then the same for "tot", which
+  // matches one common word.
+  S.cy = BENCH_ROWS / 2;
+  S.cx = 0;
+  struct Result setup = newResult(3);
+  benchOp(&setup, "\rvalue_9", 8, 0);
+  r = newResult(400);
+  for (int j = 0; j < 200; j++)
+    benchOp(&r, "\x0e\x1b", 2, 0);
+  benchOp(&setup, "\x08\x7f\x7f\x7f\x7f\x7f\x7ftot", 10, 0);
+  for (int j = 0; j < 200; j++)
+    benchOp(&r, "\x0e\x1b", 2, 0);
+  free(setup.lat);
+  report("complete", &r);
+
+  // Switch between this buffer and a second file with Ctrl-X.
+  char other[] = "/tmp/ares-bench-XXXXXX";
+  int ofd = mkstemp(other);
+  if (ofd == -1)
+    die("mkstemp");
+  for (int j = 0; j < 1000; j++)
+    dprintf(ofd, "int other_%d = %d;\n", j, j);
+  close(ofd);
+  bufferOpen(other);
+  r = newResult(1000);
+  for (int j = 0; j < 1000; j++)
+    benchOp(&r, "\x18", 1, 0);
+  report("switch", &r);
+  bufferSwitch(0);
+  unlink(other);
+
+  // The same with soft wrap on, at a width that wraps most lines, plus
+  // jumps by percentage. Turning wrap on and off is timed too.
+  setScreenSize(BENCH_SCREEN_ROWS, 40);
+  S.cy = 0;
+  S.cx = 0;
+  r = newResult(2202);
+  benchOp(&r, "\x17", 1, 0);
+  for (int j = 0; j < 1000; j++)
+    benchOp(&r, "\x1b[6~", 4, 0);
+  for (int j = 0; j < 1000; j++)
+    benchOp(&r, "\x1b[B", 3, 0);
+  for (int j = 0; j < 200; j++) {
+    int len = snprintf(jump, sizeof(jump), "\x0c%d%%\r", j / 2);
+    benchOp(&r, jump, len, 0);
+  }
+  benchOp(&r, "\x17", 1, 0);
+  report("wrap", &r);
+  setScreenSize(BENCH_SCREEN_ROWS, BENCH_SCREEN_COLS);
+
+  // Save, waiting for the background write to finish.
+  char path[] = "/tmp/ares-bench-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd == -1)
+    die("mkstemp");
+  close(fd);
+  S.filename = strdup(path);
+  S.journal.suspended++;
+  r = newResult(5);
+  for (int j = 0; j < 5; j++)
+    benchOp(&r, "\x13", 1, 1);
+  report("save", &r);
+  unlink(path);
+
+  benchLex();
+
+  return 0;
+}
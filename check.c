@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2023 Torben Conto
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Checks run with `make check`. The diff gutter one commits a file to a
+ * scratch git repository, opens it headless, makes edits and compares the
+ * gutter marks with what git would show. The lexer one compares long rows
+ * lexed in segments with the same rows lexed whole. Exits non-zero on the
+ * first mismatch.
+ */
+
+#define ARES_NO_MAIN
+#include "ares.c"
+
+static char repo[] = "/tmp/ares-check-XXXXXX";
+
+void run(const char* fmt, ...)
+{
+  char cmd[1024];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(cmd, sizeof(cmd), fmt, ap);
+  va_end(ap);
+  if (system(cmd) != 0) {
+    fprintf(stderr, "failed: %s\n", cmd);
+    exit(1);
+  }
+}
+
+// Wait for the git show started by ares_open to come back.
+void waitDiff()
+{
+  long long start = nowMs();
+  while (S.diff.loading) {
+    if (nowMs() - start > 10000) {
+      fprintf(stderr, "git show timed out\n");
+      exit(1);
+    }
+    pollJobs();
+    usleep(1000);
+  }
+}
+
+// Compare the marks of every row with want, one char per row: . + ~ and
+// - for lines deleted just above, or after the last row.
+void expect(const char* what, const char* want)
+{
+  diffUpdate();
+  char got[256];
+  int n = 0;
+  for (int j = 0; j < S.numrows && n < (int)sizeof(got) - 1; j++) {
+    unsigned char d = S.row[j].diff;
+    got[n++] = d & DIFF_DELETED ? '-'
+        : d & DIFF_MODIFIED     ? '~'
+        : d & DIFF_ADDED        ? '+'
+                                : '.';
+  }
+  got[n] = '\0';
+  if (strcmp(got, want)) {
+    printf("FAIL %s\n  want %s\n  got  %s\n", what, want, got);
+    run("rm -rf %s", repo);
+    exit(1);
+  }
+  printf("ok   %s\n", what);
+}
+
+// Pieces random long rows are made of, with every language's markers but
+// line comments, which would leave the rest of the row to them.
+const char* lex_pieces[] = { " ", " ", " ", "x", "abc", "int", "return",
+  "0x1f", "12.5e3", "1'000", "(", ")", "{", "}", ";", "\"", "'", "\\",
+  "/*", "*/", "R\"x(", ")x\"", "r#\"", "\"#", "'a'", "'a", "#" };
+#define LEX_PIECES ((int)(sizeof(lex_pieces) / sizeof(lex_pieces[0])))
+
+// Rows put above the long row, so it starts in different states.
+const char* lex_above[] = { "", "/* open", "\"open\\", "/* /* nested" };
+
+// Append random pieces to text until it holds at least len chars.
+int lexRandomText(char* text, int len)
+{
+  int n = 0;
+  while (n < len) {
+    const char* p = lex_pieces[rand() % LEX_PIECES];
+    memcpy(&text[n], p, strlen(p));
+    n += strlen(p);
+  }
+  return n;
+}
+
+// Whether every segment of row is highlighted as lexing it whole would.
+int lexSegmentsMatch(erow* row, unsigned int above)
+{
+  struct LexState st;
+  memset(&st, 0, sizeof(st));
+  st.prev_sep = 1;
+  st.state = above;
+  unsigned char* hl = malloc(row->size + 1);
+  lexSpan(row->chars, row->size, row->size, hl, &st);
+  int same = row->nsegs > 1 && row->hl_state == lexRowEnd(st.state);
+  for (int j = 0; same && j < row->nsegs; j++) {
+    struct Segment* seg = segCached(row, j);
+    same = !memcmp(seg->hl, &hl[seg->start], seg->len);
+  }
+  free(hl);
+  return same;
+}
+
+/*
+ * Long rows are lexed one segment at a time, each starting from the state
+ * the one before it ended in. Random rows, before and after edits, must
+ * come out as if lexed in one span.
+ */
+void checkSegments()
+{
+  const char* types[] = { "c", "cpp", "rust" };
+  char* text = malloc(3 * LONG_ROW);
+  srand(1);
+  for (int t = 0; t < 3; t++) {
+    S.syntax = NULL;
+    for (int j = 0; j < (int)HLDB_ENTRIES; j++)
+      if (!strcmp(HLDB[j]->filetype, types[t]))
+        S.syntax = HLDB[j];
+    if (S.syntax == NULL) {
+      printf("FAIL no %s syntax\n", types[t]);
+      exit(1);
+    }
+    for (int n = 0; n < 50; n++) {
+      const char* above = lex_above[rand() % 4];
+      insertRow(0, (char*)above, strlen(above));
+      insertRow(1, text, lexRandomText(text, 2 * LONG_ROW));
+      int same = lexSegmentsMatch(&S.row[1], S.row[0].hl_state);
+      for (int e = 0; same && e < 5; e++) {
+        int len = lexRandomText(text, 1);
+        rowInsertString(&S.row[1], rand() % S.row[1].size, text, len);
+        same = lexSegmentsMatch(&S.row[1], S.row[0].hl_state);
+      }
+      if (!same) {
+        printf("FAIL %s long row %d lexed in segments\n", types[t], n);
+        exit(1);
+      }
+      delRow(1);
+      delRow(0);
+    }
+  }
+  free(text);
+  S.syntax = NULL;
+  printf("ok   long rows lexed in segments\n");
+}
+
+int main()
+{
+  initEditor();
+  checkSegments();
+  if (mkdtemp(repo) == NULL)
+    die("mkdtemp");
+  run("git -C %s init -q && printf 'a\\nb\\nc\\nd\\ne\\nf\\ng\\nh\\n' > %s/f.txt"
+      " && git -C %s add f.txt && git -C %s -c user.name=check"
+      " -c user.email=check@localhost commit -qm init",
+      repo, repo, repo, repo);
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/f.txt", repo);
+  S.journal.suspended++;
+  ares_open(path);
+  waitDiff();
+  if (!S.diff.active) {
+    printf("FAIL no diff against HEAD\n");
+    return 1;
+  }
+  expect("unchanged", "........");
+
+  S.cy = 1;
+  S.cx = 1;
+  insertChar('x');
+  expect("modified row", ".~......");
+
+  S.cy = 4;
+  S.cx = 0;
+  insertNewline();
+  S.cy = 4;
+  insertChar('y');
+  expect("added row", ".~..+....");
+
+  delRow(7);
+  expect("deleted row", ".~..+..-");
+
+  delRow(7);
+  expect("deleted last row", ".~..+.-");
+
+  delRow(4);
+  delRow(1);
+  insertRow(1, "b", 1);
+  expect("edits undone by hand", ".....-");
+
+  // Far from any row in HEAD, edits are marked without a diff.
+  for (int j = 0; j < 3 * DIFF_WINDOW; j++)
+    insertRow(3, "new", 3);
+  diffUpdate();
+  S.cy = 3 + DIFF_WINDOW + DIFF_WINDOW / 2;
+  S.cx = 0;
+  insertChar('z');
+  diffUpdate();
+  int ok = 1;
+  for (int j = 3; j < 3 + 3 * DIFF_WINDOW; j++)
+    ok &= S.row[j].diff == DIFF_ADDED && !S.row[j].diff_stale;
+  printf("%s long added block\n", ok ? "ok  " : "FAIL");
+
+  run("rm -rf %s", repo);
+  return ok ? 0 : 1;
+}